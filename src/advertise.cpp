@@ -78,7 +78,7 @@ namespace libcage {
                 if (it != m_advertised.end() && it->second < advertise_ttl / 2)
                         return;
 
-                m_advertised[id] = time(NULL);
+                m_advertised[id] = cagetime::now();
 
 
                 timer_ptr tm(new timer_advertise);
@@ -218,7 +218,7 @@ namespace libcage {
                 boost::unordered_map<uint160_t, time_t>::iterator it;
                 time_t now;
 
-                now = time(NULL);
+                now = cagetime::now();
 
                 for (it = m_advertised.begin(); it != m_advertised.end();) {
                         time_t diff = now - it->second;
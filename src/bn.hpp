@@ -128,6 +128,25 @@ namespace libcage {
                 void            from_binary(const void *buf, int len);
                 bool            is_zero() const;
 
+                // bit operations, bit 0 is the least significant bit
+                bool            get_bit(int bit) const;
+                void            flip_bit(int bit);
+                int             clz() const;
+                int             popcount() const;
+                int             msb() const;
+
+                // compare the XOR distances of a and b from this number.
+                // returns a negative value if a is closer, a positive
+                // value if b is closer and 0 if they are the same
+                int             cmp_distance(const bn<T, N> &a,
+                                             const bn<T, N> &b) const;
+
+                // the number of leading bits this number and rhs share
+                int             prefix_len(const bn<T, N> &rhs) const;
+
+                // the most significant 64 bits of the XOR distance to rhs
+                uint64_t        distance_prefix(const bn<T, N> &rhs) const;
+
                 std::string     to_string() const;
 
                 size_t          hash_value() const;
@@ -793,6 +812,9 @@ namespace libcage {
                 n = bits / (sizeof(arr[0]) * 8);
                 m = bits % (sizeof(arr[0]) * 8);
 
+                if (n > size)
+                        n = size;
+
                 for (i = size - 1; i >= n; i--)
                         arr[i] = arr[i - n];
 
@@ -831,6 +853,9 @@ namespace libcage {
                 n = bits / (sizeof(arr[0]) * 8);
                 m = bits % (sizeof(arr[0]) * 8);
 
+                if (n > size)
+                        n = size;
+
                 for (i = 0; i < size - n; i++)
                         arr[i] = arr[i + n];
 
@@ -840,7 +865,7 @@ namespace libcage {
                 if (m == 0 || n >= size)
                         return;
 
-                for (i = 0; i < size - n; i++) {
+                for (i = 0; i < size - n - 1; i++) {
                         T msb;
 
                         msb = arr[i + 1];
@@ -929,6 +954,142 @@ namespace libcage {
                 return true;
         }
 
+        template <typename T>
+        inline int
+        bn_clz(T word)
+        {
+                // word must not be 0
+#ifdef __GNUC__
+                if (sizeof(T) <= sizeof(unsigned int))
+                        return __builtin_clz((unsigned int)word) -
+                                (sizeof(unsigned int) - sizeof(T)) * 8;
+                else
+                        return __builtin_clzll((unsigned long long)word) -
+                                (sizeof(unsigned long long) - sizeof(T)) * 8;
+#else
+                int n = 0;
+
+                while (! (word & ((T)1 << (sizeof(T) * 8 - 1)))) {
+                        word <<= 1;
+                        n++;
+                }
+
+                return n;
+#endif // __GNUC__
+        }
+
+        template <typename T>
+        inline int
+        bn_popcount(T word)
+        {
+#ifdef __GNUC__
+                return __builtin_popcountll((unsigned long long)word);
+#else
+                int n = 0;
+
+                for (; word != 0; word &= word - 1)
+                        n++;
+
+                return n;
+#endif // __GNUC__
+        }
+
+        template <typename T, int N>
+        bool
+        bn<T, N>::get_bit(int bit) const
+        {
+                const int bits = sizeof(T) * 8;
+
+                return (m_num[N - 1 - bit / bits] >> (bit % bits)) & 1;
+        }
+
+        template <typename T, int N>
+        void
+        bn<T, N>::flip_bit(int bit)
+        {
+                const int bits = sizeof(T) * 8;
+
+                m_num[N - 1 - bit / bits] ^= (T)1 << (bit % bits);
+        }
+
+        template <typename T, int N>
+        int
+        bn<T, N>::clz() const
+        {
+                for (int i = 0; i < N; i++)
+                        if (m_num[i] != 0)
+                                return i * sizeof(T) * 8 + bn_clz(m_num[i]);
+
+                return N * sizeof(T) * 8;
+        }
+
+        template <typename T, int N>
+        int
+        bn<T, N>::popcount() const
+        {
+                int n = 0;
+
+                for (int i = 0; i < N; i++)
+                        n += bn_popcount(m_num[i]);
+
+                return n;
+        }
+
+        template <typename T, int N>
+        int
+        bn<T, N>::msb() const
+        {
+                // -1 if this is 0
+                return N * sizeof(T) * 8 - 1 - clz();
+        }
+
+        template <typename T, int N>
+        int
+        bn<T, N>::cmp_distance(const bn<T, N> &a, const bn<T, N> &b) const
+        {
+                // the first word where the distances differ decides,
+                // which is the first word where a and b differ
+                for (int i = 0; i < N; i++) {
+                        T da = m_num[i] ^ a.m_num[i];
+                        T db = m_num[i] ^ b.m_num[i];
+
+                        if (da != db)
+                                return da < db ? -1 : 1;
+                }
+
+                return 0;
+        }
+
+        template <typename T, int N>
+        int
+        bn<T, N>::prefix_len(const bn<T, N> &rhs) const
+        {
+                for (int i = 0; i < N; i++) {
+                        T d = m_num[i] ^ rhs.m_num[i];
+
+                        if (d != 0)
+                                return i * sizeof(T) * 8 + bn_clz(d);
+                }
+
+                return N * sizeof(T) * 8;
+        }
+
+        template <typename T, int N>
+        uint64_t
+        bn<T, N>::distance_prefix(const bn<T, N> &rhs) const
+        {
+                const int bits = sizeof(T) * 8;
+                uint64_t  prefix = 0;
+                int       n = 0;
+
+                for (int i = 0; i < N && n + bits <= 64; i++, n += bits) {
+                        prefix <<= bits % 64;
+                        prefix  |= (uint64_t)(m_num[i] ^ rhs.m_num[i]);
+                }
+
+                return prefix << (64 - n) % 64;
+        }
+
         static const char *hexstr[16] = {"0", "1", "2", "3",
                                          "4", "5", "6", "7",
                                          "8", "9", "a", "b",
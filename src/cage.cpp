@@ -160,6 +160,12 @@ namespace libcage {
                                 m_cage.m_dht.recv_store(buf, len, from);
                         }
                         break;
+                case type_dht_store_reply:
+                        if (len >= (int)(sizeof(msg_dht_store_reply) -
+                                         sizeof(uint32_t))) {
+                                m_cage.m_dht.recv_store_reply(buf, len, from);
+                        }
+                        break;
                 case type_dht_find_value:
                         if (len >= (int)(sizeof(msg_dht_find_value) - 
                                          sizeof(uint32_t))) {
@@ -242,6 +248,7 @@ namespace libcage {
                        m_dist_real(0, 1),
                        m_drnd(m_gen, m_dist_real),
                        m_receiver(*this),
+                       m_prefilter(*this),
                        m_peers(m_drnd, m_timer),
                        m_nat(m_rnd, m_udp, m_timer, m_id, m_peers, m_proxy),
                        m_dtun(m_rnd, m_drnd, m_id, m_timer, m_peers, m_nat,
@@ -258,11 +265,51 @@ namespace libcage {
                                    m_peers, m_dtun)
         {
                 m_rdp.set_callback_dgram_out(rdp_output(*this));
+                m_rdp.set_callback_rtt(rdp_rtt(*this));
+                m_rdp.set_callback_loss(rdp_rtt(*this));
         }
 
         cage::~cage()
         {
+                // the receive threads refer to m_nat
+                m_udp.stop_workers();
+        }
+
+        void
+        cage::set_rx_threads(int num)
+        {
+                m_udp.set_rx_threads(num, &m_prefilter);
+        }
+
+        bool
+        cage::udp_prefilter::operator() (udphandler::worker &w,
+                                         const void *buf, int len,
+                                         sockaddr *from, int fromlen)
+        {
+                const msg_hdr *hdr = (const msg_hdr*)buf;
+
+                if (len < (int)sizeof(msg_hdr))
+                        return false;
+
+                if (ntohs(hdr->magic) != MAGIC_NUMBER ||
+                    hdr->ver != CAGE_VERSION) {
+                        return false;
+                }
 
+                // the reply depends only on the node ID and the source
+                // address, so it is sent from this thread
+                if (hdr->type == type_nat_echo) {
+                        if (len == (int)sizeof(msg_nat_echo)) {
+                                msg_nat_echo_reply reply;
+
+                                m_cage.m_nat.make_echo_reply(buf, from, reply);
+                                w.sendto(&reply, sizeof(reply), from, fromlen);
+                        }
+
+                        return false;
+                }
+
+                return true;
         }
 
         void
@@ -418,13 +465,10 @@ namespace libcage {
                 m_proxy.set_callback(&no_action_dgram);
         }
 
-        void
-        cage::put(const void *key, uint16_t keylen,
-                  const void *value, uint16_t valuelen, uint16_t ttl,
-                  bool is_unique)
+        static void
+        key2id(const void *key, uint16_t keylen, uint160_t &id)
         {
                 EVP_MD_CTX      ctx;
-                uint160_t       id;
                 uint32_t        len;
                 uint8_t         buf[20];
 
@@ -435,6 +479,16 @@ namespace libcage {
                 EVP_MD_CTX_cleanup(&ctx);
 
                 id.from_binary(buf, sizeof(buf));
+        }
+
+        void
+        cage::put(const void *key, uint16_t keylen,
+                  const void *value, uint16_t valuelen, uint16_t ttl,
+                  bool is_unique)
+        {
+                uint160_t       id;
+
+                key2id(key, keylen, id);
 
                 if (m_nat.get_state() == node_symmetric) {
                         m_proxy.store(id, key, keylen, value, valuelen, ttl,
@@ -445,30 +499,175 @@ namespace libcage {
                 }
         }
 
+        void
+        cage::put(const void *key, uint16_t keylen,
+                  const void *value, uint16_t valuelen, uint16_t ttl,
+                  dht::callback_store func, bool is_unique)
+        {
+                uint160_t       id;
+
+                key2id(key, keylen, id);
+
+                if (m_nat.get_state() == node_symmetric) {
+                        m_proxy.store(id, key, keylen, value, valuelen, ttl,
+                                      is_unique);
+                        func(0, 0, 0);
+                } else {
+                        m_dht.store(id, key, keylen, value, valuelen, ttl,
+                                    is_unique, func);
+                }
+        }
+
         void
         cage::get(const void *key, uint16_t keylen,
                   dht::callback_find_value func)
         {
-                EVP_MD_CTX      ctx;
-                uint160_t       id;
-                uint32_t        len;
-                uint8_t         buf[20];
+                get(key, keylen, func, lookup_param());
+        }
 
-                EVP_MD_CTX_init(&ctx);
-                EVP_DigestInit_ex(&ctx, EVP_sha1(), NULL);
-                EVP_DigestUpdate(&ctx, key, keylen);
-                EVP_DigestFinal_ex(&ctx, buf, &len);
-                EVP_MD_CTX_cleanup(&ctx);
+        void
+        cage::get(const void *key, uint16_t keylen,
+                  dht::callback_find_value func, const lookup_param &param)
+        {
+                get(key, keylen, func, param, dht::callback_value());
+        }
 
-                id.from_binary(buf, sizeof(buf));
+        void
+        cage::get(const void *key, uint16_t keylen,
+                  dht::callback_find_value func, const lookup_param &param,
+                  dht::callback_value on_value)
+        {
+                uint160_t       id;
+
+                key2id(key, keylen, id);
 
                 if (m_nat.get_state() == node_symmetric) {
-                        m_proxy.get(id, key, keylen, func);
+                        if (on_value) {
+                                proxy_get_func f;
+
+                                f.func     = func;
+                                f.on_value = on_value;
+
+                                m_proxy.get(id, key, keylen, f);
+                        } else {
+                                m_proxy.get(id, key, keylen, func);
+                        }
                 } else {
-                        m_dht.find_value(id, key, keylen, func);
+                        m_dht.find_value(id, key, keylen, func, param,
+                                         on_value);
+                }
+        }
+
+        void
+        cage::put_many(const std::vector<std::string> &keys,
+                       const std::vector<std::string> &values,
+                       uint16_t ttl, bool is_unique)
+        {
+                std::vector<uint160_t> ids(keys.size());
+
+                for (int i = 0; i < (int)keys.size(); i++)
+                        key2id(keys[i].data(), keys[i].size(), ids[i]);
+
+                if (m_nat.get_state() != node_symmetric) {
+                        m_dht.store_many(ids, keys, values, ttl, is_unique);
+                        return;
+                }
+
+                // the proxy stores one value at a time
+                for (int i = 0; i < (int)keys.size(); i++) {
+                        m_proxy.store(ids[i], keys[i].data(), keys[i].size(),
+                                      values[i].data(), values[i].size(), ttl,
+                                      is_unique);
+                }
+        }
+
+        void
+        cage::get_many(const std::vector<std::string> &keys,
+                       dht::callback_find_value_many func,
+                       dht::callback_find_value_all done,
+                       const lookup_param &param)
+        {
+                std::vector<uint160_t> ids(keys.size());
+
+                for (int i = 0; i < (int)keys.size(); i++)
+                        key2id(keys[i].data(), keys[i].size(), ids[i]);
+
+                if (m_nat.get_state() != node_symmetric) {
+                        m_dht.find_value_many(ids, keys, func, done, param);
+                        return;
+                }
+
+                // the proxy looks up one key at a time
+                boost::shared_ptr<proxy_get_many> m(new proxy_get_many);
+
+                m->func     = func;
+                m->done     = done;
+                m->num_left = keys.size();
+                m->results.resize(keys.size());
+
+                if (keys.size() == 0) {
+                        if (done)
+                                done(m->results);
+                        return;
+                }
+
+                for (int i = 0; i < (int)keys.size(); i++) {
+                        proxy_get_many_func f;
+
+                        f.m     = m;
+                        f.index = i;
+
+                        m_proxy.get(ids[i], keys[i].data(), keys[i].size(),
+                                    f);
                 }
         }
 
+        void
+        cage::proxy_get_many_func::operator() (bool result,
+                                               dht::value_set_ptr vset)
+        {
+                if (result)
+                        m->results[index] = vset;
+
+                if (m->func)
+                        m->func(index, result, vset);
+
+                if (--m->num_left == 0 && m->done)
+                        m->done(m->results);
+        }
+
+        void
+        cage::proxy_get_func::operator() (bool result, dht::value_set_ptr vset)
+        {
+                if (result && vset) {
+                        BOOST_FOREACH(const dht::value_t &v, *vset) {
+                                on_value(v);
+                        }
+                }
+
+                func(result, vset);
+        }
+
+        void
+        cage::set_lookup_param(const lookup_param &param)
+        {
+                m_dht.set_lookup_param(param);
+                m_dtun.set_lookup_param(param);
+        }
+
+        bool
+        cage::set_store_log(const std::string &dir)
+        {
+                boost::shared_ptr<sstore_log> log(new sstore_log(dir));
+
+                if (! log->open())
+                        return false;
+
+                m_dht.set_sstore(log);
+
+                return true;
+        }
+
         void
         cage::join_func::operator() (std::vector<cageaddr> &nodes)
         {
@@ -519,6 +718,20 @@ namespace libcage {
                 }
         }
 
+        void
+        cage::rdp_rtt::operator() (id_ptr id, uint32_t usec)
+        {
+                m_cage.m_dht.add_rtt(*id, usec);
+                m_cage.m_dtun.add_rtt(*id, usec);
+        }
+
+        void
+        cage::rdp_rtt::operator() (id_ptr id)
+        {
+                m_cage.m_dht.add_loss(*id);
+                m_cage.m_dtun.add_loss(*id);
+        }
+
 #ifdef DEBUG_NAT
         void
         cage::test_natdetect()
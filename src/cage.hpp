@@ -64,8 +64,37 @@ namespace libcage {
                 void            put(const void *key, uint16_t keylen,
                                     const void *value, uint16_t valuelen,
                                     uint16_t ttl, bool is_unique = false);
+                // func is called with the number of replicas which
+                // acknowledged the value, the number of replicas and the
+                // usec it took. behind a symmetric NAT the proxy stores
+                // the value, and func is called with 0 replicas when it
+                // was sent
+                void            put(const void *key, uint16_t keylen,
+                                    const void *value, uint16_t valuelen,
+                                    uint16_t ttl, dht::callback_store func,
+                                    bool is_unique = false);
+                // values[i] is stored for keys[i]
+                void            put_many(const std::vector<std::string> &keys,
+                                         const std::vector<std::string> &values,
+                                         uint16_t ttl, bool is_unique = false);
                 void            get(const void *key, uint16_t keylen,
                                     dht::callback_find_value func);
+                void            get(const void *key, uint16_t keylen,
+                                    dht::callback_find_value func,
+                                    const lookup_param &param);
+                // on_value is called with each value as it arrives
+                void            get(const void *key, uint16_t keylen,
+                                    dht::callback_find_value func,
+                                    const lookup_param &param,
+                                    dht::callback_value on_value);
+                // func is called for each key with its index in keys,
+                // then done with the values of all keys, null for the
+                // ones not found
+                void            get_many(const std::vector<std::string> &keys,
+                                         dht::callback_find_value_many func,
+                                         dht::callback_find_value_all done,
+                                         const lookup_param &param =
+                                         lookup_param());
                 void            join(std::string host, int port,
                                      callback_join func);
 
@@ -99,6 +128,94 @@ namespace libcage {
 
                 void            print_state() const;
 
+                // read the port with num sockets, all but one on their
+                // own thread. see udphandler::set_rx_threads().
+                // must be called before open()
+                void            set_rx_threads(int num);
+
+                // see udphandler::set_io_uring().
+                // must be called before open()
+                bool            set_io_uring(bool enable)
+                {
+                        return m_udp.set_io_uring(enable);
+                }
+
+                // see udphandler::set_tx_queue()
+                void            set_tx_queue(bool enable)
+                {
+                        m_udp.set_tx_queue(enable);
+                }
+
+                const udphandler::tx_stats&     get_tx_stats() const
+                {
+                        return m_udp.get_tx_stats();
+                }
+
+                // the parallelism, width and termination of lookups.
+                // fields left 0 or lookup_default are not changed.
+                // a parameter given to get() overrides them for the call
+                void            set_lookup_param(const lookup_param &param);
+
+                const lookup_stats&     get_find_value_stats() const
+                {
+                        return m_dht.get_find_value_stats();
+                }
+
+                const lookup_stats&     get_find_node_stats() const
+                {
+                        return m_dht.get_find_node_stats();
+                }
+
+                // cache the results of get() up to bytes, 0 disables it.
+                // a hit calls the callback before get() returns.
+                // lookup_param::use_cache = false bypasses it for a call
+                void            set_cache_size(size_t bytes)
+                {
+                        m_dht.set_cache_size(bytes);
+                }
+
+                const dht::cache_stats& get_cache_stats() const
+                {
+                        return m_dht.get_cache_stats();
+                }
+
+                // bound the memory of the values stored for the other
+                // nodes, see dht::set_store_limit()
+                void            set_store_limit(size_t bytes,
+                                                size_t src_bytes = 0)
+                {
+                        m_dht.set_store_limit(bytes, src_bytes);
+                }
+
+                const dht::store_stats& get_store_stats() const
+                {
+                        return m_dht.get_store_stats();
+                }
+
+                // copy the results of get() to the closest node on the
+                // lookup path which did not have them, for hot keys
+                void            set_path_cache(bool flag)
+                {
+                        m_dht.set_path_cache(flag);
+                }
+
+                // keep the stored values in a log in dir, and store the
+                // values of the last run kept in it in this node. see
+                // sstore_log
+                bool            set_store_log(const std::string &dir);
+
+                // send at most bytes per second of the stored values to
+                // the closest nodes, see dht::set_restore_rate()
+                void            set_restore_rate(size_t bytes)
+                {
+                        m_dht.set_restore_rate(bytes);
+                }
+
+                const dht::restore_stats&       get_restore_stats() const
+                {
+                        return m_dht.get_restore_stats();
+                }
+
 
         private:
                 class udp_receiver : public udphandler::callback {
@@ -114,6 +231,20 @@ namespace libcage {
                         cage   &m_cage;
                 };
 
+                // runs on the receive threads. drops malformed datagrams
+                // and answers nat echo requests
+                class udp_prefilter : public udphandler::worker_callback {
+                public:
+                        virtual bool operator() (udphandler::worker &w,
+                                                 const void *buf, int len,
+                                                 sockaddr *from, int fromlen);
+
+                        udp_prefilter(cage &c) : m_cage(c) {}
+
+                private:
+                        cage   &m_cage;
+                };
+
                 class join_func {
                 public:
                         void operator() (std::vector<cageaddr> &nodes);
@@ -122,6 +253,31 @@ namespace libcage {
                         cage   *p_cage;
                 };
 
+                // a proxy returns all the values at once
+                class proxy_get_func {
+                public:
+                        void operator() (bool result, dht::value_set_ptr vset);
+
+                        dht::callback_find_value        func;
+                        dht::callback_value             on_value;
+                };
+
+                class proxy_get_many {
+                public:
+                        std::vector<dht::value_set_ptr> results;
+                        dht::callback_find_value_many   func;
+                        dht::callback_find_value_all    done;
+                        int                             num_left;
+                };
+
+                class proxy_get_many_func {
+                public:
+                        void operator() (bool result, dht::value_set_ptr vset);
+
+                        boost::shared_ptr<proxy_get_many>       m;
+                        int                                     index;
+                };
+
                 class rdp_output {
                 public:
                         cage &m_cage;
@@ -131,6 +287,17 @@ namespace libcage {
                         void operator() (id_ptr id_dst, packetbuf_ptr pbuf);
                 };
 
+                // RTT samples and losses observed by rdp
+                class rdp_rtt {
+                public:
+                        cage &m_cage;
+
+                        rdp_rtt(cage &c) : m_cage(c) { }
+
+                        void operator() (id_ptr id, uint32_t usec);
+                        void operator() (id_ptr id);
+                };
+
                 class gen_id {
                 public:
                         gen_id(uint160_t &id)
@@ -159,6 +326,7 @@ namespace libcage {
                 timer           m_timer;
                 uint160_t       m_id;
                 udp_receiver    m_receiver;
+                udp_prefilter   m_prefilter;
                 peers           m_peers;
                 natdetector     m_nat;
                 dtun            m_dtun;
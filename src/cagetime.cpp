@@ -31,6 +31,69 @@
 
 #include "cagetime.hpp"
 
+namespace libcage {
+        uint64_t cagetime::m_cached    = 0;
+        uint64_t cagetime::m_offset    = 0;
+        bool     cagetime::m_is_cached = false;
+
+        cagetime::dispatch::dispatch() : m_is_outer(! m_is_cached)
+        {
+                if (m_is_outer) {
+                        m_cached    = read_clock();
+                        m_is_cached = true;
+                }
+        }
+
+        cagetime::dispatch::~dispatch()
+        {
+                if (m_is_outer)
+                        m_is_cached = false;
+        }
+
+        uint64_t
+        cagetime::now_usec()
+        {
+                if (m_is_cached)
+                        return m_cached;
+
+                return read_clock();
+        }
+
+        uint64_t
+        cagetime::read_clock()
+        {
+                uint64_t usec;
+
+#if defined(WIN32) || !defined(CLOCK_MONOTONIC)
+                timeval tval;
+
+                gettimeofday(&tval, NULL);
+
+                usec = (uint64_t)tval.tv_sec * 1000000 + tval.tv_usec;
+#else
+                timespec ts;
+
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+
+                usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+                if (m_offset == 0) {
+                        timeval tval;
+
+                        gettimeofday(&tval, NULL);
+
+                        m_offset  = (uint64_t)tval.tv_sec * 1000000 +
+                                    tval.tv_usec;
+                        m_offset -= usec;
+                }
+
+                usec += m_offset;
+#endif // WIN32
+
+                return usec;
+        }
+}
+
 #ifdef WIN32
 namespace libcage{
         int
@@ -47,6 +47,9 @@
   #include <sys/time.h>
 #endif // WIN32
 
+#include <stdint.h>
+#include <time.h>
+
 namespace libcage {
 #ifdef WIN32
         struct timezone 
@@ -58,8 +61,24 @@ namespace libcage {
         int gettimeofday(struct timeval *tv, struct timezone *tz);
 #endif // WIN32
 
+        // cagetime reads a monotonic clock which is cached while a
+        // callback of the event loop runs, so the protocol code can ask
+        // for the time in its loops without a system call per item.
+        // the clock starts at the wall clock time of the first read, so
+        // values in seconds can be used in place of time(NULL)
         class cagetime {
         public:
+                // caches the clock during an event loop callback.
+                // libcage's callbacks put one of these at their top
+                class dispatch {
+                public:
+                        dispatch();
+                        ~dispatch();
+
+                private:
+                        bool    m_is_outer;
+                };
+
                 cagetime()
                 {
                         update();
@@ -67,7 +86,10 @@ namespace libcage {
 
                 void update()
                 {
-                        gettimeofday(&m_tval, NULL);
+                        uint64_t usec = now_usec();
+
+                        m_tval.tv_sec  = (long)(usec / 1000000);
+                        m_tval.tv_usec = (long)(usec % 1000000);
                 }
 
                 double operator- (cagetime& rhs)
@@ -82,8 +104,17 @@ namespace libcage {
                         return sec1 - sec2;
                 }
 
+                static uint64_t now_usec();
+                static time_t   now() { return (time_t)(now_usec() / 1000000); }
+
         private:
                 timeval m_tval;
+
+                static uint64_t read_clock();
+
+                static uint64_t m_cached;
+                static uint64_t m_offset;
+                static bool     m_is_cached;
         };
 }
 
@@ -84,6 +84,35 @@ namespace libcage {
                 boost::variant<in_ptr, in6_ptr> saddr;
         };
 
+        // how an iterative lookup decides to finish
+        enum lookup_policy {
+                lookup_default,    // the policy of the dht or dtun
+                lookup_exhaustive, // when the k closest nodes replied
+                                   // or timed out
+                lookup_stall,      // also when alpha replies in a row
+                                   // found no closer node
+        };
+
+        // parameters of an iterative lookup. 0 and lookup_default mean
+        // the value of the dht or dtun
+        class lookup_param {
+        public:
+                int             alpha;  // requests in flight
+                int             k;      // nodes kept and returned
+                lookup_policy   policy;
+                bool            use_cache; // find_value may answer from
+                                           // the value cache, per call
+                bool            first_set; // find_value completes on the
+                                           // first node which sent all
+                                           // its values, per call
+
+                lookup_param(int a = 0, int n = 0,
+                             lookup_policy p = lookup_default,
+                             bool cache = true, bool first = false)
+                        : alpha(a), k(n), policy(p), use_cache(cache),
+                          first_set(first) { }
+        };
+
         static const uint16_t MAGIC_NUMBER = 0xbabe;
         static const uint8_t  CAGE_VERSION = 0;
 
@@ -122,6 +151,7 @@ namespace libcage {
         static const uint8_t type_dht_find_value          = 0x45;
         static const uint8_t type_dht_find_value_reply    = 0x46;
         static const uint8_t type_dht_store               = 0x47;
+        static const uint8_t type_dht_store_reply         = 0x48;
         static const uint8_t type_proxy                   = 0x80;
         static const uint8_t type_proxy_register          = 0x81;
         static const uint8_t type_proxy_register_reply    = 0x82;
@@ -142,6 +172,16 @@ namespace libcage {
         static const uint8_t get_by_rdp = 0xb1;
 
         static const uint8_t dht_flag_unique = 0x01;
+        static const uint8_t dht_flag_cached = 0x02; // a path cached copy
+        static const uint8_t dht_flag_more   = 0x04; // another record
+                                                     // follows in the stream
+        static const uint8_t dht_flag_ack    = 0x08; // reply by
+                                                     // msg_dht_store_reply
+
+        // the result of a store, in msg_dht_store_reply and at the end
+        // of a stream of msg_dht_rdp_store
+        static const uint8_t dht_store_ok      = 0x00;
+        static const uint8_t dht_store_refused = 0x01; // over a limit
 
         static const uint8_t dht_get_next = 0xc0;
 
@@ -340,7 +380,9 @@ namespace libcage {
                 // data[] is nodes when 0
                 uint8_t         flag;
 
-                uint8_t         padding[3];
+                uint8_t         padding;
+                uint16_t        ttl; // remaining ttl of the value, 0 if
+                                     // unknown
                 uint32_t        data[1];
         };
 
@@ -356,6 +398,17 @@ namespace libcage {
                 uint32_t        data[1];
         };
 
+        // acknowledges a msg_dht_store with dht_flag_ack. the key is
+        // echoed to tell the stores of the same id apart
+        struct msg_dht_store_reply {
+                msg_hdr         hdr;
+                uint8_t         id[CAGE_ID_LEN];
+                uint16_t        keylen;
+                uint8_t         status; // dht_store_ok or refused
+                uint8_t         reserved;
+                uint32_t        key[1];
+        };
+
         struct msg_dht_rdp_store {
                 uint8_t         id[CAGE_ID_LEN];
                 uint8_t         from[CAGE_ID_LEN];
@@ -374,7 +427,8 @@ namespace libcage {
 
         struct msg_dht_rdp_get_reply {
                 uint16_t        valuelen;
-                uint16_t        reserved;
+                uint16_t        ttl; // remaining ttl of the value, 0 if
+                                     // unknown
         };
 
         struct msg_dgram {
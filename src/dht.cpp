@@ -33,52 +33,31 @@
 
 #include "ping.hpp"
 
+#include <algorithm>
+
 #include <boost/foreach.hpp>
 
 namespace libcage {
         const int       dht::num_find_node       = 10;
         const int       dht::max_query           = 6;
         const int       dht::query_timeout       = 3;
+        const int       dht::late_wait           = 500000; // usec
         const int       dht::restore_interval    = 120;
+        const int       dht::restore_tick        = 1;
         const int       dht::slow_timer_interval = 600;
         const int       dht::fast_timer_interval = 60;
+        const int       dht::compact_interval    = 2;
         const int       dht::original_put_num    = 3;
         const int       dht::recvd_value_timeout = 3;
         const uint16_t  dht::rdp_store_port      = 100;
         const uint16_t  dht::rdp_get_port        = 101;
         const time_t    dht::rdp_timeout         = 30;
-
-        size_t
-        hash_value(const dht::_key &k)
-        {
-                size_t    h   = 0;
-                uint32_t *p   = (uint32_t*)k.key.get();
-                int       len = k.keylen / 4;
-
-                for (int i = 0; i < len; i++)
-                        boost::hash_combine(h, p[i]);
-
-                for (int j = len * 4; j < k.keylen; j++)
-                        boost::hash_combine(h, k.key[j]);
-
-                return h;
-        }
-
-        size_t
-        hash_value(const dht::stored_data &sdata)
-        {
-                size_t    h   = 0;
-                uint32_t *p   = (uint32_t*)sdata.value.get();
-                int       len = sdata.valuelen / 4;
-
-                for (int i = 0; i < len; i++)
-                        boost::hash_combine(h, p[i]);
-
-                for (int j = len * 4; j < sdata.valuelen; j++)
-                        boost::hash_combine(h, sdata.value[j]);
-
-                return h;
-        }
+        const uint16_t  dht::path_cache_ttl      = 600;
+        const int       dht::path_cache_max      = 16 * 1024 * 1024; // bytes
+        const int       dht::many_alpha          = 1;
+        const int       dht::store_stream_max    = 256 * 1024;
+        const int       dht::store_ack_timeout   = 10;
+        const int       dht::sdata_overhead      = 416; // of the containers
 
         dht::dht(rand_uint &rnd, rand_real &drnd, const uint160_t &id, timer &t,
                  peers &p, const natdetector &nat, udphandler &udp, dtun &dt,
@@ -97,9 +76,25 @@ namespace libcage {
                 m_last_restore(0),
                 m_slow_timer_dht(*this),
                 m_fast_timer_dht(*this),
+                m_compact_timer_dht(*this),
+                m_restore_timer_dht(*this),
                 m_join(*this),
                 m_sync(*this),
-                m_is_use_rdp(true)
+                m_is_use_rdp(true),
+                m_param(max_query, num_find_node, lookup_exhaustive),
+                m_cache_max(0),
+                m_is_path_cache(false),
+                m_store_max(0),
+                m_store_src_max(0),
+                m_num_cached(0),
+                m_cached_bytes(0),
+                m_sstore(new sstore_mem),
+                m_restore_rate(0),
+                m_restore_tokens(0),
+                m_restore_time(cagetime::now_usec()),
+                m_restore_start(0),
+                m_restore_bucket(0),
+                m_restore_buckets(0)
         {
                 rdp_recv_store_func func_recv(*this);
                 rdp_recv_get_func   func_get(*this);
@@ -138,214 +133,592 @@ namespace libcage {
 
         }
 
-        void
+        // false if the value was refused
+        bool
         dht::add_sdata(dht::stored_data &sdata, bool is_origin)
         {
-                _id  i;
-                _key k;
-
-                i.id     = sdata.id;
-                k.key    = sdata.key;
-                k.keylen = sdata.keylen;
+                stored_map::iterator it1;
+                sdata_map::iterator  it2;
+                sdata_set::iterator  it3;
+                sval_ptr val = new_sval(sdata);
 
+                it1 = m_stored.find(*sdata.id);
+                if (it1 == m_stored.end()) {
+                        if (! is_origin && is_over_quota(sdata))
+                                return false;
 
-                boost::unordered_map<_id, sdata_map>::iterator it1;
+                        skey_ptr key = skey::construct(*sdata.id,
+                                                       sdata.key.get(),
+                                                       sdata.keylen);
+                        sdata_map &m = m_stored[*sdata.id];
 
-                it1 = m_stored.find(i);
-                if (it1 == m_stored.end()) {
-                        m_stored[i][k].insert(sdata);
-                        return;
+                        m.push_back(std::make_pair(key, sdata_set()));
+                        return insert_sdata(m.back().second, key, val);
                 }
 
+                it2 = find_key(it1->second, sdata.key.get(), sdata.keylen);
+                if (it2 == it1->second.end()) {
+                        if (! is_origin && is_over_quota(sdata))
+                                return false;
 
-                sdata_map::iterator it2;
+                        skey_ptr key = skey::construct(*sdata.id,
+                                                       sdata.key.get(),
+                                                       sdata.keylen);
+                        sdata_map &m = it1->second;
 
-                it2 = it1->second.find(k);
-                if (it2 == it1->second.end()) {
-                        m_stored[i][k].insert(sdata);
-                        return;
+                        m.push_back(std::make_pair(key, sdata_set()));
+                        return insert_sdata(m.back().second, key, val);
                 }
 
-
-                sdata_set::iterator it3;
+                skey_ptr key = it2->first;
 
                 if (sdata.is_unique) {
                         if (it2->second.size() == 0) {
-                                it2->second.insert(sdata);
-                                return;
+                                if (! is_origin && is_over_quota(sdata))
+                                        return false;
+
+                                return insert_sdata(it2->second, key, val);
                         }
 
                         if (it2->second.size() > 1)
-                                return;
+                                return false;
 
                         it3 = it2->second.begin();
-                        if (*it3->src == *sdata.src && it3->is_unique) {
-                                if (*it3 == sdata) {
-                                        it3->ttl         = sdata.ttl;
-                                        it3->original    = sdata.original;
-                                        it3->stored_time = sdata.stored_time;
+                        if ((*it3)->get_src() == *sdata.src &&
+                            (*it3)->is_unique) {
+                                if (**it3 == *val) {
+                                        (*it3)->ttl         = sdata.ttl;
+                                        (*it3)->original    = sdata.original;
+                                        (*it3)->stored_time = sdata.stored_time;
+                                        update_expiry(key, **it3, false);
+                                        m_sstore->update(*key, **it3);
+                                        return true;
                                 } else {
+                                        size_t freed;
+
+                                        freed = sdata_bytes(key->get_keylen(),
+                                                            (*it3)->get_valuelen());
+                                        if (! is_origin &&
+                                            is_over_quota(sdata, freed))
+                                                return false;
+
+                                        sub_store_stats(*key, **it3);
+                                        m_sstore->erase(*key, **it3);
                                         it2->second.erase(it3);
-                                        it2->second.insert(sdata);
+                                        return insert_sdata(it2->second,
+                                                            key, val);
                                 }
                         }
 
-                        return;
+                        return false;
                 }
 
                 it3 = it2->second.begin();
-                if (it2->second.size() == 1 && it3->is_unique) {
-                        if (*it3->src != *sdata.src || ! sdata.is_unique)
-                                return;
+                if (it2->second.size() == 1 && (*it3)->is_unique) {
+                        if ((*it3)->get_src() != *sdata.src || ! sdata.is_unique)
+                                return false;
 
-                        if (*it3 == sdata) {
-                                it3->ttl         = sdata.ttl;
-                                it3->original    = sdata.original;
-                                it3->stored_time = sdata.stored_time;
+                        if (**it3 == *val) {
+                                (*it3)->ttl         = sdata.ttl;
+                                (*it3)->original    = sdata.original;
+                                (*it3)->stored_time = sdata.stored_time;
+                                update_expiry(key, **it3, false);
+                                m_sstore->update(*key, **it3);
                         } else {
+                                size_t freed;
+
+                                freed = sdata_bytes(key->get_keylen(),
+                                                    (*it3)->get_valuelen());
+                                if (! is_origin && is_over_quota(sdata, freed))
+                                        return false;
+
+                                sub_store_stats(*key, **it3);
+                                m_sstore->erase(*key, **it3);
                                 it2->second.erase(it3);
-                                it2->second.insert(sdata);
+                                return insert_sdata(it2->second, key, val);
                         }
 
-                        return;
+                        return true;
                 }
 
-                it3 = it2->second.find(sdata);
+                it3 = it2->second.find(val);
                 if (it3 == it2->second.end()) {
-                        it2->second.insert(sdata);
-                        return;
+                        if (! is_origin && is_over_quota(sdata))
+                                return false;
+
+                        return insert_sdata(it2->second, key, val);
                 }
 
-                if (*it3->src != *sdata.src)
-                        return;
+                if ((*it3)->get_src() != *sdata.src)
+                        return false;
 
-                it3->ttl         = sdata.ttl;
-                it3->stored_time = sdata.stored_time;
+                (*it3)->ttl         = sdata.ttl;
+                (*it3)->stored_time = sdata.stored_time;
+                update_expiry(key, **it3, false);
 
                 if (is_origin)
-                        it3->original = sdata.original;
+                        (*it3)->original = sdata.original;
+
+                m_sstore->update(*key, **it3);
+
+                return true;
         }
 
         void
         dht::erase_sdata(dht::stored_data &sdata)
         {
-                _id  i;
-                _key k;
-
-                i.id     = sdata.id;
-                k.key    = sdata.key;
-                k.keylen = sdata.keylen;
+                stored_map::iterator it1;
+                sdata_map::iterator  it2;
+                sdata_set::iterator  it3;
 
+                it1 = m_stored.find(*sdata.id);
+                if (it1 == m_stored.end())
+                        return;
 
-                boost::unordered_map<_id, sdata_map>::iterator it1;
+                it2 = find_key(it1->second, sdata.key.get(), sdata.keylen);
+                if (it2 == it1->second.end())
+                        return;
 
-                it1 = m_stored.find(i);
-                if (it1 == m_stored.end())
+                it3 = it2->second.find(new_sval(sdata));
+                if (it3 == it2->second.end() ||
+                    (*it3)->get_src() != *sdata.src)
                         return;
 
+                sub_store_stats(*it2->first, **it3);
+                m_sstore->erase(*it2->first, **it3);
+                it2->second.erase(it3);
 
-                sdata_map::iterator it2;
+                if (it2->second.size() == 0)
+                        it1->second.erase(it2);
 
-                it2 = it1->second.find(k);
-                if (it2 == it1->second.end())
-                        return;
+                if (it1->second.size() == 0)
+                        m_stored.erase(it1);
+        }
 
+        // the last thing to do, the eviction may erase s. false if val
+        // itself was evicted
+        bool
+        dht::insert_sdata(sdata_set &s, skey_ptr key, sval_ptr val)
+        {
+                add_expiry(key, *val, false);
+                s.insert(val);
+                add_store_stats(*key, *val);
 
-                sdata_set::iterator it3;
+                // a value loaded from the sstore is in it
+                if (val->pos == 0)
+                        m_sstore->add(*key, *val);
 
-                it3 = it2->second.find(sdata);
-                if (*it3->src != *sdata.src)
-                        return;
+                trim_store();
+
+                return is_stored(*key, val);
+        }
+
+        // about the heap a value takes, measured by test/store_bench
+        size_t
+        dht::sdata_bytes(uint16_t keylen, uint16_t valuelen)
+        {
+                return sdata_overhead + keylen + valuelen;
+        }
+
+        sval_ptr
+        dht::new_sval(const stored_data &sdata)
+        {
+                uint160_t src(0);
+                sval_ptr  val;
+
+                if (sdata.src)
+                        src = *sdata.src;
+
+                val = sval::construct(sdata.value.get(), sdata.valuelen, src);
+
+                val->stored_time = sdata.stored_time;
+                val->ttl         = sdata.ttl;
+                val->original    = sdata.original;
+                val->is_unique   = sdata.is_unique;
+
+                return val;
+        }
+
+        void
+        dht::to_sdata(const skey &key, const sval &val, stored_data &sdata)
+        {
+                sdata.key   = boost::shared_array<char>(new char[key.get_keylen()]);
+                sdata.value = boost::shared_array<char>(new char[val.get_valuelen()]);
+
+                memcpy(sdata.key.get(), key.get_key(), key.get_keylen());
+                memcpy(sdata.value.get(), val.get_value(), val.get_valuelen());
+
+                sdata.keylen      = key.get_keylen();
+                sdata.valuelen    = val.get_valuelen();
+                sdata.id          = id_ptr(new uint160_t(key.get_id()));
+                sdata.src         = id_ptr(new uint160_t(val.get_src()));
+                sdata.is_unique   = val.is_unique;
+                sdata.stored_time = val.stored_time;
+                sdata.original    = val.original;
+                sdata.ttl         = val.ttl;
+        }
+
+        dht::sdata_map::iterator
+        dht::find_key(sdata_map &m, const void *key, uint16_t keylen)
+        {
+                sdata_map::iterator it;
+
+                for (it = m.begin(); it != m.end(); ++it) {
+                        if (it->first->is_key(key, keylen))
+                                break;
+                }
+
+                return it;
+        }
+
+        void
+        dht::add_store_stats(const skey &key, const sval &val)
+        {
+                size_t bytes = sdata_bytes(key.get_keylen(),
+                                           val.get_valuelen());
+
+                m_store_stats.bytes += bytes;
+                m_store_stats.items++;
+                m_src_bytes[val.get_src()] += bytes;
+
+                if (m_store_max > 0)
+                        m_store_dist[key.get_id() ^ m_id]++;
+        }
+
+        void
+        dht::sub_store_stats(const skey &key, const sval &val)
+        {
+                std::map<uint160_t, int>::iterator it_dist;
+                size_t bytes = sdata_bytes(key.get_keylen(),
+                                           val.get_valuelen());
+
+                m_store_stats.bytes -= bytes;
+                m_store_stats.items--;
+
+                sub_src_bytes(val.get_src(), bytes);
+
+                it_dist = m_store_dist.find(key.get_id() ^ m_id);
+                if (it_dist != m_store_dist.end()) {
+                        it_dist->second--;
+                        if (it_dist->second == 0)
+                                m_store_dist.erase(it_dist);
+                }
+        }
+
+        void
+        dht::sub_src_bytes(const uint160_t &src, size_t bytes)
+        {
+                boost::unordered_map<uint160_t, size_t>::iterator it;
+
+                it = m_src_bytes.find(src);
+                if (it != m_src_bytes.end()) {
+                        it->second -= bytes;
+                        if (it->second == 0)
+                                m_src_bytes.erase(it);
+                }
+        }
+
+        bool
+        dht::is_over_quota(const stored_data &sdata, size_t freed)
+        {
+                boost::unordered_map<uint160_t, size_t>::iterator it;
+                size_t bytes = sdata_bytes(sdata.keylen, sdata.valuelen);
+
+                if (m_store_src_max == 0)
+                        return false;
+
+                it = m_src_bytes.find(*sdata.src);
+                if (it != m_src_bytes.end())
+                        bytes += it->second - freed;
+
+                if (bytes <= m_store_src_max)
+                        return false;
+
+                m_store_stats.num_rejected++;
+
+                return true;
+        }
+
+        // the path cached values count in the limit, and go first
+        void
+        dht::trim_store()
+        {
+                while (m_store_max > 0 &&
+                       m_store_stats.bytes + m_cached_bytes > m_store_max) {
+                        if (m_cached_bytes > 0)
+                                evict_cached();
+                        else if (! evict_sdata())
+                                break;
+                }
+        }
+
+        void
+        dht::evict_cached()
+        {
+                stored_map::iterator it1 = m_cached.begin();
+                sdata_map::iterator  it2 = it1->second.begin();
+                sdata_set::iterator  it3 = it2->second.begin();
+                size_t bytes;
+
+                bytes = sdata_bytes(it2->first->get_keylen(),
+                                    (*it3)->get_valuelen());
+
+                m_num_cached--;
+                m_cached_bytes -= bytes;
+                sub_src_bytes((*it3)->get_src(), bytes);
+                m_store_stats.num_evicted++;
 
-                it2->second.erase(sdata);
+                it2->second.erase(it3);
 
                 if (it2->second.size() == 0)
                         it1->second.erase(it2);
 
+                if (it1->second.size() == 0)
+                        m_cached.erase(it1);
+        }
+
+        // false if only the values put by this node are left. they are
+        // not evicted, restore puts them again
+        bool
+        dht::evict_sdata()
+        {
+                std::map<uint160_t, int>::reverse_iterator it_dist;
+                stored_map::iterator it1;
+                sdata_map::iterator  it2, it2_old;
+                sdata_set::iterator  it3, it3_old;
+                uint160_t            id;
+
+                // the farthest id, the oldest value of it
+                for (it_dist = m_store_dist.rbegin();
+                     it_dist != m_store_dist.rend(); ++it_dist) {
+                        id = it_dist->first ^ m_id;
+
+                        it1 = m_stored.find(id);
+                        if (it1 == m_stored.end())
+                                continue;
+
+                        it2_old = it1->second.end();
+
+                        for (it2 = it1->second.begin();
+                             it2 != it1->second.end(); ++it2) {
+                                for (it3 = it2->second.begin();
+                                     it3 != it2->second.end(); ++it3) {
+                                        if ((*it3)->original > 0)
+                                                continue;
+
+                                        if (it2_old == it1->second.end() ||
+                                            (*it3)->stored_time <
+                                            (*it3_old)->stored_time) {
+                                                it2_old = it2;
+                                                it3_old = it3;
+                                        }
+                                }
+                        }
+
+                        if (it2_old != it1->second.end())
+                                break;
+                }
+
+                if (it_dist == m_store_dist.rend())
+                        return false;
+
+                sub_store_stats(*it2_old->first, **it3_old);
+                m_sstore->erase(*it2_old->first, **it3_old);
+                it2_old->second.erase(it3_old);
+                m_store_stats.num_evicted++;
+
+                if (it2_old->second.size() == 0)
+                        it1->second.erase(it2_old);
+
                 if (it1->second.size() == 0)
                         m_stored.erase(it1);
+
+                return true;
         }
 
         void
-        dht::insert2recvd_sdata(stored_data &sdata, id_ptr id)
+        dht::set_store_limit(size_t bytes, size_t src_bytes)
         {
-                _id  i;
-                _key k;
+                // the ids by distance are only for the eviction
+                if (bytes == 0) {
+                        m_store_dist.clear();
+                } else if (m_store_max == 0) {
+                        stored_map::iterator it1;
+                        sdata_map::iterator  it2;
+
+                        for (it1 = m_stored.begin(); it1 != m_stored.end();
+                             ++it1) {
+                                for (it2 = it1->second.begin();
+                                     it2 != it1->second.end(); ++it2) {
+                                        m_store_dist[it1->first ^ m_id] +=
+                                                it2->second.size();
+                                }
+                        }
+                }
 
-                i.id     = sdata.id;
-                k.key    = sdata.key;
-                k.keylen = sdata.keylen;
+                m_store_max     = bytes;
+                m_store_src_max = src_bytes;
 
+                trim_store();
+        }
 
-                boost::unordered_map<_id, sdata_map>::iterator it1;
+        void
+        dht::set_sstore(sstore_ptr s)
+        {
+                stored_map::iterator it1;
+                sdata_map::iterator  it2;
+                sdata_set::iterator  it3;
+                sstore_load_func     func;
 
-                it1 = m_stored.find(i);
-                if (it1 == m_stored.end())
-                        return;
+                for (it1 = m_stored.begin(); it1 != m_stored.end(); ++it1) {
+                        for (it2 = it1->second.begin();
+                             it2 != it1->second.end(); ++it2) {
+                                for (it3 = it2->second.begin();
+                                     it3 != it2->second.end(); ++it3) {
+                                        (*it3)->pos = 0;
+                                }
+                        }
+                }
+
+                m_sstore = s;
 
+                func.p_dht = this;
+                m_sstore->load(func);
+
+                // the values stored before, not in s
+                for (it1 = m_stored.begin(); it1 != m_stored.end(); ++it1) {
+                        for (it2 = it1->second.begin();
+                             it2 != it1->second.end(); ++it2) {
+                                for (it3 = it2->second.begin();
+                                     it3 != it2->second.end(); ++it3) {
+                                        if ((*it3)->pos == 0)
+                                                m_sstore->add(*it2->first,
+                                                              **it3);
+                                }
+                        }
+                }
+        }
 
+        void
+        dht::load_sdata(const uint160_t &id, const void *key, uint16_t keylen,
+                        sval_ptr val)
+        {
                 sdata_map::iterator it2;
+                sdata_set::iterator it3;
+                sdata_map &m = m_stored[id];
 
-                it2 = it1->second.find(k);
-                if (it2 == it1->second.end())
+                it2 = find_key(m, key, keylen);
+                if (it2 == m.end()) {
+                        skey_ptr k = skey::construct(id, key, keylen);
+
+                        m.push_back(std::make_pair(k, sdata_set()));
+                        insert_sdata(m.back().second, k, val);
                         return;
+                }
 
+                it3 = it2->second.find(val);
+                if (it3 == it2->second.end()) {
+                        insert_sdata(it2->second, it2->first, val);
+                        return;
+                }
 
-                sdata_set::iterator it3;
+                // kept twice, or stored before s was set
+                if ((*it3)->pos == 0)
+                        (*it3)->pos = val->pos;
+                else
+                        m_sstore->erase(*it2->first, *val);
+        }
 
-                it3 = it2->second.find(sdata);
-                if (it3 == it2->second.end())
-                        return;
+        sval*
+        dht::find_sval(const uint160_t &id, const void *key, uint16_t keylen,
+                       const void *value, uint16_t valuelen)
+        {
+                stored_map::iterator it1;
+                sdata_map::iterator  it2;
+                sdata_set::iterator  it3;
+                uint160_t            src(0);
 
+                it1 = m_stored.find(id);
+                if (it1 == m_stored.end())
+                        return NULL;
 
-                _id src;
+                it2 = find_key(it1->second, key, keylen);
+                if (it2 == it1->second.end())
+                        return NULL;
 
-                src.id = id;
+                it3 = it2->second.find(sval::construct(value, valuelen, src));
+                if (it3 == it2->second.end())
+                        return NULL;
 
-                it3->recvd.insert(src);
+                return it3->get();
         }
 
-        int
-        dht::dec_origin_sdata(dht::stored_data &sdata)
+        void
+        dht::insert2recvd_sdata(stored_data &sdata, id_ptr id)
         {
-                _id  i;
-                _key k;
+                stored_map::iterator it1;
+                sdata_map::iterator  it2;
+                sdata_set::iterator  it3;
+
+                it1 = m_stored.find(*sdata.id);
+                if (it1 == m_stored.end())
+                        return;
+
+                it2 = find_key(it1->second, sdata.key.get(), sdata.keylen);
+                if (it2 == it1->second.end())
+                        return;
 
-                i.id     = sdata.id;
-                k.key    = sdata.key;
-                k.keylen = sdata.keylen;
+                it3 = it2->second.find(new_sval(sdata));
+                if (it3 == it2->second.end())
+                        return;
 
+                (*it3)->insert_recvd(*id);
+        }
 
-                boost::unordered_map<_id, sdata_map>::iterator it1;
+        int
+        dht::dec_origin_sdata(dht::stored_data &sdata)
+        {
+                stored_map::iterator it1;
+                sdata_map::iterator  it2;
+                sdata_set::iterator  it3;
+                sval_ptr val = new_sval(sdata);
 
-                it1 = m_stored.find(i);
+                it1 = m_stored.find(*sdata.id);
                 if (it1 == m_stored.end()) {
-                        m_stored[i][k].insert(sdata);
+                        skey_ptr key = skey::construct(*sdata.id,
+                                                       sdata.key.get(),
+                                                       sdata.keylen);
+                        sdata_map &m = m_stored[*sdata.id];
+
+                        m.push_back(std::make_pair(key, sdata_set()));
+                        insert_sdata(m.back().second, key, val);
                         return -1;
                 }
 
-
-                sdata_map::iterator it2;
-
-                it2 = it1->second.find(k);
+                it2 = find_key(it1->second, sdata.key.get(), sdata.keylen);
                 if (it2 == it1->second.end()) {
-                        m_stored[i][k].insert(sdata);
+                        skey_ptr key = skey::construct(*sdata.id,
+                                                       sdata.key.get(),
+                                                       sdata.keylen);
+                        sdata_map &m = it1->second;
+
+                        m.push_back(std::make_pair(key, sdata_set()));
+                        insert_sdata(m.back().second, key, val);
                         return -1;
                 }
 
-
-                sdata_set::iterator it3;
-
-                it3 = it2->second.find(sdata);
+                it3 = it2->second.find(val);
                 if (it3 == it2->second.end()) {
-                        it2->second.insert(sdata);
+                        insert_sdata(it2->second, it2->first, val);
                         return -1;
                 }
 
-                if (it3->original > 0)
-                        it3->original--;
+                if ((*it3)->original > 0) {
+                        (*it3)->original--;
+                        m_sstore->update(*it2->first, **it3);
+                }
 
-                return it3->original;
+                return (*it3)->original;
         }
 
         void
@@ -382,7 +755,7 @@ namespace libcage {
                 }
 
                 m_query->rdp_state = query::QUERY_VAL;
-                m_query->rdp_time  = time(NULL);
+                m_query->rdp_time  = cagetime::now();
                 m_query->vallen    = ntohs(msg.valuelen);
                 m_query->val_read  = 0;
 
@@ -391,6 +764,8 @@ namespace libcage {
                         return false;
                 }
 
+                m_query->add_ttl(ntohs(msg.ttl));
+
                 boost::shared_array<char> val(new char[m_query->vallen]);
                 m_query->val = val;
 
@@ -416,7 +791,7 @@ namespace libcage {
                         val.value = m_query->val;
                         val.len   = m_query->vallen;
 
-                        m_query->vset->insert(val);
+                        m_dht.add_value(m_query, val);
 
                         m_query->rdp_state = query::QUERY_HDR;
 
@@ -424,7 +799,7 @@ namespace libcage {
                         m_dht.m_rdp.send(desc, &op, sizeof(op));
                 }
 
-                m_query->rdp_time = time(NULL);
+                m_query->rdp_time = cagetime::now();
 
                 return true;
         }
@@ -443,7 +818,7 @@ namespace libcage {
                         id_ptr id = m_query->ids.front();
 
                         m_query->ids.pop();
-                        m_query->rdp_time = time(NULL);
+                        m_query->rdp_time = cagetime::now();
                         m_query->rdp_desc = m_dht.m_rdp.connect(rdp_get_port,
                                                                 id, 0, *this);
                 } else {
@@ -461,7 +836,7 @@ namespace libcage {
                 {
                         m_query->is_rdp_con = true;
                         m_query->rdp_desc   = desc;
-                        m_query->rdp_time   = time(NULL);
+                        m_query->rdp_time   = cagetime::now();
                         m_query->rdp_state  = query::QUERY_HDR;
 
                         msg_dht_rdp_get get;
@@ -569,11 +944,11 @@ namespace libcage {
                                 return;
                         }
 
-                        rget->m_time = time(NULL);
+                        rget->m_time = cagetime::now();
 
 
                         msg_dht_rdp_get_reply msg;
-                        stored_data data;
+                        sval_ptr data;
 
                         memset(&msg, 0, sizeof(msg));
 
@@ -584,10 +959,11 @@ namespace libcage {
                                 data = rget->m_data.front();
                                 rget->m_data.pop();
 
-                                msg.valuelen = htons(data.valuelen);
+                                msg.valuelen = htons(data->get_valuelen());
+                                msg.ttl      = htons(data->remaining_ttl());
                                 m_dht.m_rdp.send(desc, &msg, sizeof(msg));
-                                m_dht.m_rdp.send(desc, data.value.get(),
-                                                 data.valuelen);
+                                m_dht.m_rdp.send(desc, data->get_value(),
+                                                 data->get_valuelen());
                         }
 
                 }
@@ -596,44 +972,23 @@ namespace libcage {
         void
         dht::rdp_recv_get_func::read_val(rdp_recv_get_ptr rget)
         {
-                boost::unordered_map<_id, sdata_map>::iterator it1;
-                _id i;
-
-                i.id = rget->m_id;
-
-                it1 = m_dht.m_stored.find(i);
-                if (it1 == m_dht.m_stored.end())
-                        return;
-
-                sdata_map::iterator it2;
-                _key k;
+                sdata_set *sdata;
 
-                k.key    = rget->m_key;
-                k.keylen = rget->m_keylen;
-                
-                it2 = it1->second.find(k);
-                if (it2 == it1->second.end())
+                sdata = m_dht.find_sdata(*rget->m_id, rget->m_key.get(),
+                                         rget->m_keylen);
+                if (sdata == NULL)
                         return;
 
-
+                // expired ones are removed by refresh()
                 sdata_set::iterator it3;
-                time_t now = time(NULL);
-                for (it3 = it2->second.begin(); it3 != it2->second.end(); ) {
-                        time_t diff = now - it3->stored_time;
-                        if (diff > it3->ttl) {
-                                it2->second.erase(it3++);
+                time_t now = cagetime::now();
+                for (it3 = sdata->begin(); it3 != sdata->end(); ++it3) {
+                        time_t diff = now - (*it3)->stored_time;
+                        if (diff > (*it3)->ttl)
                                 continue;
-                        }
 
                         rget->m_data.push(*it3);
-                        ++it3;
                 }
-
-                if (it2->second.size() == 0)
-                        it1->second.erase(it2);
-
-                if (it1->second.size() == 0)
-                        m_dht.m_stored.erase(it1);
         }
 
         bool
@@ -676,7 +1031,7 @@ namespace libcage {
 
                 id->from_binary(msg.id, sizeof(msg.id));
 
-                rget->m_time   = time(NULL);
+                rget->m_time   = cagetime::now();
                 rget->m_state  = rdp_recv_get::RGET_KEY;
                 rget->m_id     = id;
                 rget->m_keylen = ntohs(msg.keylen);
@@ -691,16 +1046,22 @@ namespace libcage {
         dht::rdp_recv_store_func::read_hdr(int desc,
                                            dht::rdp_recv_store_func::it_rcvs it)
         {
-                // read header
-                msg_dht_rdp_store msg;
-                int size = sizeof(msg);
+                // read header. the header of the next record of
+                // store_many may arrive in pieces
+                msg_dht_rdp_store &msg = it->second->hdr;
+                char *buf = (char*)&msg + it->second->hdr_read;
+                int size  = sizeof(msg) - it->second->hdr_read;
 
-                m_dht.m_rdp.receive(desc, &msg, &size);
-                if (size != (int)sizeof(msg)) {
-                        m_dht.m_rdp_recv_store.erase(desc);
-                        m_dht.m_rdp.close(desc);
-                        return -1;
-                }
+                m_dht.m_rdp.receive(desc, buf, &size);
+
+                if (size == 0)
+                        return false;
+
+                it->second->hdr_read += size;
+                if (it->second->hdr_read < (int)sizeof(msg))
+                        return true;
+
+                it->second->hdr_read = 0;
 
                 it->second->keylen   = ntohs(msg.keylen);
                 it->second->valuelen = ntohs(msg.valuelen);
@@ -720,7 +1081,7 @@ namespace libcage {
                 it->second->ttl         = ntohs(msg.ttl);
                 it->second->id          = id;
                 it->second->src         = src;
-                it->second->last_time   = time(NULL);
+                it->second->last_time   = cagetime::now();
                 it->second->is_hdr_read = true;
 
                 boost::shared_array<char> key(new char[it->second->keylen]);
@@ -728,8 +1089,9 @@ namespace libcage {
                 it->second->key   = key;
                 it->second->value = val;
 
-                if (msg.flags & dht_flag_unique)
-                        it->second->is_unique = true;
+                it->second->is_unique = (msg.flags & dht_flag_unique) != 0;
+                it->second->is_cached = (msg.flags & dht_flag_cached) != 0;
+                it->second->is_more   = (msg.flags & dht_flag_more) != 0;
 
                 return true;
         }
@@ -747,7 +1109,7 @@ namespace libcage {
                                 return false;
 
                         it->second->key_read  += size;
-                        it->second->last_time  = time(NULL);
+                        it->second->last_time  = cagetime::now();
                 } else {
                         int size  = it->second->valuelen - it->second->val_read;
                         char *buf = &it->second->value[it->second->val_read];
@@ -757,13 +1119,29 @@ namespace libcage {
                                 return false;
 
                         it->second->val_read  += size;
-                        it->second->last_time  = time(NULL);
+                        it->second->last_time  = cagetime::now();
 
                         if (it->second->valuelen == it->second->val_read) {
-                                it->second->store2local();
+                                uint8_t status;
 
-                                m_dht.m_rdp_recv_store.erase(desc);
-                                m_dht.m_rdp.close(desc);
+                                if (! it->second->store2local())
+                                        it->second->is_refused = true;
+
+                                it->second->is_hdr_read = false;
+                                it->second->key_read    = 0;
+                                it->second->val_read    = 0;
+
+                                // read the next record of store_many
+                                if (it->second->is_more)
+                                        return true;
+
+                                // the sender closes the stream when it
+                                // read the result, so that it arrives
+                                status = it->second->is_refused ?
+                                         dht_store_refused : dht_store_ok;
+
+                                m_dht.m_rdp.send(desc, &status,
+                                                 sizeof(status));
 
                                 return false;
                         }
@@ -813,7 +1191,7 @@ namespace libcage {
                 }
         }
 
-        void
+        bool
         dht::rdp_recv_store::store2local()
         {
                 stored_data data;
@@ -823,19 +1201,26 @@ namespace libcage {
                 data.key         = key;
                 data.keylen      = keylen;
                 data.ttl         = ttl;
-                data.stored_time = time(NULL);
+                data.stored_time = cagetime::now();
                 data.id          = id;
                 data.src         = src;
                 data.original    = 0;
                 data.is_unique   = is_unique;
 
+                if (is_cached)
+                        return ttl == 0 || p_dht->add_cached(data);
+
                 if (ttl == 0) {
                         p_dht->erase_sdata(data);
-                        return;
+                        return true;
                 }
 
-                p_dht->add_sdata(data, false);
+                if (! p_dht->add_sdata(data, false))
+                        return false;
+
                 p_dht->insert2recvd_sdata(data, src);
+
+                return true;
         }
 
         void
@@ -855,7 +1240,12 @@ namespace libcage {
                         msg.keylen   = ntohs(keylen);
                         msg.valuelen = ntohs(valuelen);
                         msg.ttl      = ntohs(ttl);
-                        msg.flags    = dht_flag_unique;
+
+                        if (is_unique)
+                                msg.flags |= dht_flag_unique;
+
+                        if (is_cached)
+                                msg.flags |= dht_flag_cached;
 
                         p_dht->m_rdp.send(desc, &msg, sizeof(msg));
                         p_dht->m_rdp.send(desc, key.get(), keylen);
@@ -865,8 +1255,35 @@ namespace libcage {
                         dist = *id ^ *addr.did;
                         break;
                 }
-                case RESET:
+                case READY2READ:
                 {
+                        // the result of the store
+                        uint8_t status;
+                        int     size = sizeof(status);
+
+                        p_dht->m_rdp.receive(desc, &status, &size);
+
+                        if (size != sizeof(status))
+                                break;
+
+                        finish(desc, addr, status == dht_store_ok);
+                        break;
+                }
+                case RESET:
+                        // nodes without the status byte close the stream
+                        // once the value is stored
+                        finish(desc, addr, true);
+                        break;
+                default:
+                        finish(desc, addr, false);
+                        break;
+                }
+        }
+
+        void
+        dht::rdp_store_func::finish(int desc, rdp_addr &addr, bool is_ok)
+        {
+                if (is_ok) {
                         stored_data sdata;
 
                         sdata.value    = value;
@@ -876,15 +1293,13 @@ namespace libcage {
                         sdata.id       = id;
 
                         p_dht->insert2recvd_sdata(sdata, addr.did);
-                        p_dht->m_rdp_store.erase(desc);
-                        p_dht->m_rdp.close(desc);
-                        break;
-                }
-                default:
-                        p_dht->m_rdp_store.erase(desc);
-                        p_dht->m_rdp.close(desc);
-                        break;
                 }
+
+                p_dht->m_rdp_store.erase(desc);
+                p_dht->m_rdp.close(desc);
+
+                if (ack_nonce != 0)
+                        p_dht->recv_store_ack(ack_nonce, is_ok);
         }
 
         void
@@ -933,13 +1348,71 @@ namespace libcage {
                                                          m_id, m_peers, this);
         }
 
+        // lookups for the same node or value share this key
+        static std::string
+        inflight_key(const uint160_t &dst, bool is_find_value,
+                     const void *key, int keylen)
+        {
+                char buf[CAGE_ID_LEN + 1];
+
+                buf[0] = is_find_value ? 'v' : 'n';
+                dst.to_binary(buf + 1, CAGE_ID_LEN);
+
+                std::string str(buf, sizeof(buf));
+
+                if (key != NULL)
+                        str.append((const char*)key, keylen);
+
+                return str;
+        }
+
         void
         dht::find_nv(const uint160_t &dst, callback_func func,
-                     bool is_find_value, const void *key = NULL, int keylen = 0)
+                     bool is_find_value, const void *key, int keylen,
+                     const lookup_param &param, callback_value on_value,
+                     const std::vector<cageaddr> *seed)
         {
+                std::map<std::string, uint32_t>::iterator it;
+                std::string inflight;
+
+                // the same lookup is in flight, wait for its result
+                inflight = inflight_key(dst, is_find_value, key, keylen);
+                it = m_inflight.find(inflight);
+                if (it != m_inflight.end() &&
+                    m_query.find(it->second) != m_query.end()) {
+                        query_ptr q = m_query[it->second];
+
+                        q->funcs.push_back(func);
+
+                        // catch up with the values already received
+                        if (on_value) {
+                                q->on_values.push_back(on_value);
+
+                                BOOST_FOREACH(const value_t &v, *q->vset) {
+                                        on_value(v);
+                                }
+                        }
+
+                        if (is_find_value)
+                                m_find_value_stats.num_coalesced++;
+                        else
+                                m_find_node_stats.num_coalesced++;
+
+                        return;
+                }
+
                 query_ptr q(new query);
 
-                lookup(dst, num_find_node, q->nodes);
+                init_query(q, param);
+
+                if (seed != NULL && ! seed->empty()) {
+                        std::vector<cageaddr> nodes;
+
+                        lookup(dst, q->k, nodes);
+                        merge_nodes(dst, q->nodes, *seed, nodes, q->k);
+                } else {
+                        lookup(dst, q->k, q->nodes);
+                }
 
                 if (q->nodes.size() == 0) {
                         if (is_find_value) {
@@ -961,7 +1434,17 @@ namespace libcage {
                 q->dst           = p_dst;
                 q->num_query     = 0;
                 q->is_find_value = is_find_value;
-                q->func          = func;
+                q->inflight      = inflight;
+                q->is_first_set  = param.first_set;
+                q->funcs.push_back(func);
+
+                if (on_value)
+                        q->on_values.push_back(on_value);
+
+                if (is_find_value)
+                        m_find_value_stats.num_lookup++;
+                else
+                        m_find_node_stats.num_lookup++;
 
                 if (is_find_value) {
                         q->key = boost::shared_array<char>(new char[keylen]);
@@ -990,12 +1473,20 @@ namespace libcage {
 
                 q->nonce = nonce;
                 m_query[nonce] = q;
+                m_inflight[inflight] = nonce;
 
                 send_find(q);
         }
 
         void
         dht::find_node(const uint160_t &dst, callback_find_node func)
+        {
+                find_node(dst, func, lookup_param());
+        }
+
+        void
+        dht::find_node(const uint160_t &dst, callback_find_node func,
+                       const lookup_param &param)
         {
                 node_state state = m_nat.get_state();
                 if (state == node_symmetric || state == node_undefined ||
@@ -1005,7 +1496,317 @@ namespace libcage {
                         return;
                 }
 
-                find_nv(dst, func, false);
+                find_nv(dst, func, false, NULL, 0, param);
+        }
+
+        void
+        dht::set_lookup_param(const lookup_param &param)
+        {
+                if (param.alpha > 0)
+                        m_param.alpha = param.alpha;
+
+                if (param.k > 0)
+                        m_param.k = param.k;
+
+                if (param.policy != lookup_default)
+                        m_param.policy = param.policy;
+        }
+
+        void
+        dht::set_cache_size(size_t bytes)
+        {
+                m_cache_max = bytes;
+
+                while (m_cache_stats.bytes > m_cache_max) {
+                        erase_cache(m_cache.find(m_cache_lru.front()));
+                        m_cache_stats.num_evicted++;
+                }
+        }
+
+        void
+        dht::set_path_cache(bool flag)
+        {
+                m_is_path_cache = flag;
+        }
+
+        void
+        dht::cache_on_path(query_ptr q)
+        {
+                // the values are kept for a shorter time the farther the
+                // node is from the nodes which have them
+                int n, ttl;
+
+                if (q->ttl <= 0 || ! q->miss.id || ! q->holder)
+                        return;
+
+                if (q->dst->cmp_distance(*q->miss.id, *q->holder) < 0)
+                        return;
+
+                n = q->dst->prefix_len(*q->holder) -
+                        q->dst->prefix_len(*q->miss.id);
+
+                ttl = q->ttl < path_cache_ttl ? q->ttl : path_cache_ttl;
+                ttl = n < 16 ? ttl >> n : 0;
+
+                if (ttl == 0)
+                        return;
+
+                std::vector<cageaddr> nodes;
+                store_func func;
+
+                nodes.push_back(q->miss);
+
+                func.key       = q->key;
+                func.keylen    = q->keylen;
+                func.ttl       = ttl;
+                func.id        = q->dst;
+                func.from      = id_ptr(new uint160_t(m_id));
+                func.is_unique = false;
+                func.is_cached = true;
+                func.p_dht     = this;
+
+                BOOST_FOREACH(const value_t &v, *q->vset) {
+                        func.value    = v.value;
+                        func.valuelen = v.len;
+
+                        if (m_is_use_rdp)
+                                func.store_by_rdp(nodes);
+                        else
+                                func.store_by_udp(nodes);
+                }
+        }
+
+        // false if the value was refused
+        bool
+        dht::add_cached(stored_data &sdata)
+        {
+                stored_map::iterator it1;
+                sdata_map::iterator  it2;
+                sdata_set::iterator  it3;
+                sval_ptr val;
+                size_t   bytes;
+
+                // not needed where the primary replicas are
+                it1 = m_stored.find(*sdata.id);
+                if (it1 != m_stored.end() &&
+                    find_key(it1->second, sdata.key.get(),
+                             sdata.keylen) != it1->second.end())
+                        return true;
+
+                // the sender chooses the ttl, keep it short
+                if (sdata.ttl > path_cache_ttl)
+                        sdata.ttl = path_cache_ttl;
+
+                val = new_sval(sdata);
+
+                it1 = m_cached.find(*sdata.id);
+                if (it1 != m_cached.end()) {
+                        it2 = find_key(it1->second, sdata.key.get(),
+                                       sdata.keylen);
+                        if (it2 != it1->second.end()) {
+                                it3 = it2->second.find(val);
+                                if (it3 != it2->second.end()) {
+                                        (*it3)->stored_time = sdata.stored_time;
+                                        (*it3)->ttl         = sdata.ttl;
+                                        update_expiry(it2->first, **it3, true);
+                                        return true;
+                                }
+                        }
+                }
+
+                // the cached values expire soon, so the new ones are
+                // dropped when they are full
+                bytes = sdata_bytes(sdata.keylen, sdata.valuelen);
+                if (m_cached_bytes + bytes > (size_t)path_cache_max)
+                        return false;
+
+                // in the limits of the stored values, without evicting
+                // them
+                if (m_store_max > 0 &&
+                    m_store_stats.bytes + m_cached_bytes + bytes >
+                    m_store_max) {
+                        m_store_stats.num_rejected++;
+                        return false;
+                }
+
+                if (is_over_quota(sdata))
+                        return false;
+
+                sdata_map &m = m_cached[*sdata.id];
+
+                it2 = find_key(m, sdata.key.get(), sdata.keylen);
+                if (it2 == m.end()) {
+                        skey_ptr key = skey::construct(*sdata.id,
+                                                       sdata.key.get(),
+                                                       sdata.keylen);
+
+                        m.push_back(std::make_pair(key, sdata_set()));
+                        it2 = m.end() - 1;
+                }
+
+                add_expiry(it2->first, *val, true);
+                it2->second.insert(val);
+                m_num_cached++;
+                m_cached_bytes += bytes;
+                m_src_bytes[*sdata.src] += bytes;
+
+                return true;
+        }
+
+        dht::sdata_set*
+        dht::find_sdata(const uint160_t &id, const void *key, uint16_t keylen)
+        {
+                // primary replicas first, then path cached ones
+                stored_map *stored[] = {
+                        &m_stored, &m_cached
+                };
+
+                for (int n = 0; n < 2; n++) {
+                        stored_map::iterator it1;
+                        sdata_map::iterator  it2;
+
+                        it1 = stored[n]->find(id);
+                        if (it1 == stored[n]->end())
+                                continue;
+
+                        it2 = find_key(it1->second, key, keylen);
+                        if (it2 != it1->second.end() && it2->second.size() > 0)
+                                return &it2->second;
+                }
+
+                return NULL;
+        }
+
+        bool
+        dht::get_cache(const uint160_t &id, const void *key, uint16_t keylen,
+                       value_set_ptr &vset)
+        {
+                cache_map::iterator it;
+                _id i;
+
+                i.id = id_ptr(new uint160_t(id));
+
+                it = m_cache.find(i);
+                if (it == m_cache.end())
+                        return false;
+
+                if (it->second.expire <= cagetime::now()) {
+                        m_cache_stats.num_expired++;
+                        erase_cache(it);
+                        return false;
+                }
+
+                if (it->second.keylen != keylen ||
+                    memcmp(it->second.key.get(), key, keylen) != 0)
+                        return false;
+
+                m_cache_lru.splice(m_cache_lru.end(), m_cache_lru,
+                                   it->second.lru);
+
+                // callers may modify the set
+                vset = value_set_ptr(new value_set(*it->second.vset));
+
+                return true;
+        }
+
+        void
+        dht::put_cache(query_ptr q)
+        {
+                cache_map::iterator it;
+                cached_value c;
+                _id i;
+
+                // values without ttl, from older nodes, are not cached
+                if (m_cache_max == 0 || q->ttl <= 0 || q->vset->size() == 0)
+                        return;
+
+                c.size = sizeof(c) + sizeof(i) + q->keylen;
+                BOOST_FOREACH(const value_t &v, *q->vset) {
+                        c.size += sizeof(v) + v.len;
+                }
+
+                if (c.size > m_cache_max)
+                        return;
+
+                i.id = q->dst;
+
+                it = m_cache.find(i);
+                if (it != m_cache.end())
+                        erase_cache(it);
+
+                while (m_cache_stats.bytes + c.size > m_cache_max) {
+                        erase_cache(m_cache.find(m_cache_lru.front()));
+                        m_cache_stats.num_evicted++;
+                }
+
+                c.key    = q->key;
+                c.keylen = q->keylen;
+                c.vset   = value_set_ptr(new value_set(*q->vset));
+                c.expire = cagetime::now() + q->ttl;
+                c.lru    = m_cache_lru.insert(m_cache_lru.end(), i);
+
+                m_cache[i] = c;
+                m_cache_stats.bytes += c.size;
+        }
+
+        void
+        dht::erase_cache(cache_map::iterator it)
+        {
+                m_cache_stats.bytes -= it->second.size;
+                m_cache_lru.erase(it->second.lru);
+                m_cache.erase(it);
+        }
+
+        void
+        dht::sweep_cache()
+        {
+                std::list<_id>::iterator it;
+                time_t now = cagetime::now();
+
+                for (it = m_cache_lru.begin(); it != m_cache_lru.end();) {
+                        cache_map::iterator it_c = m_cache.find(*it++);
+
+                        if (it_c->second.expire <= now) {
+                                m_cache_stats.num_expired++;
+                                erase_cache(it_c);
+                        }
+                }
+        }
+
+        void
+        dht::init_query(query_ptr q, const lookup_param &param)
+        {
+                q->alpha  = param.alpha > 0 ? param.alpha : m_param.alpha;
+                q->k      = param.k > 0 ? param.k : m_param.k;
+                q->policy = param.policy != lookup_default ? param.policy :
+                        m_param.policy;
+        }
+
+        void
+        dht::merge_reply(query_ptr q, const _id &from,
+                         std::vector<cageaddr> &nodes)
+        {
+                std::vector<cageaddr> tmp;
+                int hop = q->get_hop(from) + 1;
+
+                BOOST_FOREACH(cageaddr &addr, nodes) {
+                        _id i;
+                        i.id = addr.id;
+
+                        if (q->hops.find(i) == q->hops.end())
+                                q->hops[i] = hop;
+                }
+
+                tmp.swap(q->nodes);
+
+                merge_nodes(*q->dst, q->nodes, tmp, nodes, q->k);
+
+                // count the replies which found no closer node
+                if (! tmp.empty() && ! q->nodes.empty() &&
+                    *tmp[0].id == *q->nodes[0].id)
+                        q->num_stall++;
+                else
+                        q->num_stall = 0;
         }
 
         void
@@ -1014,28 +1815,64 @@ namespace libcage {
                 if (m_is_use_rdp && q->is_find_value && q->is_rdp_con)
                         return;
 
-                BOOST_FOREACH(cageaddr &addr, q->nodes) {
-                        if (q->num_query >= max_query) {
+                bool is_stalled = (q->policy == lookup_stall &&
+                                   q->num_stall >= q->alpha);
+
+                // candidates are the closest nodes not queried yet, twice
+                // as many as the free slots. the ones expected to reply
+                // fastest are queried first
+                std::vector<std::pair<uint32_t, int> > cand;
+                int slots = is_stalled ? 0 : q->alpha - q->num_query;
+
+                for (int n = 0; n < (int)q->nodes.size(); n++) {
+                        if ((int)cand.size() >= slots * 2)
                                 break;
-                        }
 
                         _id i;
-                        i.id = addr.id;
+                        i.id = q->nodes[n].id;
 
                         if (q->sent.find(i) != q->sent.end()) {
                                 continue;
                         }
 
+                        cand.push_back(std::make_pair(get_cost(*i.id), n));
+                }
+
+                // ties are broken by the distance
+                std::sort(cand.begin(), cand.end());
+
+                if ((int)cand.size() > slots)
+                        cand.resize(slots);
+
+                for (size_t n = 0; n < cand.size(); n++) {
+                        cageaddr &addr = q->nodes[cand[n].second];
+
+                        _id i;
+                        i.id = addr.id;
+
                         // start timer
                         timer_query_ptr t(new timer_query);
                         timeval         tval;
 
                         t->nonce = q->nonce;
                         t->id    = i;
+                        t->sent  = cagetime::now_usec();
                         t->p_dht = this;
 
-                        tval.tv_sec  = query_timeout;
-                        tval.tv_usec = 0;
+                        // wait for the RTO of the node, and then for the
+                        // rest of query_timeout as a late reply
+                        uint32_t rto = get_rto(*i.id);
+
+                        if (rto < (uint32_t)query_timeout * 1000000) {
+                                t->is_soft   = true;
+                                tval.tv_sec  = rto / 1000000;
+                                tval.tv_usec = rto % 1000000;
+                        } else {
+                                t->is_soft   = false;
+                                tval.tv_sec  = query_timeout;
+                                tval.tv_usec = 0;
+                        }
+                        t->is_late = false;
 
                         q->timers[i] = t;
                         q->sent.insert(i);
@@ -1046,25 +1883,60 @@ namespace libcage {
                         // send find node
                         if (q->is_find_value) {
                                 send_find_value(addr, q);
+                                m_find_value_stats.num_request++;
                         } else {
                                 send_find_node(addr, q);
+                                m_find_node_stats.num_request++;
                         }
 
                         q->num_query++;
                 }
 
-                if (q->num_query == 0) {
+                // a late reply may still bring closer nodes, but the
+                // slowest node must not bound the lookup
+                if (q->num_query == 0 && q->num_late > 0 &&
+                    ! q->is_late_timer_started && ! is_stalled) {
+                        timeval tval;
+
+                        tval.tv_sec  = late_wait / 1000000;
+                        tval.tv_usec = late_wait % 1000000;
+
+                        q->late_timer.nonce = q->nonce;
+                        q->late_timer.p_dht = this;
+                        q->is_late_timer_started = true;
+
+                        m_timer.set_timer(&q->late_timer, &tval);
+                }
+
+                if ((q->num_query == 0 &&
+                     (q->num_late == 0 || q->is_late_over)) || is_stalled) {
+                        // the hops to the closest node
+                        if (! q->is_find_value && ! q->nodes.empty()) {
+                                _id i;
+                                i.id = q->nodes[0].id;
+
+                                m_find_node_stats.num_found++;
+                                m_find_node_stats.num_hop += q->get_hop(i);
+                        }
+
                         // call callback functions
-                        if (q->is_find_value) {
-                                cageaddr addr1, addr2;
-                                callback_find_value func;
-                                value_set_ptr p;
-                                func = boost::get<callback_find_value>(q->func);
-                                func(false, p);
-                        } else {
-                                callback_find_node func;
-                                func = boost::get<callback_find_node>(q->func);
-                                func(q->nodes);
+                        std::vector<callback_func> funcs;
+
+                        unlink_query(q);
+                        funcs.swap(q->funcs);
+
+                        BOOST_FOREACH(callback_func &f, funcs) {
+                                if (q->is_find_value) {
+                                        callback_find_value func;
+                                        value_set_ptr p;
+                                        func = boost::get<callback_find_value>(f);
+                                        func(false, p);
+                                } else {
+                                        callback_find_node func;
+                                        std::vector<cageaddr> nodes(q->nodes);
+                                        func = boost::get<callback_find_node>(f);
+                                        func(nodes);
+                                }
                         }
 
                         remove_query(q);
@@ -1082,10 +1954,28 @@ namespace libcage {
                 if (q->is_timer_recvd_started)
                         m_timer.unset_timer(q->timer_recvd.get());
 
+                if (q->is_late_timer_started)
+                        m_timer.unset_timer(&q->late_timer);
+
                 // remove query
+                unlink_query(q);
                 m_query.erase(q->nonce);
         }
 
+        void
+        dht::unlink_query(query_ptr q)
+        {
+                // later lookups for the same key start a new query
+                std::map<std::string, uint32_t>::iterator it;
+
+                if (q->inflight.empty())
+                        return;
+
+                it = m_inflight.find(q->inflight);
+                if (it != m_inflight.end() && it->second == q->nonce)
+                        m_inflight.erase(it);
+        }
+
         void
         dht::find_node_func::operator() (bool result, cageaddr &addr)
         {
@@ -1142,8 +2032,38 @@ namespace libcage {
                 timer_query_ptr t = q->timers[id];
                 uint160_t zero;
 
+                if (is_soft) {
+                        // the node is slow. give its slot to the next
+                        // node. its reply is still accepted until
+                        // query_timeout, unless the lookup has finished
+                        uint64_t elapsed = cagetime::now_usec() - sent;
+                        uint64_t rest    = 0;
+                        timeval  tval;
+
+                        if (elapsed < (uint64_t)query_timeout * 1000000)
+                                rest = (uint64_t)query_timeout * 1000000 -
+                                        elapsed;
+
+                        tval.tv_sec  = (long)(rest / 1000000);
+                        tval.tv_usec = (long)(rest % 1000000);
+
+                        is_soft = false;
+                        is_late = true;
+
+                        p_dht->m_timer.set_timer(this, &tval);
+
+                        q->num_query--;
+                        q->num_late++;
+
+                        p_dht->send_find(q);
+                        return;
+                }
+
                 q->sent.insert(id);
-                q->num_query--;
+                if (is_late)
+                        q->num_late--;
+                else
+                        q->num_query--;
                 q->timers.erase(id);
 
                 zero.fill_zero();
@@ -1167,11 +2087,21 @@ namespace libcage {
         }
 
         void
-        dht::recv_find_node(void *msg, sockaddr *from)
+        dht::timer_late::operator() ()
         {
-                msg_dht_find_node_reply *reply;
+                query_ptr q = p_dht->m_query[nonce];
+
+                q->is_late_over = true;
+
+                p_dht->send_find(q);
+        }
+
+        void
+        dht::recv_find_node(void *msg, sockaddr *from)
+        {
+                msg_dht_find_node_reply *reply;
                 msg_dht_find_node       *req;
-                std::vector<cageaddr>    nodes;
+                std::vector<entry_view>  nodes;
                 uint160_t dst;
                 uint160_t zero;
                 uint160_t id;
@@ -1247,6 +2177,7 @@ namespace libcage {
                 uint16_t  domain;
                 int       size;
                 _id       c_id;
+                bool      is_late = false;
 
 
                 reply = (msg_dht_find_node_reply*)msg;
@@ -1288,11 +2219,19 @@ namespace libcage {
                         t = q->timers[c_id];
                         m_timer.unset_timer(t.get());
                         q->timers.erase(c_id);
+
+                        add_rtt(*addr.id, (uint32_t)(cagetime::now_usec() -
+                                                     t->sent));
+                        is_late = t->is_late;
                 } else {
                         timer_query_ptr t;
                         t = q->timers[c_id];
                         m_timer.unset_timer(t.get());
                         q->timers.erase(c_id);
+
+                        add_rtt(*addr.id, (uint32_t)(cagetime::now_usec() -
+                                                     t->sent));
+                        is_late = t->is_late;
                 }
 
                 // read nodes
@@ -1329,20 +2268,15 @@ namespace libcage {
                 i.id = addr.id;
 
                 q->sent.insert(i);
-                q->num_query--;
+                if (is_late)
+                        q->num_late--;
+                else
+                        q->num_query--;
 
-                // sort
-                compare cmp;
-                cmp.m_id = &id;
-                std::sort(nodes.begin(), nodes.end(), cmp);
+                m_find_node_stats.num_reply++;
 
                 // merge
-                std::vector<cageaddr> tmp;
-
-                tmp = q->nodes;
-                q->nodes.clear();
-
-                merge_nodes(*q->dst, q->nodes, tmp, nodes, num_find_node);
+                merge_reply(q, i, nodes);
 
                 // send
                 send_find(q);
@@ -1357,12 +2291,21 @@ namespace libcage {
                         return;
 
 
-                sockaddr_storage saddr;
+                resolve_func f;
 
-                if (! m_udp.get_sockaddr(&saddr, host, port))
+                f.func  = func;
+                f.p_dht = this;
+
+                m_udp.resolve(host, port, f);
+        }
+
+        void
+        dht::resolve_func::operator() (bool result, sockaddr_storage &saddr)
+        {
+                if (! result)
                         return;
 
-                find_node((sockaddr*)&saddr, func);
+                p_dht->find_node((sockaddr*)&saddr, func);
         }
 
         void
@@ -1374,10 +2317,15 @@ namespace libcage {
 
                 *dst = m_id;
 
+                init_query(q, lookup_param());
+
                 q->dst           = dst;
                 q->num_query     = 1;
                 q->is_find_value = false;
-                q->func          = func;
+                q->funcs.push_back(func);
+
+                m_find_node_stats.num_lookup++;
+                m_find_node_stats.num_request++;
 
                 // add my id
                 _id i;
@@ -1406,6 +2354,9 @@ namespace libcage {
 
                 t->nonce = q->nonce;
                 t->id    = zero_id;
+                t->sent  = cagetime::now_usec();
+                t->is_soft = false;
+                t->is_late = false;
                 t->p_dht = this;
 
                 tval.tv_sec  = query_timeout;
@@ -1449,11 +2400,39 @@ namespace libcage {
         void
         dht::store(id_ptr id, boost::shared_array<char> key, uint16_t keylen,
                    boost::shared_array<char> value, uint16_t valuelen,
-                   uint16_t ttl, id_ptr from, bool is_unique)
+                   uint16_t ttl, id_ptr from, bool is_unique,
+                   callback_store on_stored)
         {
                 // store to dht network
                 store_func func;
 
+                if (on_stored) {
+                        store_query_ptr q(new store_query);
+                        uint32_t nonce;
+
+                        do {
+                                nonce = m_rnd();
+                        } while (nonce == 0 ||
+                                 m_store_query.find(nonce) !=
+                                 m_store_query.end());
+
+                        q->func  = on_stored;
+                        q->nonce = nonce;
+                        q->start = cagetime::now_usec();
+
+                        q->timer_ack.nonce = nonce;
+                        q->timer_ack.p_dht = this;
+
+                        timeval tval;
+                        tval.tv_sec  = store_ack_timeout;
+                        tval.tv_usec = 0;
+
+                        m_timer.set_timer(&q->timer_ack, &tval);
+
+                        m_store_query[nonce] = q;
+                        func.ack_nonce = nonce;
+                }
+
                 func.key       = key;
                 func.value     = value;
                 func.id        = id;
@@ -1467,6 +2446,16 @@ namespace libcage {
                 find_node(*id, func);
 
 
+                // the cached values of the key are stale now
+                cache_map::iterator it;
+                _id i;
+
+                i.id = id;
+                it = m_cache.find(i);
+                if (it != m_cache.end())
+                        erase_cache(it);
+
+
                 // store to local
                 stored_data data;
 
@@ -1475,7 +2464,7 @@ namespace libcage {
                 data.keylen      = keylen;
                 data.valuelen    = valuelen;
                 data.ttl         = ttl;
-                data.stored_time = time(NULL);
+                data.stored_time = cagetime::now();
                 data.id          = func.id;
                 data.original    = original_put_num;
                 data.src         = from;
@@ -1507,6 +2496,116 @@ namespace libcage {
                       is_unique);
         }
 
+        void
+        dht::store(const uint160_t &id, const void *key, uint16_t keylen,
+                   const void *value, uint16_t valuelen, uint16_t ttl,
+                   bool is_unique, callback_store func)
+        {
+                id_ptr     p_id(new uint160_t(id));
+                id_ptr     p_from(new uint160_t(m_id));
+                boost::shared_array<char> p_key(new char[keylen]);
+                boost::shared_array<char> p_val(new char[valuelen]);
+
+                memcpy(p_key.get(), key, keylen);
+                memcpy(p_val.get(), value, valuelen);
+
+                store(p_id, p_key, keylen, p_val, valuelen, ttl, p_from,
+                      is_unique, func);
+        }
+
+        dht::store_query_ptr
+        dht::find_store_query(uint32_t nonce)
+        {
+                std::map<uint32_t, store_query_ptr>::iterator it;
+
+                if (nonce == 0)
+                        return store_query_ptr();
+
+                it = m_store_query.find(nonce);
+                if (it == m_store_query.end())
+                        return store_query_ptr();
+
+                return it->second;
+        }
+
+        static std::string
+        store_ack_key(const uint160_t &node, const uint160_t &id,
+                      const void *key, int keylen)
+        {
+                char buf[CAGE_ID_LEN * 2];
+
+                node.to_binary(buf, CAGE_ID_LEN);
+                id.to_binary(buf + CAGE_ID_LEN, CAGE_ID_LEN);
+
+                std::string str(buf, sizeof(buf));
+
+                str.append((const char*)key, keylen);
+
+                return str;
+        }
+
+        void
+        dht::wait_store_ack(store_query_ptr q, const uint160_t &node,
+                            const uint160_t &id, const void *key,
+                            uint16_t keylen)
+        {
+                std::string str = store_ack_key(node, id, key, keylen);
+
+                m_store_ack[str].push_back(q->nonce);
+                q->acks.push_back(str);
+                q->num_wait++;
+        }
+
+        void
+        dht::recv_store_ack(uint32_t nonce, bool result)
+        {
+                store_query_ptr q = find_store_query(nonce);
+
+                if (! q)
+                        return;
+
+                if (result)
+                        q->num_ack++;
+
+                q->num_wait--;
+
+                if (q->is_sent && q->num_wait <= 0)
+                        finish_store(q);
+        }
+
+        void
+        dht::finish_store(store_query_ptr q)
+        {
+                m_timer.unset_timer(&q->timer_ack);
+
+                BOOST_FOREACH(std::string &str, q->acks) {
+                        std::map<std::string,
+                                 std::list<uint32_t> >::iterator it;
+
+                        it = m_store_ack.find(str);
+                        if (it == m_store_ack.end())
+                                continue;
+
+                        it->second.remove(q->nonce);
+                        if (it->second.empty())
+                                m_store_ack.erase(it);
+                }
+
+                m_store_query.erase(q->nonce);
+
+                q->func(q->num_ack, q->num_replica,
+                        cagetime::now_usec() - q->start);
+        }
+
+        void
+        dht::timer_store::operator() ()
+        {
+                store_query_ptr q = p_dht->find_store_query(nonce);
+
+                if (q)
+                        p_dht->finish_store(q);
+        }
+
         bool
         dht::store_func::store_by_udp(std::vector<cageaddr>& nodes)
         {
@@ -1531,6 +2630,13 @@ namespace libcage {
                 if (is_unique)
                         msg->flags |= dht_flag_unique;
 
+                if (is_cached)
+                        msg->flags |= dht_flag_cached;
+
+                store_query_ptr q = p_dht->find_store_query(ack_nonce);
+                if (q)
+                        msg->flags |= dht_flag_ack;
+
 
                 id->to_binary(msg->id, sizeof(msg->id));
                 p_dht->m_id.to_binary(msg->from, sizeof(msg->from));
@@ -1551,6 +2657,10 @@ namespace libcage {
 
                         send_msg(p_dht->m_udp, &msg->hdr, size,
                                  type_dht_store, addr, p_dht->m_id);
+
+                        if (q)
+                                p_dht->wait_store_ack(q, *addr.id, *id,
+                                                      key.get(), keylen);
                 }
 
                 return me;
@@ -1570,8 +2680,13 @@ namespace libcage {
                 func.id        = id;
                 func.from      = from;
                 func.is_unique = is_unique;
+                func.is_cached = is_cached;
                 func.p_dht     = p_dht;
 
+                store_query_ptr q = p_dht->find_store_query(ack_nonce);
+                if (q)
+                        func.ack_nonce = ack_nonce;
+
                 BOOST_FOREACH(cageaddr &addr, nodes) {
                         if (*addr.id == p_dht->m_id) {
                                 me = true;
@@ -1585,7 +2700,11 @@ namespace libcage {
                         if (desc <= 0)
                                 continue;
 
-                        p_dht->m_rdp_store[desc] = time(NULL);
+                        p_dht->m_rdp_store[desc] = cagetime::now();
+
+                        // acknowledged by closing the stream
+                        if (q)
+                                q->num_wait++;
                 }
 
                 return me;
@@ -1601,7 +2720,25 @@ namespace libcage {
                         me = store_by_udp(nodes);
                 }
 
-                if (nodes.size() >= (uint32_t)num_find_node) {
+                done(nodes, me);
+
+                store_query_ptr q = p_dht->find_store_query(ack_nonce);
+                if (q) {
+                        q->num_replica = nodes.size();
+                        q->is_sent     = true;
+
+                        if (me)
+                                q->num_ack++;
+
+                        if (q->num_wait <= 0)
+                                p_dht->finish_store(q);
+                }
+        }
+
+        void
+        dht::store_func::done(std::vector<cageaddr>& nodes, bool me)
+        {
+                if (nodes.size() >= (uint32_t)p_dht->m_param.k) {
                         stored_data sdata;
 
                         sdata.value     = value;
@@ -1631,6 +2768,7 @@ namespace libcage {
                 uint16_t  valuelen;
                 uint16_t  ttl;
                 int       size;
+                bool      is_stored;
 
                 req = (msg_dht_store*)msg;
 
@@ -1673,7 +2811,7 @@ namespace libcage {
                 data.key         = key;
                 data.keylen      = keylen;
                 data.ttl         = ttl;
-                data.stored_time = time(NULL);
+                data.stored_time = cagetime::now();
                 data.id          = id;
                 data.original    = 0;
                 data.src         = src;
@@ -1681,18 +2819,98 @@ namespace libcage {
                 if (req->flags & dht_flag_unique)
                         data.is_unique = true;
 
-                if (ttl == 0) {
+                if (req->flags & dht_flag_cached) {
+                        is_stored = ttl == 0 || add_cached(data);
+                } else if (ttl == 0) {
                         erase_sdata(data);
-                        return;
+                        is_stored = true;
+                } else {
+                        is_stored = add_sdata(data, false);
+                        if (is_stored)
+                                insert2recvd_sdata(data, addr.id);
+                }
+
+                if (req->flags & dht_flag_ack) {
+                        msg_dht_store_reply *reply;
+                        char buf[1024 * 2];
+
+                        reply = (msg_dht_store_reply*)buf;
+                        size  = sizeof(*reply) - sizeof(reply->key) + keylen;
+
+                        // the key fitted in the request
+                        memset(reply, 0, sizeof(*reply));
+
+                        memcpy(reply->id, req->id, sizeof(reply->id));
+                        reply->keylen = htons(keylen);
+                        reply->status = is_stored ? dht_store_ok :
+                                                    dht_store_refused;
+                        memcpy(reply->key, req->data, keylen);
+
+                        send_msg(m_udp, &reply->hdr, size,
+                                 type_dht_store_reply, addr, m_id);
                 }
+        }
+
+        void
+        dht::recv_store_reply(void *msg, int len, sockaddr *from)
+        {
+                std::map<std::string, std::list<uint32_t> >::iterator it;
+                msg_dht_store_reply *reply;
+                cageaddr  addr;
+                uint160_t dst;
+                uint160_t id;
+                uint16_t  keylen;
+                uint32_t  nonce;
+                int       size;
+
+                reply = (msg_dht_store_reply*)msg;
 
-                add_sdata(data, false);
-                insert2recvd_sdata(data, addr.id);
+                dst.from_binary(reply->hdr.dst, sizeof(reply->hdr.dst));
+                if (dst != m_id)
+                        return;
+
+                keylen = ntohs(reply->keylen);
+                size   = sizeof(*reply) - sizeof(reply->key) + keylen;
+
+                if (size != len)
+                        return;
+
+                addr = new_cageaddr(&reply->hdr, from);
+                id.from_binary(reply->id, sizeof(reply->id));
+
+                it = m_store_ack.find(store_ack_key(*addr.id, id, reply->key,
+                                                    keylen));
+                if (it == m_store_ack.end())
+                        return;
+
+                // the oldest store of the key to the node
+                nonce = it->second.front();
+                it->second.pop_front();
+
+                if (it->second.empty())
+                        m_store_ack.erase(it);
+
+                recv_store_ack(nonce, reply->status == dht_store_ok);
         }
 
         void
         dht::find_value(const uint160_t &dst, const void *key, uint16_t keylen,
                         callback_find_value func)
+        {
+                find_value(dst, key, keylen, func, lookup_param());
+        }
+
+        void
+        dht::find_value(const uint160_t &dst, const void *key, uint16_t keylen,
+                        callback_find_value func, const lookup_param &param)
+        {
+                find_value(dst, key, keylen, func, param, callback_value());
+        }
+
+        void
+        dht::find_value(const uint160_t &dst, const void *key, uint16_t keylen,
+                        callback_find_value func, const lookup_param &param,
+                        callback_value on_value)
         {
                 node_state state = m_nat.get_state();
                 if (state == node_symmetric || state == node_undefined ||
@@ -1703,7 +2921,26 @@ namespace libcage {
                 }
 
 
-                find_nv(dst, func, true, key, keylen);
+                if (m_cache_max > 0 && param.use_cache) {
+                        value_set_ptr p;
+
+                        if (get_cache(dst, key, keylen, p)) {
+                                m_cache_stats.num_hit++;
+
+                                if (on_value) {
+                                        BOOST_FOREACH(const value_t &v, *p) {
+                                                on_value(v);
+                                        }
+                                }
+
+                                func(true, p);
+                                return;
+                        }
+
+                        m_cache_stats.num_miss++;
+                }
+
+                find_nv(dst, func, true, key, keylen, param, on_value);
         }
 
         void
@@ -1800,7 +3037,6 @@ namespace libcage {
         void
         dht::recv_find_value(void *msg, int len, sockaddr *from)
         {
-                boost::shared_array<char> key;
                 msg_dht_find_value_reply *reply;
                 msg_dht_find_value       *req;
                 cageaddr  addr;
@@ -1831,13 +3067,8 @@ namespace libcage {
                 id->from_binary(req->id, sizeof(req->id));
 
                 if (req->flag == get_by_rdp) {
-                        boost::unordered_map<_id, sdata_map>::iterator it;
-                        _id i;
-
-                        i.id = id;
-                        it = m_stored.find(i);
-
-                        if (it != m_stored.end()) {
+                        if (m_stored.find(*id) != m_stored.end() ||
+                            m_cached.find(*id) != m_cached.end()) {
                                 size = sizeof(*reply) - sizeof(reply->data);
 
                                 memset(reply, 0, size);
@@ -1855,64 +3086,50 @@ namespace libcage {
                         }
                 } else if (req->flag == get_by_udp) {
                         // lookup stored data
-                        key = boost::shared_array<char>(new char[keylen]);
-                        memcpy(key.get(), req->key, keylen);
-
-                        boost::unordered_map<_id, sdata_map>::iterator it1;
-                        _id i;
-
-                        i.id = id;
-                        it1 = m_stored.find(i);
-
-                        if (it1 != m_stored.end()) {
-                                sdata_map::iterator it2;
-                                _key k;
-
-                                k.key    = key;
-                                k.keylen = keylen;
+                        sdata_set *sdata;
 
-                                it2 = it1->second.find(k);
+                        sdata = find_sdata(*id, req->key, keylen);
 
-                                if (it2 != it1->second.end()) {
-                                        sdata_set::iterator it3;
-                                        uint16_t i = 1;
-                                        for (it3 = it2->second.begin();
-                                             it3 != it2->second.end(); ++it3) {
-                                                msg_data *data;
-
-                                                size = sizeof(*reply) -
-                                                        sizeof(reply->data) +
-                                                        sizeof(*data) -
-                                                        sizeof(data->data) +
-                                                        it3->keylen +
-                                                        it3->valuelen;
+                        if (sdata != NULL) {
+                                sdata_set::iterator it3;
+                                uint16_t i = 1;
+                                for (it3 = sdata->begin();
+                                     it3 != sdata->end(); ++it3) {
+                                        msg_data *data;
 
-                                                memset(reply, 0, size);
+                                        size = sizeof(*reply) -
+                                                sizeof(reply->data) +
+                                                sizeof(*data) -
+                                                sizeof(data->data) +
+                                                keylen +
+                                                (*it3)->get_valuelen();
 
-                                                reply->nonce = req->nonce;
-                                                reply->flag  = data_are_values;
-                                                reply->index = htons(i);
-                                                reply->total = htons((uint16_t)it2->second.size());
+                                        memset(reply, 0, size);
 
-                                                memcpy(reply->id, req->id, sizeof(reply->id));
+                                        reply->nonce = req->nonce;
+                                        reply->flag  = data_are_values;
+                                        reply->index = htons(i);
+                                        reply->total = htons((uint16_t)sdata->size());
+                                        reply->ttl   = htons((*it3)->remaining_ttl());
 
-                                                data = (msg_data*)reply->data;
+                                        memcpy(reply->id, req->id, sizeof(reply->id));
 
-                                                data->keylen   = htons(it3->keylen);
-                                                data->valuelen = htons(it3->valuelen);
+                                        data = (msg_data*)reply->data;
 
-                                                memcpy(data->data, it3->key.get(),
-                                                       it3->keylen);
-                                                memcpy((char*)data->data + it3->keylen,
-                                                       it3->value.get(), it3->valuelen);
+                                        data->keylen   = htons(keylen);
+                                        data->valuelen = htons((*it3)->get_valuelen());
 
-                                                send_msg(m_udp, &reply->hdr, size,
-                                                         type_dht_find_value_reply,
-                                                         addr, m_id);
-                                        }
+                                        memcpy(data->data, req->key, keylen);
+                                        memcpy((char*)data->data + keylen,
+                                               (*it3)->get_value(),
+                                               (*it3)->get_valuelen());
 
-                                        return;
+                                        send_msg(m_udp, &reply->hdr, size,
+                                                 type_dht_find_value_reply,
+                                                 addr, m_id);
                                 }
+
+                                return;
                         }
                 } else {
                         return;
@@ -1920,7 +3137,7 @@ namespace libcage {
 
                 // reply nodes
                 msg_nodes *data;
-                std::vector<cageaddr>    nodes;
+                std::vector<entry_view>  nodes;
                 uint16_t domain;
 
                 lookup(*id, num_find_node, nodes);
@@ -2023,11 +3240,39 @@ namespace libcage {
 
                         // add to rttale and request cache
                         add(addr);
+                        add_rtt(*addr.id, (uint32_t)(cagetime::now_usec() -
+                                                     t->sent));
                         m_peers.add_node(addr);
 
 
                         q->sent.insert(i);
-                        q->num_query--;
+                        if (t->is_late)
+                                q->num_late--;
+                        else
+                                q->num_query--;
+
+                        m_find_value_stats.num_reply++;
+
+                        // the closest nodes with and without the value
+                        if (reply->flag == data_are_nodes) {
+                                if (! q->miss.id ||
+                                    q->dst->cmp_distance(*addr.id,
+                                                         *q->miss.id) < 0)
+                                        q->miss = addr;
+                        } else {
+                                if (! q->holder ||
+                                    q->dst->cmp_distance(*addr.id,
+                                                         *q->holder) < 0)
+                                        q->holder = addr.id;
+                        }
+
+                        // the hops to the first node which has the value
+                        if (reply->flag != data_are_nodes && q->hop == 0) {
+                                q->hop = q->get_hop(i);
+
+                                m_find_value_stats.num_found++;
+                                m_find_value_stats.num_hop += q->hop;
+                        }
                 }
 
 
@@ -2040,7 +3285,7 @@ namespace libcage {
                         rdp_get_func func(*this, q);
 
                         q->is_rdp_con = true;
-                        q->rdp_time   = time(NULL);
+                        q->rdp_time   = cagetime::now();
 
                         q->rdp_desc = m_rdp.connect(0, addr.id, rdp_get_port,
                                                     func);
@@ -2101,10 +3346,20 @@ namespace libcage {
                         v.value = v_ptr;
                         v.len   = valuelen;
 
-                        q->vset->insert(v);
+                        q->add_ttl(ntohs(reply->ttl));
                         it_val->second.values.insert(v);
                         it_val->second.indeces.insert(index);
 
+                        add_value(q, v);
+
+                        // all the values of this node are here
+                        if (q->is_first_set &&
+                            it_val->second.num_value <=
+                            it_val->second.values.size()) {
+                                recvd_value(q);
+                                return;
+                        }
+
 
                         if (! q->is_timer_recvd_started) {
                                 // start timer
@@ -2174,18 +3429,8 @@ namespace libcage {
                                 return;
                         }
 
-                        // sort
-                        compare cmp;
-                        cmp.m_id = &id;
-                        std::sort(nodes.begin(), nodes.end(), cmp);
-
                         // merge
-                        std::vector<cageaddr> tmp;
-
-                        tmp = q->nodes;
-                        q->nodes.clear();
-
-                        merge_nodes(id, q->nodes, tmp, nodes, num_find_node);
+                        merge_reply(q, i, nodes);
 
                         // send
                         send_find(q);
@@ -2193,117 +3438,666 @@ namespace libcage {
         }
 
         void
-        dht::recvd_value(query_ptr q)
+        dht::find_value_many(const std::vector<uint160_t> &ids,
+                             const std::vector<std::string> &keys,
+                             callback_find_value_many func,
+                             callback_find_value_all done,
+                             const lookup_param &param)
         {
-                // call callback function
-                callback_find_value func;
-                func = boost::get<callback_find_value>(q->func);
-                func(true, q->vset);
+                many_ptr m(new many_query);
+
+                m->ids      = ids;
+                m->keys     = keys;
+                m->param    = param;
+                m->func     = func;
+                m->done     = done;
+                m->num_left = ids.size();
+                m->results.resize(ids.size());
+
+                if (ids.size() == 0) {
+                        if (done)
+                                done(m->results);
+                        return;
+                }
 
-                remove_query(q);
-        }
+                node_state state = m_nat.get_state();
+                if (state == node_symmetric || state == node_undefined ||
+                    state == node_nat) {
+                        for (int i = 0; i < (int)ids.size(); i++) {
+                                many_value_func f;
 
-        void
-        dht::refresh()
-        {
-                boost::unordered_map<_id, sdata_map>::iterator it1;
-                sdata_map::iterator it2;
-                sdata_set::iterator it3;
-                
-                time_t now = time(NULL);
+                                f.m     = m;
+                                f.index = i;
+                                f(false, value_set_ptr());
+                        }
+                        return;
+                }
 
-                for(it1 = m_stored.begin(); it1 != m_stored.end();) {
-                        for (it2 = it1->second.begin();
-                             it2 != it1->second.end();) {
-                                for (it3 = it2->second.begin();
-                                     it3 != it2->second.end();) {
-                                        time_t diff;
-                                        diff = now - it3->stored_time;
-
-                                        if (diff > it3->ttl)
-                                                it2->second.erase(it3++);
-                                        else
-                                                ++it3;
+                std::vector<std::vector<int> > groups;
+                std::vector<int> todo;
+
+                for (int i = 0; i < (int)ids.size(); i++) {
+                        value_set_ptr p;
+
+                        if (m_cache_max > 0 && param.use_cache) {
+                                if (get_cache(ids[i], keys[i].data(),
+                                              keys[i].size(), p)) {
+                                        many_value_func f;
+
+                                        m_cache_stats.num_hit++;
+
+                                        f.m     = m;
+                                        f.index = i;
+                                        f(true, p);
+                                        continue;
                                 }
 
-                                if (it2->second.size() == 0)
-                                        it1->second.erase(it2++);
-                                else
-                                        ++it2;
+                                m_cache_stats.num_miss++;
                         }
 
-                        if (it1->second.size() == 0)
-                                m_stored.erase(it1++);
-                        else
-                                ++it1;
+                        todo.push_back(i);
                 }
-        }
 
-        bool
-        dht::restore_func::restore_by_udp(std::vector<cageaddr> &nodes,
-                                          sdata_set::iterator &it)
-        {
-                msg_dht_store *msg;
-                uint16_t       ttl;
-                int            size;
-                char           buf[1024 * 2];
-                char          *p_key, *p_value;
-                time_t         now = time(NULL);
-                time_t         diff;
-                bool           me = false;
+                group_keys(ids, todo, groups);
 
-                if (it->original > 0)
-                        return true;
-                        
+                BOOST_FOREACH(std::vector<int> &g, groups) {
+                        if (g.size() == 1) {
+                                many_value_func f;
 
-                size = sizeof(*msg) - sizeof(msg->data) +
-                        it->keylen + it->valuelen;
+                                f.m     = m;
+                                f.index = g[0];
 
-                if (size > (int)sizeof(buf))
-                        return false;
+                                find_nv(ids[g[0]], callback_find_value(f),
+                                        true, keys[g[0]].data(),
+                                        keys[g[0]].size(), param);
+                        } else {
+                                many_node_func f;
 
-                diff = now - it->stored_time;
-                if (diff >= it->ttl)
-                        return false;
+                                f.m       = m;
+                                f.indices = g;
+                                f.p_dht   = this;
 
-                if (it->original > 0) {
-                        store_func sfunc;
+                                find_node(ids[g[0]], f, param);
+                        }
+                }
+        }
 
-                        sfunc.key       = it->key;
-                        sfunc.value     = it->value;
-                        sfunc.id        = it->id;
-                        sfunc.from      = it->src;
-                        sfunc.keylen    = it->keylen;
-                        sfunc.valuelen  = it->valuelen;
-                        sfunc.ttl       = it->ttl - diff;
-                        sfunc.is_unique = it->is_unique;
-                        sfunc.p_dht     = p_dht;
+        void
+        dht::group_keys(const std::vector<uint160_t> &ids,
+                        const std::vector<int> &indices,
+                        std::vector<std::vector<int> > &groups)
+        {
+                // by the closest node in my routing table
+                std::map<uint160_t, std::vector<int> > m;
+                std::map<uint160_t, std::vector<int> >::iterator it;
 
-                        p_dht->find_node(*it->id, sfunc);
+                BOOST_FOREACH(int i, indices) {
+                        std::vector<cageaddr> nodes;
 
-                        return true;
+                        lookup(ids[i], 1, nodes);
+
+                        if (nodes.empty())
+                                groups.push_back(std::vector<int>(1, i));
+                        else
+                                m[*nodes[0].id].push_back(i);
                 }
 
-                ttl = it->ttl - diff;
+                for (it = m.begin(); it != m.end(); ++it)
+                        groups.push_back(it->second);
+        }
 
-                msg = (msg_dht_store*)buf;
+        void
+        dht::store_many(const std::vector<uint160_t> &ids,
+                        const std::vector<std::string> &keys,
+                        const std::vector<std::string> &values,
+                        uint16_t ttl, bool is_unique)
+        {
+                std::vector<std::vector<int> > groups;
+                std::vector<store_func> recs(ids.size());
+                std::vector<int> todo;
+                id_ptr from(new uint160_t(m_id));
+
+                for (int i = 0; i < (int)ids.size(); i++) {
+                        store_func &f = recs[i];
+
+                        f.id        = id_ptr(new uint160_t(ids[i]));
+                        f.key       = boost::shared_array<char>(
+                                new char[keys[i].size()]);
+                        f.value     = boost::shared_array<char>(
+                                new char[values[i].size()]);
+                        f.keylen    = keys[i].size();
+                        f.valuelen  = values[i].size();
+                        f.ttl       = ttl;
+                        f.is_unique = is_unique;
+                        f.from      = from;
+                        f.p_dht     = this;
+
+                        memcpy(f.key.get(), keys[i].data(), f.keylen);
+                        memcpy(f.value.get(), values[i].data(), f.valuelen);
+
+
+                        // the cached values of the key are stale now
+                        cache_map::iterator it;
+                        _id id;
+
+                        id.id = f.id;
+                        it = m_cache.find(id);
+                        if (it != m_cache.end())
+                                erase_cache(it);
+
+
+                        // store to local
+                        stored_data data;
+
+                        data.key         = f.key;
+                        data.value       = f.value;
+                        data.keylen      = f.keylen;
+                        data.valuelen    = f.valuelen;
+                        data.ttl         = ttl;
+                        data.stored_time = cagetime::now();
+                        data.id          = f.id;
+                        data.original    = original_put_num;
+                        data.src         = from;
+                        data.is_unique   = is_unique;
+
+                        if (ttl == 0) {
+                                erase_sdata(data);
+                        } else {
+                                add_sdata(data, true);
+                        }
+
+                        todo.push_back(i);
+                }
+
+                group_keys(ids, todo, groups);
+
+                store_many_ptr sm(new store_many_query);
+
+                sm->recs.swap(recs);
+                sm->replicas.resize(ids.size());
+                sm->num_left = todo.size();
+
+                BOOST_FOREACH(std::vector<int> &g, groups) {
+                        if (g.size() == 1) {
+                                store_many_node_func f;
+
+                                f.s     = sm;
+                                f.index = g[0];
+                                f.p_dht = this;
+
+                                find_node(ids[g[0]], f);
+                        } else {
+                                store_many_func f;
+
+                                f.s       = sm;
+                                f.indices = g;
+                                f.p_dht   = this;
+
+                                find_node(ids[g[0]], f);
+                        }
+                }
+        }
+
+        void
+        dht::store_many_func::operator() (std::vector<cageaddr>& nodes)
+        {
+                // the keys of a group share a few bits only when the
+                // network is larger than my routing table. each key needs
+                // its own closest nodes
+                BOOST_FOREACH(int i, indices) {
+                        store_many_node_func f;
+
+                        f.s     = s;
+                        f.index = i;
+                        f.p_dht = p_dht;
+
+                        p_dht->find_nv(*s->recs[i].id, callback_find_node(f),
+                                       false, NULL, 0, lookup_param(),
+                                       callback_value(), &nodes);
+                }
+        }
+
+        void
+        dht::store_many_node_func::operator() (std::vector<cageaddr>& nodes)
+        {
+                s->replicas[index] = nodes;
+
+                if (--s->num_left == 0)
+                        p_dht->send_store_many(s);
+        }
+
+        void
+        dht::send_store_many(store_many_ptr s)
+        {
+                // the records for each node
+                typedef std::pair<cageaddr, std::vector<int> > batch;
+                std::map<_id, batch> batches;
+                std::map<_id, batch>::iterator it;
+
+                for (int n = 0; n < (int)s->recs.size(); n++) {
+                        std::vector<cageaddr> &replicas = s->replicas[n];
+                        store_func &f = s->recs[n];
+                        bool me = false;
+
+                        if (! m_is_use_rdp) {
+                                me = f.store_by_udp(replicas);
+                                f.done(replicas, me);
+                                continue;
+                        }
+
+                        BOOST_FOREACH(cageaddr &addr, replicas) {
+                                _id i;
+
+                                if (*addr.id == m_id) {
+                                        me = true;
+                                        continue;
+                                }
+
+                                i.id = addr.id;
+
+                                batch &b = batches[i];
+                                b.first = addr;
+                                b.second.push_back(n);
+                        }
+
+                        f.done(replicas, me);
+                }
+
+                // one RDP stream per node, split when it gets long
+                for (it = batches.begin(); it != batches.end(); ++it) {
+                        std::vector<int> &idx = it->second.second;
+                        int i = 0;
+
+                        while (i < (int)idx.size()) {
+                                rdp_store_many_func func;
+                                int size = 0;
+
+                                func.p_dht = this;
+
+                                do {
+                                        store_func &f = s->recs[idx[i++]];
+
+                                        size += sizeof(msg_dht_rdp_store);
+                                        size += f.keylen + f.valuelen;
+                                        func.recs.push_back(f);
+                                } while (i < (int)idx.size() &&
+                                         size < store_stream_max);
+
+                                int desc;
+                                desc = m_rdp.connect(0, it->second.first.id,
+                                                     rdp_store_port, func);
+                                if (desc <= 0)
+                                        continue;
+
+                                m_rdp_store[desc] = cagetime::now();
+                        }
+                }
+        }
+
+        void
+        dht::rdp_store_many_func::operator() (int desc, rdp_addr addr,
+                                              rdp_event event)
+        {
+                switch (event) {
+                case CONNECTED:
+                {
+                        // write the records at once so that they are sent
+                        // in full segments. store_stream_max keeps them
+                        // within the send window
+                        std::vector<char> buf;
+
+                        for (int i = 0; i < (int)recs.size(); i++) {
+                                store_func &f = recs[i];
+                                msg_dht_rdp_store msg;
+                                int pos = buf.size();
+
+                                memset(&msg, 0, sizeof(msg));
+
+                                f.id->to_binary(&msg.id, sizeof(msg.id));
+                                f.from->to_binary(&msg.from, sizeof(msg.from));
+
+                                msg.keylen   = htons(f.keylen);
+                                msg.valuelen = htons(f.valuelen);
+                                msg.ttl      = htons(f.ttl);
+
+                                if (f.is_unique)
+                                        msg.flags |= dht_flag_unique;
+
+                                if (i + 1 < (int)recs.size())
+                                        msg.flags |= dht_flag_more;
+
+                                buf.resize(pos + sizeof(msg) + f.keylen +
+                                           f.valuelen);
+
+                                memcpy(&buf[pos], &msg, sizeof(msg));
+                                pos += sizeof(msg);
+                                memcpy(&buf[pos], f.key.get(), f.keylen);
+                                pos += f.keylen;
+                                memcpy(&buf[pos], f.value.get(), f.valuelen);
+                        }
+
+                        p_dht->m_rdp.send(desc, &buf[0], buf.size());
+                        break;
+                }
+                case READY2READ:
+                {
+                        // the result of the stores, refused if any of
+                        // them was
+                        uint8_t status;
+                        int     size = sizeof(status);
+
+                        p_dht->m_rdp.receive(desc, &status, &size);
+
+                        if (size != sizeof(status))
+                                break;
+
+                        finish(desc, addr, status == dht_store_ok);
+                        break;
+                }
+                case RESET:
+                        // nodes without the status byte close the stream
+                        // once the values are stored
+                        finish(desc, addr, true);
+                        break;
+                default:
+                        finish(desc, addr, false);
+                        break;
+                }
+        }
+
+        void
+        dht::rdp_store_many_func::finish(int desc, rdp_addr &addr, bool is_ok)
+        {
+                if (is_ok) {
+                        BOOST_FOREACH(store_func &f, recs) {
+                                stored_data sdata;
+
+                                sdata.value    = f.value;
+                                sdata.valuelen = f.valuelen;
+                                sdata.key      = f.key;
+                                sdata.keylen   = f.keylen;
+                                sdata.id       = f.id;
+
+                                p_dht->insert2recvd_sdata(sdata, addr.did);
+                        }
+                }
+
+                p_dht->m_rdp_store.erase(desc);
+                p_dht->m_rdp.close(desc);
+        }
+
+        void
+        dht::many_node_func::operator() (std::vector<cageaddr> &nodes)
+        {
+                lookup_param param = m->param;
+
+                // the nodes are close to the keys already, one request at
+                // a time mostly reaches a node with the value first
+                if (param.alpha == 0)
+                        param.alpha = many_alpha;
+
+                BOOST_FOREACH(int i, indices) {
+                        many_value_func f;
+
+                        f.m     = m;
+                        f.index = i;
+
+                        p_dht->find_nv(m->ids[i], callback_find_value(f),
+                                       true, m->keys[i].data(),
+                                       m->keys[i].size(), param,
+                                       callback_value(), &nodes);
+                }
+        }
+
+        void
+        dht::many_value_func::operator() (bool result, value_set_ptr vset)
+        {
+                if (result)
+                        m->results[index] = vset;
+
+                if (m->func)
+                        m->func(index, result, vset);
+
+                if (--m->num_left == 0 && m->done)
+                        m->done(m->results);
+        }
+
+        void
+        dht::add_value(query_ptr q, value_t &v)
+        {
+                if (! q->vset->insert(v).second)
+                        return;
+
+                // a callback may start lookups joining this query
+                std::vector<callback_value> on_values(q->on_values);
+
+                BOOST_FOREACH(callback_value &f, on_values) {
+                        f(v);
+                }
+        }
+
+        void
+        dht::recvd_value(query_ptr q)
+        {
+                // call callback functions
+                std::vector<callback_func> funcs;
+
+                put_cache(q);
+
+                if (m_is_path_cache)
+                        cache_on_path(q);
+
+                unlink_query(q);
+                funcs.swap(q->funcs);
+
+                BOOST_FOREACH(callback_func &f, funcs) {
+                        callback_find_value func;
+                        func = boost::get<callback_find_value>(f);
+                        func(true, q->vset);
+                }
+
+                remove_query(q);
+        }
+
+        void
+        dht::refresh()
+        {
+                // only the values whose expiry came up are looked at
+                time_t now = cagetime::now();
+
+                while (! m_expiry.empty() && m_expiry.top().time < now) {
+                        expiry e = m_expiry.top();
+
+                        m_expiry.pop();
+                        expire(e, now);
+                }
+        }
+
+        void
+        dht::expire(const expiry &e, time_t now)
+        {
+                stored_map &stored = e.is_cached ? m_cached : m_stored;
+                stored_map::iterator it1;
+                sdata_map::iterator  it2;
+                sdata_set::iterator  it3;
+
+                it1 = stored.find(e.key->get_id());
+                if (it1 == stored.end())
+                        return;
+
+                it2 = find_key(it1->second, e.key->get_key(),
+                               e.key->get_keylen());
+                if (it2 == it1->second.end())
+                        return;
+
+                for (it3 = it2->second.begin(); it3 != it2->second.end();) {
+                        // another entry is for the value, or it was erased
+                        if (it3->get() != e.val ||
+                            (*it3)->expire_at != e.time) {
+                                ++it3;
+                                continue;
+                        }
+
+                        if (now - (*it3)->stored_time > (*it3)->ttl) {
+                                if (e.is_cached) {
+                                        size_t bytes;
+
+                                        bytes = sdata_bytes(
+                                                it2->first->get_keylen(),
+                                                (*it3)->get_valuelen());
+
+                                        m_num_cached--;
+                                        m_cached_bytes -= bytes;
+                                        sub_src_bytes((*it3)->get_src(),
+                                                      bytes);
+                                } else {
+                                        sub_store_stats(*it2->first, **it3);
+                                        m_sstore->erase(*it2->first, **it3);
+                                }
+
+                                it2->second.erase(it3++);
+                                continue;
+                        }
+
+                        // the ttl was extended
+                        expiry next = e;
+
+                        next.time         = (*it3)->stored_time + (*it3)->ttl;
+                        (*it3)->expire_at = next.time;
+
+                        m_expiry.push(next);
+                        ++it3;
+                }
+
+                if (it2->second.size() == 0)
+                        it1->second.erase(it2);
+
+                if (it1->second.size() == 0)
+                        stored.erase(it1);
+        }
+
+        void
+        dht::add_expiry(skey_ptr key, sval &val, bool is_cached)
+        {
+                expiry e;
+
+                // the entries of erased values hold their keys until
+                // they come up, so do not let them outnumber the others
+                if (m_expiry.size() > 2 * (m_store_stats.items +
+                                           m_num_cached) + 1024)
+                        rebuild_expiry();
+
+                e.time      = val.stored_time + val.ttl;
+                e.key       = key;
+                e.val       = &val;
+                e.is_cached = is_cached;
+
+                val.expire_at = e.time;
+
+                m_expiry.push(e);
+        }
+
+        void
+        dht::rebuild_expiry()
+        {
+                stored_map *stored[] = {
+                        &m_stored, &m_cached
+                };
+
+                m_expiry = expiry_heap();
+
+                for (int n = 0; n < 2; n++) {
+                        stored_map::iterator it1;
+                        sdata_map::iterator  it2;
+                        sdata_set::iterator  it3;
+
+                        for (it1 = stored[n]->begin();
+                             it1 != stored[n]->end(); ++it1) {
+                                for (it2 = it1->second.begin();
+                                     it2 != it1->second.end(); ++it2) {
+                                        for (it3 = it2->second.begin();
+                                             it3 != it2->second.end(); ++it3)
+                                                add_expiry(it2->first, **it3,
+                                                           n == 1);
+                                }
+                        }
+                }
+        }
+
+        void
+        dht::update_expiry(skey_ptr key, sval &val, bool is_cached)
+        {
+                // a later expiry is rescheduled when the entry comes up
+                if (val.stored_time + val.ttl < val.expire_at)
+                        add_expiry(key, val, is_cached);
+        }
+
+        bool
+        dht::restore_func::restore_by_udp(std::vector<cageaddr> &nodes,
+                                          const skey &key, sval &val)
+        {
+                msg_dht_store *msg;
+                uint16_t       ttl;
+                int            size;
+                char           buf[1024 * 2];
+                char          *p_key, *p_value;
+                time_t         now = cagetime::now();
+                time_t         diff;
+                bool           me = false;
+
+                size = sizeof(*msg) - sizeof(msg->data) +
+                        key.get_keylen() + val.get_valuelen();
+
+                if (size > (int)sizeof(buf))
+                        return false;
+
+                diff = now - val.stored_time;
+                if (diff >= val.ttl)
+                        return false;
+
+                if (val.original > 0) {
+                        store_func  sfunc;
+                        stored_data sdata;
+
+                        to_sdata(key, val, sdata);
+
+                        sfunc.key       = sdata.key;
+                        sfunc.value     = sdata.value;
+                        sfunc.id        = sdata.id;
+                        sfunc.from      = sdata.src;
+                        sfunc.keylen    = sdata.keylen;
+                        sfunc.valuelen  = sdata.valuelen;
+                        sfunc.ttl       = sdata.ttl - diff;
+                        sfunc.is_unique = sdata.is_unique;
+                        sfunc.p_dht     = p_dht;
+
+                        p_dht->find_node(*sdata.id, sfunc);
+
+                        sent += size * nodes.size();
+
+                        return true;
+                }
+
+                ttl = val.ttl - diff;
+
+                msg = (msg_dht_store*)buf;
 
                 memset(msg, 0, sizeof(*msg));
 
-                msg->keylen   = htons(it->keylen);
-                msg->valuelen = htons(it->valuelen);
+                msg->keylen   = htons(key.get_keylen());
+                msg->valuelen = htons(val.get_valuelen());
                 msg->ttl      = htons(ttl);
 
-                it->id->to_binary(msg->id, sizeof(msg->id));
-                it->src->to_binary(msg->from, sizeof(msg->from));
+                key.get_id().to_binary(msg->id, sizeof(msg->id));
+                val.get_src().to_binary(msg->from, sizeof(msg->from));
 
                 p_key   = (char*)msg->data;
-                p_value = p_key + it->keylen;
+                p_value = p_key + key.get_keylen();
 
-                memcpy(p_key, it->key.get(), it->keylen);
-                memcpy(p_value, it->value.get(), it->valuelen);
+                memcpy(p_key, key.get_key(), key.get_keylen());
+                memcpy(p_value, val.get_value(), val.get_valuelen());
 
-                if (it->is_unique)
+                if (val.is_unique)
                         msg->flags = dht_flag_unique;
 
                 BOOST_FOREACH(cageaddr &addr, nodes) {
@@ -2312,16 +4106,15 @@ namespace libcage {
                                 continue;
                         }
 
-                        _id i;
-
-                        i.id = addr.id;
-                        if (it->recvd.find(i) != it->recvd.end())
+                        if (val.is_recvd(*addr.id))
                                 continue;
 
-                        it->recvd.insert(i);
+                        val.insert_recvd(*addr.id);
 
                         send_msg(p_dht->m_udp, &msg->hdr, size, type_dht_store,
                                  addr, p_dht->m_id);
+
+                        sent += size;
                 }
 
                 return me;
@@ -2329,43 +4122,52 @@ namespace libcage {
 
         bool
         dht::restore_func::restore_by_rdp(std::vector<cageaddr> &nodes,
-                                          sdata_set::iterator &it)
+                                          const skey &key, sval &val)
         {
                 rdp_store_func func;
-                time_t         now = time(NULL);
+                stored_data    sdata;
+                time_t         now = cagetime::now();
                 time_t         diff;
+                size_t         size;
                 bool           me = false;
 
-                diff = now - it->stored_time;
-                if (diff >= it->ttl)
+                diff = now - val.stored_time;
+                if (diff >= val.ttl)
                         return false;
 
-                if (it->original > 0) {
+                to_sdata(key, val, sdata);
+
+                size = sizeof(msg_dht_rdp_store) + sdata.keylen +
+                       sdata.valuelen;
+
+                if (val.original > 0) {
                         store_func sfunc;
 
-                        sfunc.key       = it->key;
-                        sfunc.value     = it->value;
-                        sfunc.id        = it->id;
-                        sfunc.from      = it->src;
-                        sfunc.keylen    = it->keylen;
-                        sfunc.valuelen  = it->valuelen;
-                        sfunc.ttl       = it->ttl - diff;
-                        sfunc.is_unique = it->is_unique;
+                        sfunc.key       = sdata.key;
+                        sfunc.value     = sdata.value;
+                        sfunc.id        = sdata.id;
+                        sfunc.from      = sdata.src;
+                        sfunc.keylen    = sdata.keylen;
+                        sfunc.valuelen  = sdata.valuelen;
+                        sfunc.ttl       = sdata.ttl - diff;
+                        sfunc.is_unique = sdata.is_unique;
                         sfunc.p_dht     = p_dht;
 
-                        p_dht->find_node(*it->id, sfunc);
+                        p_dht->find_node(*sdata.id, sfunc);
+
+                        sent += size * nodes.size();
 
                         return true;
                 }
 
-                func.key       = it->key;
-                func.value     = it->value;
-                func.keylen    = it->keylen;
-                func.valuelen  = it->valuelen;
-                func.ttl       = it->ttl;
-                func.id        = it->id;
-                func.from      = it->src;
-                func.is_unique = it->is_unique;
+                func.key       = sdata.key;
+                func.value     = sdata.value;
+                func.keylen    = sdata.keylen;
+                func.valuelen  = sdata.valuelen;
+                func.ttl       = sdata.ttl;
+                func.id        = sdata.id;
+                func.from      = sdata.src;
+                func.is_unique = sdata.is_unique;
                 func.p_dht     = p_dht;
 
                 BOOST_FOREACH(cageaddr &addr, nodes) {
@@ -2374,10 +4176,7 @@ namespace libcage {
                                 continue;
                         }
 
-                        _id    i;
-
-                        i.id = addr.id;
-                        if (it->recvd.find(i) != it->recvd.end())
+                        if (val.is_recvd(*addr.id))
                                 continue;
 
                         int desc;
@@ -2387,61 +4186,14 @@ namespace libcage {
                         if (desc <= 0)
                                 continue;
 
-                        p_dht->m_rdp_store[desc] = time(NULL);
+                        p_dht->m_rdp_store[desc] = cagetime::now();
+
+                        sent += size;
                 }
 
                 return me;
         }
 
-        void
-        dht::restore_func::operator() (std::vector<cageaddr> &n)
-        {
-                boost::unordered_map<_id, sdata_map>::iterator it1;
-                sdata_map::iterator   it2;
-                sdata_set::iterator   it3;
-                std::vector<cageaddr> nodes;
-
-                for(it1 = p_dht->m_stored.begin();
-                    it1 != p_dht->m_stored.end();) {
-                        nodes.clear();
-                        p_dht->lookup(*it1->first.id, num_find_node, nodes);
-
-                        if (nodes.size() == 0) {
-                                ++it1;
-                                continue;
-                        }
-
-                        for (it2 = it1->second.begin();
-                             it2 != it1->second.end();) {
-                                for (it3 = it2->second.begin();
-                                     it3 != it2->second.end();) {
-                                        bool me;
-
-                                        if (p_dht->m_is_use_rdp) {
-                                                me = restore_by_rdp(nodes, it3);
-                                        } else {
-                                                me = restore_by_udp(nodes, it3);
-                                        }
-
-                                        if (! me)
-                                                it2->second.erase(it3++);
-                                        else
-                                                ++it3;
-                                }
-
-                                if (it2->second.size() == 0)
-                                        it1->second.erase(it2++);
-                                else
-                                        ++it2;
-                        }
-
-                        if (it1->second.size() == 0)
-                                p_dht->m_stored.erase(it1++);
-                        else
-                                ++it1;
-                }
-        }
-
         void
         dht::sync_node::operator() (cageaddr &addr)
         {
@@ -2452,7 +4204,7 @@ namespace libcage {
         void
         dht::sweep_rdp()
         {
-                time_t now = time(NULL);
+                time_t now = cagetime::now();
                 time_t diff;
 
                 std::map<int, rdp_recv_store_ptr>::iterator it1;
@@ -2507,7 +4259,7 @@ namespace libcage {
                                         id_ptr id = it4->second->ids.front();
 
                                         it4->second->ids.pop();
-                                        it4->second->rdp_time = time(NULL);
+                                        it4->second->rdp_time = cagetime::now();
                                         it4->second->rdp_desc = m_rdp.connect(rdp_get_port,
                                                                 id, 0, func);
                                 } else {
@@ -2520,25 +4272,244 @@ namespace libcage {
                 }
         }
 
+        void
+        dht::set_restore_rate(size_t bytes)
+        {
+                m_restore_rate   = bytes;
+                m_restore_tokens = 0;
+        }
+
+        // called every restore_tick. goes through the values a pass should
+        // have by now, and sends the ones found to be sent as the rate
+        // allows
         void
         dht::restore()
         {
                 node_state state = m_nat.get_state();
+                uint64_t   now   = cagetime::now_usec();
+                uint64_t   elapsed;
+
+                elapsed = now - m_restore_time;
+                m_restore_time = now;
+
                 if (state == node_symmetric || state == node_undefined ||
                     state == node_nat)
                         return;
 
-                time_t diff;
-                diff = time(NULL) - m_last_restore;
+                // tokens of a tick are kept at most
+                if (m_restore_rate > 0) {
+                        int64_t max = (int64_t)m_restore_rate * restore_tick;
+
+                        m_restore_tokens += (int64_t)(m_restore_rate *
+                                                      elapsed / 1000000);
+                        if (m_restore_tokens > max)
+                                m_restore_tokens = max;
+                }
+
+                send_restore();
+
+                // the values found are sent before going further
+                if (! m_restore_changed.empty() || ! m_restore_origin.empty())
+                        return;
+
+                if (m_restore_bucket >= m_restore_buckets) {
+                        if (cagetime::now() - m_last_restore <
+                            restore_interval)
+                                return;
+
+                        m_last_restore    = cagetime::now();
+                        m_restore_start   = now;
+                        m_restore_bucket  = 0;
+                        m_restore_buckets = m_stored.bucket_count();
+                        m_restore_stats.num_pass++;
+
+                        find_node(m_id, no_action);
+                }
+
+                walk_restore(now - m_restore_start);
+                send_restore();
+        }
+
+        // goes through the buckets of m_stored up to the share of usec in
+        // restore_interval
+        void
+        dht::walk_restore(uint64_t usec)
+        {
+                std::vector<uint160_t> ids;
+                size_t n = m_stored.bucket_count();
+                size_t bucket;
+
+                // rehashed during the pass
+                if (n != m_restore_buckets && m_restore_buckets > 0)
+                        m_restore_bucket = (uint64_t)m_restore_bucket * n /
+                                           m_restore_buckets;
+
+                m_restore_buckets = n;
+
+                if (usec >= (uint64_t)restore_interval * 1000000)
+                        bucket = n;
+                else
+                        bucket = (uint64_t)n * usec /
+                                 ((uint64_t)restore_interval * 1000000);
+
+                for (; m_restore_bucket < bucket; m_restore_bucket++) {
+                        stored_map::local_iterator it;
+
+                        for (it = m_stored.begin(m_restore_bucket);
+                             it != m_stored.end(m_restore_bucket); ++it) {
+                                ids.push_back(it->first);
+                        }
+                }
+
+                BOOST_FOREACH(const uint160_t &id, ids) {
+                        restore_id(id);
+                }
+        }
+
+        // queues the values of id which the closest nodes do not have,
+        // and the ones put by this node to be put again. the values this
+        // node should no longer have are erased after they are sent
+        void
+        dht::restore_id(const uint160_t &id)
+        {
+                stored_map::iterator  it1;
+                sdata_map::iterator   it2;
+                sdata_set::iterator   it3;
+                std::vector<cageaddr> nodes;
+                time_t now = cagetime::now();
+                bool   me  = false;
+
+                it1 = m_stored.find(id);
+                if (it1 == m_stored.end())
+                        return;
+
+                lookup(id, m_param.k, nodes);
+
+                if (nodes.size() == 0)
+                        return;
+
+                BOOST_FOREACH(cageaddr &addr, nodes) {
+                        if (*addr.id == m_id)
+                                me = true;
+                }
 
-                if (diff >= restore_interval) {
-                        m_last_restore = time(NULL);
+                for (it2 = it1->second.begin(); it2 != it1->second.end();) {
+                        for (it3 = it2->second.begin();
+                             it3 != it2->second.end();) {
+                                restore_item item;
+                                bool is_changed = ! me;
+
+                                item.key        = it2->first;
+                                item.val        = *it3;
+                                // the values put by this node are erased
+                                // by store_func::done once put enough
+                                item.is_dropped = ! me &&
+                                                  item.val->original == 0;
+
+                                if (now - item.val->stored_time >=
+                                    item.val->ttl) {
+                                        item.is_dropped = true;
+                                        is_changed      = false;
+                                } else {
+                                        BOOST_FOREACH(cageaddr &addr, nodes) {
+                                                if (*addr.id != m_id &&
+                                                    ! item.val->is_recvd(
+                                                            *addr.id))
+                                                        is_changed = true;
+                                        }
+                                }
 
-                        restore_func rfunc;
+                                if (is_changed)
+                                        m_restore_changed.push_back(item);
+                                else if (item.val->original > 0 &&
+                                         ! item.is_dropped)
+                                        m_restore_origin.push_back(item);
+
+                                if (item.is_dropped) {
+                                        sub_store_stats(*item.key,
+                                                        *item.val);
+                                        m_sstore->erase(*item.key, *item.val);
+                                        it2->second.erase(it3++);
+                                } else {
+                                        ++it3;
+                                }
+                        }
 
-                        rfunc.p_dht = this;
-                        find_node(m_id, rfunc);
+                        if (it2->second.size() == 0)
+                                it2 = it1->second.erase(it2);
+                        else
+                                ++it2;
                 }
+
+                if (it1->second.size() == 0)
+                        m_stored.erase(it1);
+        }
+
+        void
+        dht::send_restore()
+        {
+                restore_func rfunc;
+
+                rfunc.p_dht = this;
+
+                while (m_restore_rate == 0 || m_restore_tokens > 0) {
+                        std::deque<restore_item> &q =
+                                m_restore_changed.empty() ?
+                                m_restore_origin : m_restore_changed;
+                        std::vector<cageaddr> nodes;
+                        restore_item item;
+
+                        if (q.empty())
+                                break;
+
+                        item = q.front();
+                        q.pop_front();
+
+                        // erased meanwhile
+                        if (! item.is_dropped &&
+                            ! is_stored(*item.key, item.val))
+                                continue;
+
+                        lookup(item.key->get_id(), m_param.k, nodes);
+
+                        rfunc.sent = 0;
+
+                        if (m_is_use_rdp)
+                                rfunc.restore_by_rdp(nodes, *item.key,
+                                                     *item.val);
+                        else
+                                rfunc.restore_by_udp(nodes, *item.key,
+                                                     *item.val);
+
+                        m_restore_tokens       -= rfunc.sent;
+                        m_restore_stats.bytes  += rfunc.sent;
+
+                        if (rfunc.sent > 0)
+                                m_restore_stats.num_sent++;
+                }
+
+                m_restore_stats.queued = m_restore_changed.size() +
+                                         m_restore_origin.size();
+        }
+
+        bool
+        dht::is_stored(const skey &key, const sval_ptr &val)
+        {
+                stored_map::iterator it1;
+                sdata_map::iterator  it2;
+                sdata_set::iterator  it3;
+
+                it1 = m_stored.find(key.get_id());
+                if (it1 == m_stored.end())
+                        return false;
+
+                it2 = find_key(it1->second, key.get_key(), key.get_keylen());
+                if (it2 == it1->second.end())
+                        return false;
+
+                it3 = it2->second.find(val);
+
+                return it3 != it2->second.end() && *it3 == val;
         }
 
         void
@@ -40,9 +40,15 @@
 #include "peers.hpp"
 #include "rttable.hpp"
 #include "rdp.hpp"
+#include "sdata.hpp"
+#include "sstore.hpp"
 #include "udphandler.hpp"
 
+#include <deque>
+#include <functional>
+#include <list>
 #include <map>
+#include <queue>
 #include <set>
 #include <string>
 #include <vector>
@@ -58,19 +64,43 @@
 namespace libcage {
         class proxy;
 
+        // counters of the lookups started by a node
+        class lookup_stats {
+        public:
+                uint64_t        num_lookup;
+                uint64_t        num_coalesced; // joined one in flight
+                uint64_t        num_request; // find_node/value sent
+                uint64_t        num_reply;
+                uint64_t        num_found;   // lookups which got an answer
+                uint64_t        num_hop;     // total hops to the answers
+
+                lookup_stats() : num_lookup(0), num_coalesced(0),
+                                 num_request(0), num_reply(0), num_found(0),
+                                 num_hop(0) { }
+        };
+
         class dht : public rttable {
         private:
                 static const int        num_find_node;
                 static const int        max_query;
                 static const int        query_timeout;
+                static const int        late_wait;
                 static const int        restore_interval;
+                static const int        restore_tick;
                 static const int        slow_timer_interval;
                 static const int        fast_timer_interval;
+                static const int        compact_interval;
                 static const int        original_put_num;
                 static const int        recvd_value_timeout;
                 static const uint16_t   rdp_store_port;
                 static const uint16_t   rdp_get_port;
                 static const time_t     rdp_timeout;
+                static const uint16_t   path_cache_ttl;
+                static const int        path_cache_max;
+                static const int        many_alpha;
+                static const int        store_stream_max;
+                static const int        store_ack_timeout;
+                static const int        sdata_overhead;
 
         public:
                 class value_t {
@@ -96,10 +126,56 @@ namespace libcage {
                 typedef std::set<value_t>             value_set;
                 typedef boost::shared_ptr<value_set>  value_set_ptr;
 
+                // counters of the value cache
+                class cache_stats {
+                public:
+                        uint64_t        num_hit;
+                        uint64_t        num_miss;
+                        uint64_t        num_expired;
+                        uint64_t        num_evicted;
+                        uint64_t        bytes;  // used now
+
+                        cache_stats() : num_hit(0), num_miss(0),
+                                        num_expired(0), num_evicted(0),
+                                        bytes(0) { }
+                };
+
+                // counters of the values stored for the nodes
+                class store_stats {
+                public:
+                        uint64_t        bytes;  // used now
+                        uint64_t        items;  // stored now
+                        uint64_t        num_evicted;
+                        uint64_t        num_rejected;   // over a limit
+
+                        store_stats() : bytes(0), items(0), num_evicted(0),
+                                        num_rejected(0) { }
+                };
+
+                // counters of the restore of the stored values to the
+                // nodes closest to them
+                class restore_stats {
+                public:
+                        uint64_t        num_pass;       // over the values
+                        uint64_t        num_sent;       // values
+                        uint64_t        bytes;          // sent about
+                        uint64_t        queued;         // to be sent now
+
+                        restore_stats() : num_pass(0), num_sent(0), bytes(0),
+                                          queued(0) { }
+                };
+
 
                 typedef boost::function<void (std::vector<cageaddr>&)>
                 callback_find_node;
                 typedef boost::function<void (bool, value_set_ptr)> callback_find_value;
+                typedef boost::function<void (const value_t&)> callback_value;
+                typedef boost::function<void (int, bool, value_set_ptr)>
+                callback_find_value_many;
+                typedef boost::function<void (std::vector<value_set_ptr>&)>
+                callback_find_value_all;
+                typedef boost::function<void (int, int, uint64_t)>
+                callback_store;
                 typedef boost::variant<callback_find_node,
                                        callback_find_value> callback_func;
 
@@ -120,10 +196,15 @@ namespace libcage {
                 void            recv_find_value_reply(void *msg, int len,
                                                       sockaddr *from);
                 void            recv_store(void *msg, int len, sockaddr *from);
+                void            recv_store_reply(void *msg, int len,
+                                                 sockaddr *from);
 
 
                 void            find_node(const uint160_t &dst,
                                           callback_find_node func);
+                void            find_node(const uint160_t &dst,
+                                          callback_find_node func,
+                                          const lookup_param &param);
                 void            find_node(std::string host, int port,
                                           callback_find_node func);
                 void            find_node(sockaddr *saddr,
@@ -131,6 +212,39 @@ namespace libcage {
                 void            find_value(const uint160_t &dst,
                                            const void *key, uint16_t keylen,
                                            callback_find_value func);
+                void            find_value(const uint160_t &dst,
+                                           const void *key, uint16_t keylen,
+                                           callback_find_value func,
+                                           const lookup_param &param);
+
+                // on_value is called with each value as it arrives,
+                // before func is called with all of them
+                void            find_value(const uint160_t &dst,
+                                           const void *key, uint16_t keylen,
+                                           callback_find_value func,
+                                           const lookup_param &param,
+                                           callback_value on_value);
+
+                // store many values with the same ttl. the keys whose
+                // closest known node is the same share a find_node, which
+                // the find_node of each key starts from, and the values
+                // for a node are sent in one RDP stream
+                void            store_many(const std::vector<uint160_t> &ids,
+                                           const std::vector<std::string> &keys,
+                                           const std::vector<std::string> &values,
+                                           uint16_t ttl, bool is_unique);
+
+                // look up many keys at once. the keys whose closest known
+                // node is the same share a find_node, and their find_value
+                // start from the nodes it found. func is called for each
+                // key with its index, then done with the values of all
+                // keys, null for the ones not found
+                void            find_value_many(
+                                        const std::vector<uint160_t> &ids,
+                                        const std::vector<std::string> &keys,
+                                        callback_find_value_many func,
+                                        callback_find_value_all done,
+                                        const lookup_param &param);
                 void            store(const uint160_t &id,
                                       const void *key, uint16_t keylen,
                                       const void *value, uint16_t valuelen,
@@ -139,13 +253,83 @@ namespace libcage {
                                       uint16_t keylen,
                                       boost::shared_array<char> value,
                                       uint16_t valuelen, uint16_t ttl,
-                                      id_ptr from, bool is_unique);
+                                      id_ptr from, bool is_unique,
+                                      callback_store func = callback_store());
+
+                // func is called with the number of replicas which
+                // acknowledged the value, this node included, the number
+                // of replicas and the usec it took. it is called when all
+                // the replicas replied, or after store_ack_timeout
+                void            store(const uint160_t &id,
+                                      const void *key, uint16_t keylen,
+                                      const void *value, uint16_t valuelen,
+                                      uint16_t ttl, bool is_unique,
+                                      callback_store func);
 
 
                 void            set_enabled_dtun(bool flag);
                 void            set_enabled_rdp(bool flag);
                 bool            is_use_rdp() { return m_is_use_rdp; }
 
+                void            set_lookup_param(const lookup_param &param);
+                const lookup_param&     get_lookup_param() const
+                {
+                        return m_param;
+                }
+
+                const lookup_stats&     get_find_node_stats() const
+                {
+                        return m_find_node_stats;
+                }
+
+                const lookup_stats&     get_find_value_stats() const
+                {
+                        return m_find_value_stats;
+                }
+
+                // cache the values found by find_value until the smallest
+                // remaining ttl of them. 0 bytes, the default, disables it
+                void            set_cache_size(size_t bytes);
+                const cache_stats&      get_cache_stats() const
+                {
+                        return m_cache_stats;
+                }
+
+                // keep the stored values under bytes, evicting the path
+                // cached ones first, and then the ones whose id is
+                // farthest from this node, the oldest of them. the values
+                // put by this node are not evicted. a node sending more
+                // than src_bytes of values, cached or not, is refused
+                // more of them, except by this node. 0, the default, is
+                // no limit
+                void            set_store_limit(size_t bytes, size_t src_bytes);
+                const store_stats&      get_store_stats() const
+                {
+                        return m_store_stats;
+                }
+
+                // store the values found by find_value at the closest node
+                // which replied without them. disabled by default. the
+                // values cached here are kept for path_cache_ttl sec and
+                // path_cache_max bytes at most
+                void            set_path_cache(bool flag);
+
+                // keep the stored values in s too, and store the values it
+                // kept in this node. sstore_mem, the default, keeps them
+                // only in memory
+                void            set_sstore(sstore_ptr s);
+
+                // the stored values are gone through once a
+                // restore_interval, evenly, and sent to the closest nodes
+                // which do not have them. send at most bytes per second
+                // of them, the ones whose closest nodes changed first.
+                // 0, the default, is no limit
+                void            set_restore_rate(size_t bytes);
+                const restore_stats&    get_restore_stats() const
+                {
+                        return m_restore_stats;
+                }
+
         private:
                 class rdp_recv_store {
                 public:
@@ -160,15 +344,22 @@ namespace libcage {
                         id_ptr          src;
                         time_t          last_time;
                         dht            *p_dht;
+                        msg_dht_rdp_store       hdr;
+                        int             hdr_read;
                         bool            is_hdr_read;
                         bool            is_unique;
+                        bool            is_cached;
+                        bool            is_more;
+                        bool            is_refused; // a record of it
 
                         rdp_recv_store(dht *d, id_ptr from) :
                                 keylen(0), valuelen(0), key_read(0),
-                                val_read(0), src(from), last_time(time(NULL)),
-                                p_dht(d), is_hdr_read(false) { }
+                                val_read(0), src(from), last_time(cagetime::now()),
+                                p_dht(d), hdr_read(0), is_hdr_read(false),
+                                is_unique(false), is_cached(false),
+                                is_more(false), is_refused(false) { }
 
-                        void store2local();
+                        bool store2local();
                 };
 
                 typedef boost::shared_ptr<rdp_recv_store> rdp_recv_store_ptr;
@@ -197,10 +388,17 @@ namespace libcage {
                         id_ptr          id;
                         id_ptr          from;
                         bool            is_unique;
+                        bool            is_cached;
+                        uint32_t        ack_nonce; // store_query, 0 if none
                         dht            *p_dht;
 
+                        rdp_store_func() : is_cached(false), ack_nonce(0) { }
+
                         void operator() (int desc, rdp_addr addr,
                                          rdp_event event);
+
+                private:
+                        void finish(int desc, rdp_addr &addr, bool is_ok);
                 };
 
                 class sync_node {
@@ -230,29 +428,87 @@ namespace libcage {
                         id_ptr          id;
                         id_ptr          from;
                         bool            is_unique;
+                        bool            is_cached;
+                        uint32_t        ack_nonce; // store_query, 0 if none
                         dht            *p_dht;
+
+                        store_func() : is_cached(false), ack_nonce(0) { }
+
+                        void done(std::vector<cageaddr>& nodes, bool me);
                 };
 
-                class _key {
+                // for the acknowledgements of store
+                class timer_store : public timer::callback {
                 public:
-                        boost::shared_array<char>       key;
-                        uint16_t        keylen;
+                        virtual void operator() ();
 
-                        bool operator== (const _key &rhs) const
-                        {
-                                if (keylen != rhs.keylen) {
-                                        return false;
-                                } else if (memcmp(key.get(), rhs.key.get(),
-                                                  keylen) != 0) {
-                                        return false;
-                                }
-
-                                return true;
-                        }
+                        uint32_t        nonce;
+                        dht            *p_dht;
                 };
 
-                friend size_t hash_value(const _key &k);
+                class store_query {
+                public:
+                        callback_store  func;
+                        timer_store     timer_ack;
+                        uint32_t        nonce;
+                        uint64_t        start;  // usec
+                        int             num_replica;
+                        int             num_ack;
+                        int             num_wait; // replicas not replied
+                        bool            is_sent;
+
+                        // its keys in m_store_ack
+                        std::vector<std::string>        acks;
+
+                        store_query() : num_replica(0), num_ack(0),
+                                        num_wait(0), is_sent(false) { }
+                };
+
+                typedef boost::shared_ptr<store_query> store_query_ptr;
+
+                // for store_many
+                class store_many_query {
+                public:
+                        std::vector<store_func> recs;
+                        std::vector<std::vector<cageaddr> >     replicas;
+                        int                     num_left;
+                };
 
+                typedef boost::shared_ptr<store_many_query> store_many_ptr;
+
+                // the lookup of a group, which the lookups of its keys
+                // start from
+                class store_many_func {
+                public:
+                        void operator() (std::vector<cageaddr>& nodes);
+
+                        store_many_ptr          s;
+                        std::vector<int>        indices;
+                        dht                    *p_dht;
+                };
+
+                class store_many_node_func {
+                public:
+                        void operator() (std::vector<cageaddr>& nodes);
+
+                        store_many_ptr  s;
+                        int             index;
+                        dht            *p_dht;
+                };
+
+                class rdp_store_many_func {
+                public:
+                        void operator() (int desc, rdp_addr addr,
+                                         rdp_event event);
+
+                        std::vector<store_func> recs;
+                        dht            *p_dht;
+
+                private:
+                        void finish(int desc, rdp_addr &addr, bool is_ok);
+                };
+
+                // a value to store, as it was put or received
                 class stored_data {
                 public:
                         boost::shared_array<char>       key;
@@ -262,30 +518,55 @@ namespace libcage {
                         id_ptr          id;
                         id_ptr          src;
                         bool            is_unique;
+                        time_t          stored_time;
+                        int             original;
+                        uint16_t        ttl;
+
+                        stored_data() : keylen(0), valuelen(0),
+                                        is_unique(false), stored_time(0),
+                                        original(0), ttl(0) { }
+                };
 
-                        mutable std::set<_id>   recvd;
-                        mutable time_t          stored_time;
-                        mutable int             original;
-                        mutable uint16_t        ttl;
+                // the values stored for an id, by key. an id has mostly
+                // one key
+                typedef sval_set sdata_set;
+                typedef std::vector<std::pair<skey_ptr, sdata_set> > sdata_map;
+                typedef boost::unordered_map<uint160_t, sdata_map> stored_map;
 
+                // for the value cache, least recently used first in
+                // m_cache_lru
+                class cached_value {
+                public:
+                        boost::shared_array<char>       key;
+                        uint16_t        keylen;
+                        value_set_ptr   vset;
+                        time_t          expire;
+                        size_t          size;
+                        std::list<_id>::iterator        lru;
+                };
 
-                        bool operator== (const stored_data &rhs) const
+                typedef boost::unordered_map<_id, cached_value> cache_map;
+
+                // an entry of the expiry index, one for each stored or
+                // path cached value. the value is found by its address
+                // when the entry comes up, and is given a new entry if
+                // its ttl was extended
+                class expiry {
+                public:
+                        time_t          time;   // stored_time + ttl
+                        skey_ptr        key;
+                        const sval     *val;    // only compared
+                        bool            is_cached;
+
+                        bool operator> (const expiry &rhs) const
                         {
-                                if (valuelen != rhs.valuelen) {
-                                        return false;
-                                } else if (memcmp(value.get(), rhs.value.get(),
-                                                  valuelen) != 0) {
-                                        return false;
-                                }
-
-                                return true;
+                                return time > rhs.time;
                         }
                 };
 
-                friend size_t hash_value(const stored_data &sdata);
-
-                typedef boost::unordered_set<stored_data> sdata_set;
-                typedef boost::unordered_map<_key, sdata_set> sdata_map;
+                typedef std::priority_queue<expiry, std::vector<expiry>,
+                                            std::greater<expiry> >
+                expiry_heap;
 
                 // for ping
                 class ping_func {
@@ -318,17 +599,69 @@ namespace libcage {
                         dht            *p_dht;
                 };
 
+                // for find_value_many
+                class many_query {
+                public:
+                        std::vector<uint160_t>          ids;
+                        std::vector<std::string>        keys;
+                        std::vector<value_set_ptr>      results;
+                        lookup_param                    param;
+                        callback_find_value_many        func;
+                        callback_find_value_all         done;
+                        int                             num_left;
+                };
+
+                typedef boost::shared_ptr<many_query> many_ptr;
+
+                class many_value_func {
+                public:
+                        void operator() (bool result, value_set_ptr vset);
+
+                        many_ptr        m;
+                        int             index;
+                };
+
+                class many_node_func {
+                public:
+                        void operator() (std::vector<cageaddr> &nodes);
+
+                        many_ptr        m;
+                        std::vector<int>        indices;
+                        dht            *p_dht;
+                };
+
+                // for find node by host name
+                class resolve_func {
+                public:
+                        void operator() (bool result, sockaddr_storage &saddr);
+
+                        callback_find_node      func;
+                        dht                    *p_dht;
+                };
+
                 class timer_query : public timer::callback {
                 public:
                         virtual void operator() ();
 
                         _id             id;
                         uint32_t        nonce;
+                        uint64_t        sent;   // usec
+                        bool            is_soft;
+                        bool            is_late;
                         dht            *p_dht;
                 };
 
                 typedef boost::shared_ptr<timer_query>  timer_query_ptr;
 
+                // ends a lookup which waits only for late replies
+                class timer_late : public timer::callback {
+                public:
+                        virtual void operator() ();
+
+                        uint32_t        nonce;
+                        dht            *p_dht;
+                };
+
 
                 class timer_recvd_value;
                 typedef boost::shared_ptr<timer_recvd_value> timer_recvd_ptr;
@@ -343,6 +676,33 @@ namespace libcage {
                         int             num_query;
                         bool            is_find_value;
 
+                        int             alpha;
+                        int             k;
+                        lookup_policy   policy;
+                        int             num_stall;
+
+                        // hops to reach the nodes, 1 for those of my
+                        // routing table. hop is the one of the node
+                        // which answered the value
+                        std::map<_id, int>      hops;
+                        int             hop;
+
+                        int get_hop(const _id &i) const
+                        {
+                                std::map<_id, int>::const_iterator it;
+
+                                it = hops.find(i);
+                                return it == hops.end() ? 1 : it->second;
+                        }
+
+                        // the requests past their RTO, which may still
+                        // be answered until query_timeout. the lookup
+                        // waits for them late_wait at most
+                        int             num_late;
+                        timer_late      late_timer;
+                        bool            is_late_timer_started;
+                        bool            is_late_over;
+
                         boost::shared_array<char>       key;
                         int             keylen;
                         
@@ -372,11 +732,38 @@ namespace libcage {
                         timer_recvd_ptr       timer_recvd;
                         bool                  is_timer_recvd_started;
 
-                        callback_func   func;
+                        // the smallest remaining ttl of the values, 0 if
+                        // one of them is unknown and -1 before the first
+                        int             ttl;
+
+                        // the closest nodes which replied with and
+                        // without the value, for path caching
+                        id_ptr          holder;
+                        cageaddr        miss;
+
+                        void add_ttl(uint16_t t)
+                        {
+                                if (t == 0)
+                                        ttl = 0;
+                                else if (ttl < 0 || t < ttl)
+                                        ttl = t;
+                        }
+
+                        // the callbacks of the lookups coalesced into
+                        // this query, and its key in m_inflight
+                        std::vector<callback_func>      funcs;
+                        std::vector<callback_value>     on_values;
+                        std::string                     inflight;
+
+                        bool            is_first_set;
 
-                        query() : vset(new value_set),
+                        query() : num_stall(0), hop(0), num_late(0),
+                                  is_late_timer_started(false),
+                                  is_late_over(false),
+                                  vset(new value_set),
                                   is_rdp_con(false),
-                                  is_timer_recvd_started(false) { } 
+                                  is_timer_recvd_started(false),
+                                  ttl(-1), is_first_set(false) { } 
                 };
 
                 typedef boost::shared_ptr<query> query_ptr;
@@ -426,9 +813,9 @@ namespace libcage {
                         uint16_t        m_keylen;
                         uint16_t        m_key_read;
                         boost::shared_array<char>      m_key;
-                        std::queue<stored_data>        m_data;
+                        std::queue<sval_ptr>           m_data;
 
-                        rdp_recv_get(dht &d) : m_dht(d), m_time(time(NULL)),
+                        rdp_recv_get(dht &d) : m_dht(d), m_time(cagetime::now()),
                                                m_state(RGET_HDR),
                                                m_key_read(0) { }
                 };
@@ -453,12 +840,80 @@ namespace libcage {
                 // for restore
                 class restore_func {
                 public:
-                        void operator() (std::vector<cageaddr> &n);
-
                         bool restore_by_udp(std::vector<cageaddr> &nodes,
-                                            sdata_set::iterator &it);
+                                            const skey &key, sval &val);
                         bool restore_by_rdp(std::vector<cageaddr> &nodes,
-                                            sdata_set::iterator &it);
+                                            const skey &key, sval &val);
+
+                        dht    *p_dht;
+                        size_t  sent;   // bytes
+
+                        restore_func() : sent(0) { }
+                };
+
+                // a value to be sent by restore. a dropped one was erased
+                // here, as this node is no longer one of the closest
+                class restore_item {
+                public:
+                        skey_ptr        key;
+                        sval_ptr        val;
+                        bool            is_dropped;
+                };
+
+                class restore_timer_dht : public timer::callback {
+                public:
+                        virtual void operator() ()
+                        {
+                                timeval tval;
+
+                                m_dht.restore();
+
+                                tval.tv_sec  = dht::restore_tick;
+                                tval.tv_usec = 0;
+
+                                m_dht.m_timer.set_timer(this, &tval);
+                        }
+
+                        restore_timer_dht(dht &d) : m_dht(d)
+                        {
+                                timeval tval;
+
+                                tval.tv_sec  = dht::restore_tick;
+                                tval.tv_usec = 0;
+
+                                m_dht.m_timer.set_timer(this, &tval);
+                        }
+
+                        virtual ~restore_timer_dht()
+                        {
+                                m_dht.m_timer.unset_timer(this);
+                        }
+
+                        dht    &m_dht;
+                };
+
+                // for sstore
+                class sstore_load_func {
+                public:
+                        void operator() (const uint160_t &id, const void *key,
+                                         uint16_t keylen, sval_ptr val)
+                        {
+                                p_dht->load_sdata(id, key, keylen, val);
+                        }
+
+                        dht    *p_dht;
+                };
+
+                class sstore_find_func {
+                public:
+                        sval* operator() (const uint160_t &id,
+                                          const void *key, uint16_t keylen,
+                                          const void *value,
+                                          uint16_t valuelen)
+                        {
+                                return p_dht->find_sval(id, key, keylen,
+                                                        value, valuelen);
+                        }
 
                         dht    *p_dht;
                 };
@@ -499,6 +954,7 @@ namespace libcage {
                         {
                                 m_dht.refresh();
                                 m_dht.sweep_rdp();
+                                m_dht.sweep_cache();
 
                                 reschedule();
                         }
@@ -514,7 +970,6 @@ namespace libcage {
                 public:
                         virtual void operator() ()
                         {
-                                m_dht.restore();
                                 m_dht.maintain();
 
                                 reschedule();
@@ -527,6 +982,25 @@ namespace libcage {
                         dht    &m_dht;
                 };
 
+                class compact_timer_dht : public timer_dht {
+                public:
+                        virtual void operator() ()
+                        {
+                                sstore_find_func func;
+
+                                func.p_dht = &m_dht;
+                                m_dht.m_sstore->compact(func);
+
+                                reschedule();
+                        }
+
+                        compact_timer_dht(dht &d) :
+                                timer_dht(d, dht::compact_interval),
+                                m_dht(d) { }
+
+                        dht    &m_dht;
+                };
+
                 // for join
                 class dht_join : public timer::callback {
                 public:
@@ -556,24 +1030,100 @@ namespace libcage {
 
                 void            find_nv(const uint160_t &dst,
                                         callback_func func, bool is_find_value,
-                                        const void *key, int keylen);
+                                        const void *key, int keylen,
+                                        const lookup_param &param,
+                                        callback_value on_value =
+                                        callback_value(),
+                                        const std::vector<cageaddr> *seed =
+                                        NULL);
+                void            init_query(query_ptr q,
+                                           const lookup_param &param);
+                void            merge_reply(query_ptr q, const _id &from,
+                                            std::vector<cageaddr> &nodes);
                 void            send_find(query_ptr q);
                 void            send_find_node(cageaddr &dst, query_ptr q);
                 void            send_find_value(cageaddr &dst, query_ptr q);
 
                 void            refresh();
+                void            expire(const expiry &e, time_t now);
+                void            add_expiry(skey_ptr key, sval &val,
+                                           bool is_cached);
+                void            update_expiry(skey_ptr key, sval &val,
+                                              bool is_cached);
+                void            rebuild_expiry();
                 void            restore();
+                void            walk_restore(uint64_t usec);
+                void            restore_id(const uint160_t &id);
+                void            send_restore();
+                bool            is_stored(const skey &key, const sval_ptr &val);
                 void            sweep_rdp();
                 void            maintain();
 
+                void            group_keys(const std::vector<uint160_t> &ids,
+                                           const std::vector<int> &indices,
+                                           std::vector<std::vector<int> >
+                                           &groups);
+                void            send_store_many(store_many_ptr s);
+
                 void            recvd_value(query_ptr q);
+                void            add_value(query_ptr q, value_t &v);
                 void            remove_query(query_ptr q);
+                void            unlink_query(query_ptr q);
+
+                bool            get_cache(const uint160_t &id,
+                                          const void *key, uint16_t keylen,
+                                          value_set_ptr &vset);
+                void            put_cache(query_ptr q);
+                void            erase_cache(cache_map::iterator it);
+                void            sweep_cache();
+
+                void            cache_on_path(query_ptr q);
+                bool            add_cached(stored_data &sdata);
+                sdata_set*      find_sdata(const uint160_t &id,
+                                           const void *key, uint16_t keylen);
+                sval*           find_sval(const uint160_t &id,
+                                          const void *key, uint16_t keylen,
+                                          const void *value,
+                                          uint16_t valuelen);
+                void            load_sdata(const uint160_t &id,
+                                           const void *key, uint16_t keylen,
+                                           sval_ptr val);
 
-                void            add_sdata(stored_data &sdata, bool is_origin);
+                bool            add_sdata(stored_data &sdata, bool is_origin);
                 void            erase_sdata(stored_data &sdata);
                 void            insert2recvd_sdata(stored_data &sdata,
                                                    id_ptr id);
                 int             dec_origin_sdata(stored_data &sdata);
+                bool            insert_sdata(sdata_set &s, skey_ptr key,
+                                             sval_ptr val);
+                void            add_store_stats(const skey &key,
+                                                const sval &val);
+                void            sub_store_stats(const skey &key,
+                                                const sval &val);
+                bool            is_over_quota(const stored_data &sdata,
+                                              size_t freed = 0);
+                void            sub_src_bytes(const uint160_t &src,
+                                              size_t bytes);
+                void            trim_store();
+                bool            evict_sdata();
+                void            evict_cached();
+                static size_t   sdata_bytes(uint16_t keylen,
+                                            uint16_t valuelen);
+                static sval_ptr new_sval(const stored_data &sdata);
+                static void     to_sdata(const skey &key, const sval &val,
+                                         stored_data &sdata);
+                static sdata_map::iterator      find_key(sdata_map &m,
+                                                         const void *key,
+                                                         uint16_t keylen);
+
+                store_query_ptr find_store_query(uint32_t nonce);
+                void            wait_store_ack(store_query_ptr q,
+                                               const uint160_t &node,
+                                               const uint160_t &id,
+                                               const void *key,
+                                               uint16_t keylen);
+                void            recv_store_ack(uint32_t nonce, bool result);
+                void            finish_store(store_query_ptr q);
 
 
                 rand_uint               &m_rnd;
@@ -589,17 +1139,49 @@ namespace libcage {
                 time_t                   m_last_restore;
                 slow_timer_dht           m_slow_timer_dht;
                 fast_timer_dht           m_fast_timer_dht;
+                compact_timer_dht        m_compact_timer_dht;
+                restore_timer_dht        m_restore_timer_dht;
                 dht_join                 m_join;
                 sync_node                m_sync;
                 int                      m_rdp_recv_listen;
                 int                      m_rdp_get_listen;
                 bool                     m_is_use_rdp;
                 int                      m_mask_bit;
-
-                boost::unordered_map<_id, sdata_map>    m_stored;
+                lookup_param             m_param;
+                lookup_stats             m_find_node_stats;
+                lookup_stats             m_find_value_stats;
+                size_t                   m_cache_max;
+                bool                     m_is_path_cache;
+                cache_stats              m_cache_stats;
+                size_t                   m_store_max;
+                size_t                   m_store_src_max;
+                store_stats              m_store_stats;
+                size_t                   m_num_cached;
+                size_t                   m_cached_bytes;
+                sstore_ptr               m_sstore;
+                size_t                   m_restore_rate;
+                int64_t                  m_restore_tokens; // bytes
+                uint64_t                 m_restore_time;   // usec
+                uint64_t                 m_restore_start;  // of the pass
+                size_t                   m_restore_bucket; // of m_stored
+                size_t                   m_restore_buckets;
+                restore_stats            m_restore_stats;
+
+                stored_map                              m_stored;
+                stored_map                              m_cached; // on path
+                expiry_heap                             m_expiry;
+                std::deque<restore_item>                m_restore_changed;
+                std::deque<restore_item>                m_restore_origin;
+                std::map<uint160_t, int>                m_store_dist; // from m_id
+                boost::unordered_map<uint160_t, size_t> m_src_bytes;
                 std::map<uint32_t, query_ptr>           m_query;
+                std::map<std::string, uint32_t>         m_inflight;
+                cache_map                               m_cache;
+                std::list<_id>                          m_cache_lru;
                 std::map<int, rdp_recv_store_ptr>       m_rdp_recv_store;
                 std::map<int, time_t>                   m_rdp_store;
+                std::map<uint32_t, store_query_ptr>     m_store_query;
+                std::map<std::string, std::list<uint32_t> >     m_store_ack;
                 std::map<int, rdp_recv_get_ptr>         m_rdp_recv_get;
         };
 }
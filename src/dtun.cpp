@@ -34,6 +34,8 @@
 #include "ping.hpp"
 #include "proxy.hpp"
 
+#include <algorithm>
+
 #include <openssl/rand.h>
 
 #include <boost/foreach.hpp>
@@ -42,6 +44,7 @@ namespace libcage {
         const int       dtun::num_find_node     = 10;
         const int       dtun::max_query         = 6;
         const int       dtun::query_timeout     = 2;
+        const int       dtun::late_wait         = 500000; // usec
         const int       dtun::request_retry     = 2;
         const int       dtun::request_timeout   = 2;
         const int       dtun::registered_ttl    = 300;
@@ -57,8 +60,38 @@ namespace libcage {
                 timer_ptr t = q->timers[id];
                 uint160_t zero;
 
+                if (is_soft) {
+                        // the node is slow. give its slot to the next
+                        // node. its reply is still accepted until
+                        // query_timeout, unless the lookup has finished
+                        uint64_t elapsed = cagetime::now_usec() - sent;
+                        uint64_t rest    = 0;
+                        timeval  tval;
+
+                        if (elapsed < (uint64_t)query_timeout * 1000000)
+                                rest = (uint64_t)query_timeout * 1000000 -
+                                        elapsed;
+
+                        tval.tv_sec  = (long)(rest / 1000000);
+                        tval.tv_usec = (long)(rest % 1000000);
+
+                        is_soft = false;
+                        is_late = true;
+
+                        p_dtun->m_timer.set_timer(this, &tval);
+
+                        q->num_query--;
+                        q->num_late++;
+
+                        p_dtun->send_find(q);
+                        return;
+                }
+
                 q->sent.insert(id);
-                q->num_query--;
+                if (is_late)
+                        q->num_late--;
+                else
+                        q->num_query--;
                 q->timers.erase(id);
 
                 zero.fill_zero();
@@ -81,6 +114,16 @@ namespace libcage {
                 p_dtun->send_find(q);
         }
 
+        void
+        dtun::timer_late::operator() ()
+        {
+                query_ptr q = p_dtun->m_query[nonce];
+
+                q->is_late_over = true;
+
+                p_dtun->send_find(q);
+        }
+
         dtun::dtun(rand_uint &rnd, rand_real &drnd, const uint160_t &id,
                    timer &t, peers &p, const natdetector &nat, udphandler &udp,
                    proxy &pr) :
@@ -96,7 +139,8 @@ namespace libcage {
                 m_registering(false),
                 m_last_registered(0),
                 m_timer_refresh(*this),
-                m_is_enabled(true)
+                m_is_enabled(true),
+                m_param(max_query, num_find_node, lookup_exhaustive)
         {
                 RAND_pseudo_bytes((unsigned char*)&m_register_session,
                                   sizeof(m_register_session));
@@ -113,7 +157,7 @@ namespace libcage {
         void
         dtun::maintain()
         {
-                time_t diff = time(NULL) - m_last_maintain;
+                time_t diff = cagetime::now() - m_last_maintain;
 
                 if (diff < maintain_interval)
                         return;
@@ -132,7 +176,7 @@ namespace libcage {
                 if (m_mask_bit > 20)
                         m_mask_bit = 1;
 
-                m_last_maintain = time(NULL);
+                m_last_maintain = cagetime::now();
         }
 
         void
@@ -168,12 +212,21 @@ namespace libcage {
                 if (! m_is_enabled)
                         return;
 
-                sockaddr_storage saddr;
+                resolve_func f;
+
+                f.func   = func;
+                f.p_dtun = this;
 
-                if (! m_udp.get_sockaddr(&saddr, host, port))
+                m_udp.resolve(host, port, f);
+        }
+
+        void
+        dtun::resolve_func::operator() (bool result, sockaddr_storage &saddr)
+        {
+                if (! result)
                         return;
 
-                find_node((sockaddr*)&saddr, func);
+                p_dtun->find_node((sockaddr*)&saddr, func);
         }
 
         void
@@ -185,10 +238,12 @@ namespace libcage {
                 // initialize query
                 query_ptr q(new query);
 
+                init_query(q);
+
                 q->dst           = m_id;
                 q->num_query     = 1;
                 q->is_find_value = false;
-                q->func          = func;
+                q->funcs.push_back(func);
 
                 // add my id
                 _id i;
@@ -217,6 +272,9 @@ namespace libcage {
 
                 t->nonce  = q->nonce;
                 t->id     = zero_id;
+                t->sent   = cagetime::now_usec();
+                t->is_soft = false;
+                t->is_late = false;
                 t->p_dtun = this;
 
                 tval.tv_sec  = query_timeout;
@@ -245,13 +303,39 @@ namespace libcage {
                 send_find_node(addr, q);
         }
 
+        // lookups for the same node or value share this key
+        static std::string
+        inflight_key(const uint160_t &dst, bool is_find_value)
+        {
+                char buf[CAGE_ID_LEN + 1];
+
+                buf[0] = is_find_value ? 'v' : 'n';
+                dst.to_binary(buf + 1, CAGE_ID_LEN);
+
+                return std::string(buf, sizeof(buf));
+        }
+
         void
         dtun::find_nv(const uint160_t &dst, callback_func func,
                       bool is_find_value)
         {
+                std::map<std::string, uint32_t>::iterator it;
+                std::string inflight;
+
+                // the same lookup is in flight, wait for its result
+                inflight = inflight_key(dst, is_find_value);
+                it = m_inflight.find(inflight);
+                if (it != m_inflight.end() &&
+                    m_query.find(it->second) != m_query.end()) {
+                        m_query[it->second]->funcs.push_back(func);
+                        return;
+                }
+
                 query_ptr q(new query);
 
-                lookup(dst, num_find_node, q->nodes);
+                init_query(q);
+
+                lookup(dst, q->k, q->nodes);
 
                 if (q->nodes.size() == 1) {
                         if (is_find_value) {
@@ -270,7 +354,8 @@ namespace libcage {
                 q->dst           = dst;
                 q->num_query     = 0;
                 q->is_find_value = is_find_value;
-                q->func          = func;
+                q->inflight      = inflight;
+                q->funcs.push_back(func);
 
                 // add my id
                 _id i;
@@ -287,6 +372,7 @@ namespace libcage {
 
                 q->nonce = nonce;
                 m_query[nonce] = q;
+                m_inflight[inflight] = nonce;
 
 
                 send_find(q);
@@ -311,31 +397,119 @@ namespace libcage {
                 find_nv(dst, func, true);
         }
 
+        void
+        dtun::set_lookup_param(const lookup_param &param)
+        {
+                if (param.alpha > 0)
+                        m_param.alpha = param.alpha;
+
+                if (param.k > 0)
+                        m_param.k = param.k;
+
+                if (param.policy != lookup_default)
+                        m_param.policy = param.policy;
+        }
+
+        void
+        dtun::init_query(query_ptr q)
+        {
+                q->alpha  = m_param.alpha;
+                q->k      = m_param.k;
+                q->policy = m_param.policy;
+        }
+
+        void
+        dtun::merge_reply(query_ptr q, std::vector<cageaddr> &nodes)
+        {
+                std::vector<cageaddr> tmp;
+
+                tmp.swap(q->nodes);
+
+                merge_nodes(q->dst, q->nodes, tmp, nodes, q->k);
+
+                // count the replies which found no closer node
+                if (! tmp.empty() && ! q->nodes.empty() &&
+                    *tmp[0].id == *q->nodes[0].id)
+                        q->num_stall++;
+                else
+                        q->num_stall = 0;
+        }
+
+        void
+        dtun::unlink_query(query_ptr q)
+        {
+                // later lookups for the same key start a new query
+                std::map<std::string, uint32_t>::iterator it;
+
+                if (q->inflight.empty())
+                        return;
+
+                it = m_inflight.find(q->inflight);
+                if (it != m_inflight.end() && it->second == q->nonce)
+                        m_inflight.erase(it);
+        }
+
         void
         dtun::send_find(query_ptr q)
         {
-                BOOST_FOREACH(cageaddr &addr, q->nodes) {
-                        if (q->num_query >= max_query) {
+                bool is_stalled = (q->policy == lookup_stall &&
+                                   q->num_stall >= q->alpha);
+
+                // candidates are the closest nodes not queried yet, twice
+                // as many as the free slots. the ones expected to reply
+                // fastest are queried first
+                std::vector<std::pair<uint32_t, int> > cand;
+                int slots = is_stalled ? 0 : q->alpha - q->num_query;
+
+                for (int n = 0; n < (int)q->nodes.size(); n++) {
+                        if ((int)cand.size() >= slots * 2)
                                 break;
-                        }
 
                         _id i;
-                        i.id = addr.id;
+                        i.id = q->nodes[n].id;
 
                         if (q->sent.find(i) != q->sent.end()) {
                                 continue;
                         }
 
+                        cand.push_back(std::make_pair(get_cost(*i.id), n));
+                }
+
+                // ties are broken by the distance
+                std::sort(cand.begin(), cand.end());
+
+                if ((int)cand.size() > slots)
+                        cand.resize(slots);
+
+                for (size_t n = 0; n < cand.size(); n++) {
+                        cageaddr &addr = q->nodes[cand[n].second];
+
+                        _id i;
+                        i.id = addr.id;
+
                         // start timer
                         timeval   tval;
                         timer_ptr t(new timer_query);
 
                         t->nonce  = q->nonce;
                         t->id     = i;
+                        t->sent   = cagetime::now_usec();
                         t->p_dtun = this;
 
-                        tval.tv_sec  = query_timeout;
-                        tval.tv_usec = 0;
+                        // wait for the RTO of the node, and then for the
+                        // rest of query_timeout as a late reply
+                        uint32_t rto = get_rto(*i.id);
+
+                        if (rto < (uint32_t)query_timeout * 1000000) {
+                                t->is_soft   = true;
+                                tval.tv_sec  = rto / 1000000;
+                                tval.tv_usec = rto % 1000000;
+                        } else {
+                                t->is_soft   = false;
+                                tval.tv_sec  = query_timeout;
+                                tval.tv_usec = 0;
+                        }
+                        t->is_late = false;
 
                         q->timers[i] = t;
                         q->sent.insert(i);
@@ -353,17 +527,42 @@ namespace libcage {
                         q->num_query++;
                 }
 
-                if (q->num_query == 0) {
+                // a late reply may still bring closer nodes, but the
+                // slowest node must not bound the lookup
+                if (q->num_query == 0 && q->num_late > 0 &&
+                    ! q->is_late_timer_started && ! is_stalled) {
+                        timeval tval;
+
+                        tval.tv_sec  = late_wait / 1000000;
+                        tval.tv_usec = late_wait % 1000000;
+
+                        q->late_timer.nonce  = q->nonce;
+                        q->late_timer.p_dtun = this;
+                        q->is_late_timer_started = true;
+
+                        m_timer.set_timer(&q->late_timer, &tval);
+                }
+
+                if ((q->num_query == 0 &&
+                     (q->num_late == 0 || q->is_late_over)) || is_stalled) {
                         // call callback functions
-                        if (q->is_find_value) {
-                                cageaddr addr1, addr2;
-                                callback_find_value func;
-                                func = boost::get<callback_find_value>(q->func);
-                                func(false, addr1, addr2);
-                        } else {
-                                callback_find_node func;
-                                func = boost::get<callback_find_node>(q->func);
-                                func(q->nodes);
+                        std::vector<callback_func> funcs;
+
+                        unlink_query(q);
+                        funcs.swap(q->funcs);
+
+                        BOOST_FOREACH(callback_func &f, funcs) {
+                                if (q->is_find_value) {
+                                        cageaddr addr1, addr2;
+                                        callback_find_value func;
+                                        func = boost::get<callback_find_value>(f);
+                                        func(false, addr1, addr2);
+                                } else {
+                                        callback_find_node func;
+                                        std::vector<cageaddr> nodes(q->nodes);
+                                        func = boost::get<callback_find_node>(f);
+                                        func(nodes);
+                                }
                         }
 
                         // stop all timers
@@ -373,6 +572,9 @@ namespace libcage {
                                 m_timer.unset_timer(it->second.get());
                         }
 
+                        if (q->is_late_timer_started)
+                                m_timer.unset_timer(&q->late_timer);
+
                         // remove query
                         m_query.erase(q->nonce);
                 }
@@ -435,7 +637,7 @@ namespace libcage {
         {
                 msg_dtun_find_node       *find_node;
                 msg_dtun_find_node_reply *reply;
-                std::vector<cageaddr>     nodes;
+                std::vector<entry_view>   nodes;
                 uint160_t                 dst, id;
                 int                       size;
                 char                      buf[1024 * 2];
@@ -535,6 +737,7 @@ namespace libcage {
                 uint16_t  domain;
                 int       size;
                 _id       c_id;
+                bool      is_late = false;
 
                 
                 reply = (msg_dtun_find_node_reply*)msg;
@@ -579,11 +782,19 @@ namespace libcage {
                         t = q->timers[c_id];
                         m_timer.unset_timer(t.get());
                         q->timers.erase(c_id);
+
+                        add_rtt(*src, (uint32_t)(cagetime::now_usec() -
+                                                 t->sent));
+                        is_late = t->is_late;
                 } else {
                         timer_ptr t;
                         t = q->timers[c_id];
                         m_timer.unset_timer(t.get());
                         q->timers.erase(c_id);
+
+                        add_rtt(*src, (uint32_t)(cagetime::now_usec() -
+                                                 t->sent));
+                        is_late = t->is_late;
                 }
 
 
@@ -625,25 +836,18 @@ namespace libcage {
                 i.id = caddr.id;
 
                 q->sent.insert(i);
-                q->num_query--;
+                if (is_late)
+                        q->num_late--;
+                else
+                        q->num_query--;
 
                 // add to rttable
                 add(caddr);
                 m_peers.add_node(caddr);
 
 
-                // sort
-                compare cmp;
-                cmp.m_id = &id;
-                std::sort(nodes.begin(), nodes.end(), cmp);
-
                 // merge
-                std::vector<cageaddr> tmp;
-
-                tmp = q->nodes;
-                q->nodes.clear();
-
-                merge_nodes(id, q->nodes, tmp, nodes, num_find_node);
+                merge_reply(q, nodes);
 
                 // send
                 send_find(q);
@@ -774,7 +978,7 @@ namespace libcage {
 
                 r.addr    = new_cageaddr(&reg->hdr, from);
                 r.session = ntohl(reg->session);
-                r.t       = time(NULL);
+                r.t       = cagetime::now();
 
                 i.id = r.addr.id;
 
@@ -911,7 +1115,7 @@ namespace libcage {
                 }
 
                 // send nodes
-                std::vector<cageaddr> nodes;
+                std::vector<entry_view> nodes;
                 int size = 0;
 
                 lookup(*id, num_find_node, nodes);
@@ -956,6 +1160,8 @@ namespace libcage {
                 uint16_t  domain;
                 int       size;
                 _id       c_id;
+                bool      is_wait = false;
+                bool      is_late = false;
 
                 reply = (msg_dtun_find_value_reply*)msg;
 
@@ -989,6 +1195,11 @@ namespace libcage {
                         t = q->timers[c_id];
                         m_timer.unset_timer(t.get());
                         q->timers.erase(c_id);
+
+                        add_rtt(*src, (uint32_t)(cagetime::now_usec() -
+                                                 t->sent));
+                        is_wait = true;
+                        is_late = t->is_late;
                 }
 
 
@@ -1030,7 +1241,10 @@ namespace libcage {
                 i.id = caddr.id;
 
                 q->sent.insert(i);
-                q->num_query--;
+                if (is_wait && is_late)
+                        q->num_late--;
+                else if (is_wait)
+                        q->num_query--;
 
                 // add to rttable
                 add(caddr);
@@ -1046,10 +1260,21 @@ namespace libcage {
                                 m_timer.unset_timer(it->second.get());
                         }
 
-                        // call callback
-                        callback_find_value func;
-                        func = boost::get<callback_find_value>(q->func);
-                        func(true, nodes[0], caddr);
+                        if (q->is_late_timer_started)
+                                m_timer.unset_timer(&q->late_timer);
+
+                        // call callbacks
+                        std::vector<callback_func> funcs;
+
+                        unlink_query(q);
+                        funcs.swap(q->funcs);
+
+                        BOOST_FOREACH(callback_func &f, funcs) {
+                                callback_find_value func;
+                                cageaddr addr1 = nodes[0], addr2 = caddr;
+                                func = boost::get<callback_find_value>(f);
+                                func(true, addr1, addr2);
+                        }
 
                         m_query.erase(nonce);
 
@@ -1057,18 +1282,8 @@ namespace libcage {
                 }
 
 
-                // sort
-                compare cmp;
-                cmp.m_id = &id;
-                std::sort(nodes.begin(), nodes.end(), cmp);
-
                 // merge
-                std::vector<cageaddr> tmp;
-
-                tmp = q->nodes;
-                q->nodes.clear();
-
-                merge_nodes(id, q->nodes, tmp, nodes, num_find_node);
+                merge_reply(q, nodes);
 
                 // send
                 send_find(q);
@@ -1451,7 +1666,7 @@ namespace libcage {
         dtun::refresh()
         {
                 std::map<_id, registered>::iterator it;
-                time_t now = time(NULL);
+                time_t now = cagetime::now();
 
                 for (it = m_registered_nodes.begin();
                      it != m_registered_nodes.end();) {
@@ -35,6 +35,7 @@
 #include "common.hpp"
 
 #include "bn.hpp"
+#include "cagetypes.hpp"
 #include "natdetector.hpp"
 #include "timer.hpp"
 #include "udphandler.hpp"
@@ -57,6 +58,7 @@ namespace libcage {
                 static const int        num_find_node;
                 static const int        max_query;
                 static const int        query_timeout;
+                static const int        late_wait;
                 static const int        request_retry;
                 static const int        request_timeout;
                 static const int        registered_ttl;
@@ -117,6 +119,12 @@ namespace libcage {
 
                 void            refresh();
 
+                void            set_lookup_param(const lookup_param &param);
+                const lookup_param&     get_lookup_param() const
+                {
+                        return m_param;
+                }
+
                 void            set_enabled(bool enabled);
                 bool            is_enabled() { return m_is_enabled; }
 
@@ -154,11 +162,23 @@ namespace libcage {
 
                         _id             id;
                         uint32_t        nonce;
+                        uint64_t        sent;   // usec
+                        bool            is_soft;
+                        bool            is_late;
                         dtun           *p_dtun;
                 };
 
                 typedef boost::shared_ptr<timer_query>  timer_ptr;
 
+                // ends a lookup which waits only for late replies
+                class timer_late : public timer::callback {
+                public:
+                        virtual void operator() ();
+
+                        uint32_t        nonce;
+                        dtun           *p_dtun;
+                };
+
                 class query {
                 public:
                         std::vector<cageaddr>           nodes;
@@ -169,11 +189,40 @@ namespace libcage {
                         int             num_query;
                         bool            is_find_value;
 
-                        callback_func   func;
+                        int             alpha;
+                        int             k;
+                        lookup_policy   policy;
+                        int             num_stall;
+
+                        // the requests past their RTO, which may still
+                        // be answered until query_timeout. the lookup
+                        // waits for them late_wait at most
+                        int             num_late;
+                        timer_late      late_timer;
+                        bool            is_late_timer_started;
+                        bool            is_late_over;
+
+                        // the callbacks of the lookups coalesced into
+                        // this query, and its key in m_inflight
+                        std::vector<callback_func>      funcs;
+                        std::string                     inflight;
+
+                        query() : num_stall(0), num_late(0),
+                                  is_late_timer_started(false),
+                                  is_late_over(false) { }
                 };
 
                 typedef boost::shared_ptr<query> query_ptr;
 
+                // for find node by host name
+                class resolve_func {
+                public:
+                        void operator() (bool result, sockaddr_storage &saddr);
+
+                        callback_find_node      func;
+                        dtun                   *p_dtun;
+                };
+
                 // register
                 class register_callback {
                 public:
@@ -226,6 +275,10 @@ namespace libcage {
 
                 void            find_nv(const uint160_t &dst,
                                         callback_func func, bool is_find_value);
+                void            init_query(query_ptr q);
+                void            unlink_query(query_ptr q);
+                void            merge_reply(query_ptr q,
+                                            std::vector<cageaddr> &nodes);
 
 
                 virtual void    send_ping(cageaddr &dst, uint32_t nonce);
@@ -250,6 +303,7 @@ namespace libcage {
                 udphandler             &m_udp;
                 proxy                  &m_proxy;
                 std::map<uint32_t, query_ptr>   m_query;
+                std::map<std::string, uint32_t> m_inflight;
                 bool                    m_registering;
                 time_t                  m_last_registered;
                 uint32_t                m_register_session;
@@ -259,6 +313,7 @@ namespace libcage {
                 bool                    m_is_enabled;
                 int                     m_mask_bit;
                 time_t                  m_last_maintain;
+                lookup_param            m_param;
         };
 }
 
@@ -188,9 +188,20 @@ namespace libcage {
         void
         natdetector::recv_echo(void *msg, sockaddr *from, int fromlen)
         {
-                msg_nat_echo *echo = (msg_nat_echo*)msg;
                 msg_nat_echo_reply reply;
 
+                make_echo_reply(msg, from, reply);
+
+                m_udp.sendto(&reply, sizeof(reply), from, fromlen);
+        }
+
+        // reads only m_id, so that receive threads can call this
+        void
+        natdetector::make_echo_reply(const void *msg, const sockaddr *from,
+                                     msg_nat_echo_reply &reply) const
+        {
+                const msg_nat_echo *echo = (const msg_nat_echo*)msg;
+
                 memset(&reply, 0, sizeof(reply));
 
                 reply.hdr.magic = htons(MAGIC_NUMBER);
@@ -204,22 +215,20 @@ namespace libcage {
                 reply.nonce  = echo->nonce;
 
                 if (from->sa_family == PF_INET) {
-                        sockaddr_in *saddr = (sockaddr_in*)from;
+                        const sockaddr_in *saddr = (const sockaddr_in*)from;
 
                         reply.domain = htons(domain_inet);
                         reply.port   = saddr->sin_port;
                         memcpy(reply.addr, &saddr->sin_addr,
                                sizeof(saddr->sin_addr));
                 } else if (from->sa_family == PF_INET6) {
-                        sockaddr_in6 *saddr = (sockaddr_in6*)from;
+                        const sockaddr_in6 *saddr = (const sockaddr_in6*)from;
 
                         reply.domain = htons(domain_inet6);
                         reply.port   = saddr->sin6_port;
                         memcpy(reply.addr, &saddr->sin6_addr,
                                sizeof(saddr->sin6_addr));
                 }
-
-                m_udp.sendto(&reply, sizeof(reply), from, fromlen);
         }
 
         void
@@ -65,6 +65,9 @@ namespace libcage {
                                                 int slen);
                 void            recv_echo(void *msg, sockaddr *from,
                                           int fromlen);
+                void            make_echo_reply(const void *msg,
+                                                const sockaddr *from,
+                                                msg_nat_echo_reply &reply) const;
                 void            recv_echo_reply(void *msg, sockaddr *from,
                                                 int fromlen);
                 void            recv_echo_redirect(void *msg, sockaddr *from,
@@ -203,7 +203,7 @@ namespace libcage {
                         return false;
 
                 i.id      = addr.id;
-                i.t       = time(NULL);
+                i.t       = cagetime::now();
                 i.session = session;
 
                 _bimap::left_iterator it = m_map.left.find(i);
@@ -264,7 +264,7 @@ namespace libcage {
                 a.saddr  = addr.saddr;
 
                 i.id      = addr.id;
-                i.t       = time(NULL);
+                i.t       = cagetime::now();
                 i.session = 0;
 
                 m_map.insert(value_t(i, a));
@@ -275,7 +275,7 @@ namespace libcage {
         void
         peers::refresh()
         {
-                time_t now = time(NULL);
+                time_t now = cagetime::now();
 
                 boost::unordered_set<__id>::iterator it1;
                 for (it1 = m_timeout.begin(); it1 != m_timeout.end();) {
@@ -306,7 +306,7 @@ namespace libcage {
         {
                 __id i;
 
-                i.t  = time(NULL);
+                i.t  = cagetime::now();
                 i.id = id;
 
                 if (m_timeout.find(i) == m_timeout.end())
@@ -152,7 +152,7 @@ namespace libcage {
                 _bimap          m_map;
                 boost::unordered_set<__id>       m_timeout;
 
-                timer           m_timer;
+                timer          &m_timer;
                 timer_func      m_timer_func;
                 bool            m_is_callback;
                 callback        m_callback;
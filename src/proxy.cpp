@@ -127,7 +127,7 @@ namespace libcage {
         void
         proxy::sweep_rdp()
         {
-                time_t now = time(NULL);
+                time_t now = cagetime::now();
                 time_t diff;
 
                 std::map<int, time_t>::iterator it1;
@@ -338,7 +338,7 @@ namespace libcage {
 
                         a.session   = ntohl(reg->session);
                         a.addr      = addr;
-                        a.recv_time = time(NULL);
+                        a.recv_time = cagetime::now();
 
                         m_registered[i] = a;
 
@@ -348,7 +348,7 @@ namespace libcage {
 
                         if (it->second.session == session) {
                                 it->second.addr      = addr;
-                                it->second.recv_time = time(NULL);
+                                it->second.recv_time = cagetime::now();
                         } else {
                                 return;
                         }
@@ -377,7 +377,7 @@ namespace libcage {
 
                 desc = m_rdp.connect(0, m_server.id, proxy_store_port, func);
 
-                m_rdp_store[desc] = time(NULL);
+                m_rdp_store[desc] = cagetime::now();
         }
 
         void
@@ -563,7 +563,7 @@ namespace libcage {
                 }
 
                 ptr->m_nonce = nonce;
-                ptr->m_time  = time(NULL);
+                ptr->m_time  = cagetime::now();
                 ptr->m_state = rdp_recv_get_reply::RGR_VAL_HDR;
 
                 if (msg.flag == proxy_get_fail) {
@@ -602,7 +602,7 @@ namespace libcage {
                 ptr->m_valuelen = ntohs(msg.valuelen);
                 ptr->m_val_read = 0;
                 ptr->m_state    = rdp_recv_get_reply::RGR_VAL;
-                ptr->m_time     = time(NULL);
+                ptr->m_time     = cagetime::now();
 
                 boost::shared_array<char> val(new char[ptr->m_valuelen]);
                 ptr->m_val = val;
@@ -634,7 +634,7 @@ namespace libcage {
                                 return false;
 
                         ptr->m_val_read += size;
-                        ptr->m_time      = time(NULL);
+                        ptr->m_time      = cagetime::now();
 
                         if (ptr->m_val_read += ptr->m_valuelen) {
                                 dht::value_t v;
@@ -777,7 +777,7 @@ namespace libcage {
 
                         m_proxy.m_rdp.send(desc, &msg, sizeof(msg));
 
-                        m_proxy.m_rdp_get_reply[desc] = time(NULL);
+                        m_proxy.m_rdp_get_reply[desc] = cagetime::now();
 
                         break;
                 }
@@ -814,7 +814,7 @@ namespace libcage {
                 desc = p_proxy->m_rdp.connect(0, src, proxy_get_reply_port,
                                               func);
 
-                p_proxy->m_rdp_get_reply[desc] = time(NULL);
+                p_proxy->m_rdp_get_reply[desc] = cagetime::now();
         }
 
         void
@@ -976,7 +976,7 @@ namespace libcage {
 
                         desc = m_rdp.connect(0, m_server.id, proxy_store_port,
                                              *func);
-                        m_rdp_store[desc] = time(NULL);
+                        m_rdp_store[desc] = cagetime::now();
                 }
 
                 m_store_data.clear();
@@ -1008,7 +1008,7 @@ namespace libcage {
                 p_get->m_key    = p_key;
                 p_get->m_keylen = keylen;
                 p_get->m_func   = func;
-                p_get->m_time   = time(NULL);
+                p_get->m_time   = cagetime::now();
                 p_get->m_nonce  = nonce;
                 p_get->m_data   = gdp;
 
@@ -1439,7 +1439,7 @@ namespace libcage {
 
                 ptr->m_keylen = ntohs(msg.keylen);
                 ptr->m_nonce  = ntohl(msg.nonce);
-                ptr->m_time   = time(NULL);
+                ptr->m_time   = cagetime::now();
                 ptr->m_state  = rdp_recv_get::RG_KEY;
 
                 boost::shared_array<char> key(new char[ptr->m_keylen]);
@@ -1592,7 +1592,7 @@ namespace libcage {
                 ptr->m_valuelen = ntohs(msg.valuelen);
                 ptr->m_ttl      = ntohs(msg.ttl);
                 ptr->m_id       = id;
-                ptr->m_time     = time(NULL);
+                ptr->m_time     = cagetime::now();
                 ptr->m_state    = rdp_recv_store::RS_KEY;
 
                 if (msg.flags & dht_flag_unique)
@@ -1621,7 +1621,7 @@ namespace libcage {
                                 return false;
 
                         ptr->m_key_read += size;
-                        ptr->m_time      = time(NULL);
+                        ptr->m_time      = cagetime::now();
 
                         if (ptr->m_keylen == ptr->m_key_read) {
                                 ptr->m_state = rdp_recv_store::RS_VAL;
@@ -1645,7 +1645,7 @@ namespace libcage {
                                 return;
 
                         ptr->m_val_read += size;
-                        ptr->m_time      = time(NULL);
+                        ptr->m_time      = cagetime::now();
 
                         if (ptr->m_valuelen == ptr->m_val_read) {
                                 m_proxy.m_rdp.close(desc);
@@ -1677,7 +1677,7 @@ namespace libcage {
 
                         rdp_recv_store_ptr ptr(new rdp_recv_store);
 
-                        ptr->m_time = time(NULL);
+                        ptr->m_time = cagetime::now();
                         ptr->m_src  = addr.did;
 
                         m_proxy.m_rdp_recv_store[desc] = ptr;
@@ -1730,7 +1730,7 @@ namespace libcage {
                 std::map<_id, _addr>::iterator it;
                 time_t now;
 
-                now = time(NULL);
+                now = cagetime::now();
 
                 for (it = m_registered.begin(); it != m_registered.end();) {
                         time_t diff = now - it->second.recv_time;
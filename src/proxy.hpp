@@ -233,7 +233,7 @@ namespace libcage {
                         recv_get_state  m_state;
 
                         rdp_recv_get(proxy &p) : m_proxy(p), m_key_read(0),
-                                                 m_time(time(NULL)),
+                                                 m_time(cagetime::now()),
                                                  m_state(RG_HDR) { }
                 };
 
@@ -328,7 +328,7 @@ namespace libcage {
                         time_t          m_time;
 
                         rdp_recv_get_reply() : m_state(RGR_HDR),
-                                               m_time(time(NULL)) { }
+                                               m_time(cagetime::now()) { }
                 };
 
                 typedef boost::shared_ptr<rdp_recv_get_reply> rdp_recv_get_reply_ptr;
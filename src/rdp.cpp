@@ -80,7 +80,7 @@ namespace libcage {
                 
                 for (it = m_rdp.m_desc2conn.begin();
                      it != m_rdp.m_desc2conn.end();) {
-                        time_t now = time(NULL);
+                        time_t now = cagetime::now();
                         time_t diff;
                         switch (it->second->state) {
                         case SYN_SENT:
@@ -317,8 +317,13 @@ namespace libcage {
                 while (! it->second->rqueue.empty()) {
                         packetbuf_ptr  pbuf = it->second->rqueue.front();
 
+                        // a segment longer than the buffer is read in part
                         if (total + pbuf->get_len() > *len) {
-                                *len = total;
+                                int size = *len - total;
+
+                                memcpy(dst, pbuf->get_data(), size);
+                                pbuf->rm_head(size);
+
                                 return;
                         }
 
@@ -372,7 +377,8 @@ namespace libcage {
                 for (;;) {
                         packetbuf_ptr pbuf = packetbuf::construct();
                         int   dmax = it->second->sbuf_max - sizeof(rdp_head);
-                        int   size = (len < dmax) ? len : dmax;
+                        int   left = len - total;
+                        int   size = (left < dmax) ? left : dmax;
                         void *data;
 
                         data = pbuf->append(size);
@@ -420,6 +426,7 @@ namespace libcage {
 
                         it->second->state     = CLOSE_WAIT_ACTIVE;
                         it->second->is_closed = true;
+                        it->second->free_wnd();
 
                         packetbuf_ptr  pbuf = packetbuf::construct();
                         rdp_head      *rst;
@@ -434,7 +441,7 @@ namespace libcage {
                         rst->dport  = htons(it->second->addr.dport);
                         rst->seqnum = htonl(it->second->snd_nxt);
 
-                        it->second->rst_time     = time(NULL);
+                        it->second->rst_time     = cagetime::now();
                         it->second->rst_tout     = 1;
                         it->second->is_retry_rst = true;
 
@@ -585,7 +592,7 @@ namespace libcage {
                 syn->out_segs_max = htons(p_con->rcv_max);
                 syn->seg_size_max = htons(p_con->rbuf_max);
 
-                p_con->syn_time = time(NULL);
+                p_con->syn_time = cagetime::now();
                 p_con->syn_tout = 1;
 
 
@@ -769,7 +776,7 @@ namespace libcage {
                         rst->dport  = htons(addr.dport);
                         rst->seqnum = htonl(p_con->snd_nxt);
 
-                        p_con->rst_time = time(NULL);
+                        p_con->rst_time = cagetime::now();
                         output(addr.did, pbuf);
                 }
         }
@@ -805,7 +812,7 @@ namespace libcage {
                         rst->dport  = htons(addr.dport);
                         rst->seqnum = htonl(p_con->snd_nxt);
 
-                        p_con->rst_time = time(NULL);
+                        p_con->rst_time = cagetime::now();
                         output(p_con->addr.did, pbuf_rst);
                 }
         }
@@ -964,7 +971,7 @@ namespace libcage {
                         syn_out->out_segs_max = htons(p_con->rcv_max);
                         syn_out->seg_size_max = htons(p_con->rbuf_max);
 
-                        p_con->syn_time = time(NULL);
+                        p_con->syn_time = cagetime::now();
                         p_con->syn_tout = 1;
 
                         p_con->acked_time.update();
@@ -1126,7 +1133,7 @@ namespace libcage {
                                 syn_out->out_segs_max = htons(p_con->rcv_max);
                                 syn_out->seg_size_max = htons(p_con->rbuf_max);
 
-                                p_con->syn_time = time(NULL);
+                                p_con->syn_time = cagetime::now();
                                 p_con->syn_tout = 1;
 
                                 output(addr.did, pbuf_syn);
@@ -1175,7 +1182,7 @@ namespace libcage {
                         syn->seg_size_max = htons(p_con->rbuf_max);
 
 
-                        p_con->syn_time = time(NULL);
+                        p_con->syn_time = cagetime::now();
 
                         output(addr.did, pbuf);
 
@@ -1440,6 +1447,7 @@ namespace libcage {
                         p_con->delayed_ack();
 
                         p_con->state = CLOSE_WAIT_PASV;
+                        p_con->free_wnd();
 
                         // send rst | fin
                         packetbuf_ptr  pbuf_rst = packetbuf::construct();
@@ -1455,7 +1463,7 @@ namespace libcage {
                         rst->dport  = htons(addr.dport);
                         rst->seqnum = htonl(p_con->snd_nxt);
 
-                        p_con->rst_time     = time(NULL);
+                        p_con->rst_time     = cagetime::now();
                         p_con->rst_tout     = 1;
                         p_con->is_retry_rst = true;
 
@@ -1578,6 +1586,18 @@ namespace libcage {
                 m_output_func = func;
         }
 
+        void
+        rdp::set_callback_rtt(callback_rtt func)
+        {
+                m_rtt_func = func;
+        }
+
+        void
+        rdp::set_callback_loss(callback_loss func)
+        {
+                m_loss_func = func;
+        }
+
         void
         rdp::set_callback_rdp_event(int desc, callback_rdp_event func)
         {
@@ -1608,6 +1628,21 @@ namespace libcage {
                 m_swnd = boost::shared_array<swnd>(new swnd[m_swnd_len]);
         }
 
+        void
+        rdp_con::free_wnd()
+        {
+                m_swnd.reset();
+                m_swnd_len    = 0;
+                m_swnd_head   = 0;
+                m_swnd_used   = 0;
+                m_swnd_ostand = 0;
+
+                m_rwnd.reset();
+                m_rwnd_len  = 0;
+                m_rwnd_head = 0;
+                m_rwnd_used = 0;
+        }
+
         bool
         rdp_con::retransmit()
         {
@@ -1637,7 +1672,7 @@ namespace libcage {
                                 return false;
                         }
 
-                        time_t now  = time(NULL);
+                        time_t now  = cagetime::now();
                         time_t diff = now - p_wnd->sent_time;
 
                         if (diff > p_wnd->rt_sec) {
@@ -1646,10 +1681,14 @@ namespace libcage {
 
                                 head->acknum = htonl(rcv_cur);
 
-                                p_wnd->sent_time  = now;
-                                p_wnd->rt_sec    *= 2;
+                                p_wnd->sent_time   = now;
+                                p_wnd->rt_sec     *= 2;
+                                p_wnd->is_retrans  = true;
 
                                 ref_rdp.output(addr.did, p_wnd->pbuf);
+
+                                if (ref_rdp.m_loss_func)
+                                        ref_rdp.m_loss_func(addr.did);
                         }
                 }
 
@@ -1671,6 +1710,7 @@ namespace libcage {
                 p_wnd->sent_time = 0;
                 p_wnd->is_acked  = false;
                 p_wnd->is_sent   = false;
+                p_wnd->is_retrans = false;
                 p_wnd->rt_sec    = 1;
 
                 m_swnd_used++;
@@ -1690,7 +1730,8 @@ namespace libcage {
                         if (snd_nxt - snd_una < snd_max) {
                                 swnd *p_wnd = &m_swnd[i];
 
-                                p_wnd->sent_time = time(NULL);
+                                p_wnd->sent_time = cagetime::now();
+                                p_wnd->sent_usec = cagetime::now_usec();
                                 p_wnd->is_sent   = true;
                                 p_wnd->seqnum    = snd_nxt;
 
@@ -1738,7 +1779,8 @@ namespace libcage {
                 // Endif
 
                 if (acknum - snd_una < snd_nxt - snd_una) {
-                        int i = m_swnd_head;
+                        int      i    = m_swnd_head;
+                        uint64_t sent = 0;
 
                         while (i != m_swnd_ostand) {
                                 swnd *p_wnd = &m_swnd[i];
@@ -1746,8 +1788,13 @@ namespace libcage {
                                 if (p_wnd->seqnum - snd_una <=
                                     acknum - snd_una) {
                                         if (p_wnd->is_sent) {
-                                                if (! p_wnd->is_acked)
+                                                if (! p_wnd->is_acked) {
                                                         p_wnd->pbuf.reset();
+
+                                                        // Karn's algorithm
+                                                        if (! p_wnd->is_retrans)
+                                                                sent = p_wnd->sent_usec;
+                                                }
                                                 m_swnd_used--;
                                         }
                                 } else {
@@ -1761,11 +1808,26 @@ namespace libcage {
 
                         m_swnd_head = i;
                         snd_una     = acknum;
+
+                        // the newest segment acked gives an RTT sample
+                        if (sent != 0)
+                                rtt_sample(sent);
                 }
 
                 send_ostand_swnd();
         }
 
+        void
+        rdp_con::rtt_sample(uint64_t sent)
+        {
+                // acks may be delayed up to ack_interval, so the samples
+                // are upper bounds of the RTT
+                if (ref_rdp.m_rtt_func)
+                        ref_rdp.m_rtt_func(addr.did,
+                                           (uint32_t)(cagetime::now_usec() -
+                                                      sent));
+        }
+
         void
         rdp_con::recv_eack(uint32_t eacknum)
         {
@@ -1788,6 +1850,9 @@ namespace libcage {
                     p_wnd->is_sent && ! p_wnd->is_acked) {
                         p_wnd->pbuf.reset();
                         p_wnd->is_acked = true;
+
+                        if (! p_wnd->is_retrans)
+                                rtt_sample(p_wnd->sent_usec);
                 }
 
 
@@ -113,6 +113,8 @@ namespace libcage {
         size_t hash_value(const rdp_addr &addr);
 
         typedef boost::function<void (id_ptr, packetbuf_ptr)> callback_dgram_out;
+        typedef boost::function<void (id_ptr, uint32_t usec)> callback_rtt;
+        typedef boost::function<void (id_ptr)> callback_loss;
         typedef boost::function<void (int desc, rdp_addr addr,
                                       rdp_event event)> callback_rdp_event;
 
@@ -151,6 +153,8 @@ namespace libcage {
                 void            set_callback_rdp_event(int desc,
                                                        callback_rdp_event func);
                 void            set_callback_dgram_out(callback_dgram_out func);
+                void            set_callback_rtt(callback_rtt func);
+                void            set_callback_loss(callback_loss func);
                 void            input_dgram(id_ptr src, packetbuf_ptr pbuf);
 
         private:
@@ -179,6 +183,8 @@ namespace libcage {
 
                 
                 callback_dgram_out         m_output_func;
+                callback_rtt               m_rtt_func;
+                callback_loss              m_loss_func;
 
                 rand_uint                 &m_rnd;
 
@@ -282,6 +288,9 @@ namespace libcage {
 
                 void            init_rwnd();
 
+                // a closing connection sends and receives no more data
+                void            free_wnd();
+
                 bool            retransmit();
 
                 void            set_output_func(callback_dgram_out func);
@@ -289,6 +298,7 @@ namespace libcage {
 
                 void            recv_ack(uint32_t acknum);
                 void            recv_eack(uint32_t eacknum);
+                void            rtt_sample(uint64_t sent);
 
                 void            delayed_ack();
 
@@ -304,8 +314,10 @@ namespace libcage {
                 public:
                         packetbuf_ptr   pbuf;
                         time_t          sent_time;
+                        uint64_t        sent_usec;
                         bool            is_acked;
                         bool            is_sent;
+                        bool            is_retrans;
                         uint32_t        seqnum;
                         time_t          rt_sec;
                 };
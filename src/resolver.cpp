@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2009, Yuuki Takano (ytakanoster@gmail.com).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the writers nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "resolver.hpp"
+
+#include <stdio.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif // WIN32
+
+namespace libcage {
+        const int       resolver::max_cache = 256;
+
+#ifndef WIN32
+        void
+        resolver_callback(int fd, short event, void *arg)
+        {
+                cagetime::dispatch d;
+                resolver *r = (resolver*)arg;
+                char      buf[64];
+
+                while (read(fd, buf, sizeof(buf)) > 0);
+
+                r->recv_done();
+        }
+
+        void*
+        resolver_main(void *arg)
+        {
+                resolver *r = (resolver*)arg;
+
+                pthread_mutex_lock(&r->m_mutex);
+
+                for (;;) {
+                        while (r->m_req.empty() && ! r->m_is_stop)
+                                pthread_cond_wait(&r->m_cond, &r->m_mutex);
+
+                        if (r->m_is_stop)
+                                break;
+
+                        resolver::_request req = r->m_req.front();
+                        r->m_req.pop_front();
+
+                        pthread_mutex_unlock(&r->m_mutex);
+
+                        req.result = resolver::lookup(req.domain,
+                                                      req.key.host,
+                                                      req.key.port,
+                                                      &req.saddr);
+
+                        pthread_mutex_lock(&r->m_mutex);
+
+                        r->m_done.push_back(req);
+
+                        char c = 0;
+                        if (write(r->m_pipe[1], &c, 1) < 0)
+                                perror("write");
+                }
+
+                pthread_mutex_unlock(&r->m_mutex);
+
+                return NULL;
+        }
+#endif // WIN32
+
+        resolver::resolver() : m_domain(PF_INET), m_ttl(300), m_ttl_fail(10),
+                               m_is_started(false), m_is_stop(false)
+        {
+#ifndef WIN32
+                pthread_mutex_init(&m_mutex, NULL);
+                pthread_cond_init(&m_cond, NULL);
+#endif // WIN32
+        }
+
+        resolver::~resolver()
+        {
+#ifndef WIN32
+                if (m_is_started) {
+                        pthread_mutex_lock(&m_mutex);
+                        m_is_stop = true;
+                        pthread_cond_signal(&m_cond);
+                        pthread_mutex_unlock(&m_mutex);
+
+                        // waits for a lookup in progress
+                        pthread_join(m_thread, NULL);
+
+                        event_del(&m_event);
+                        close(m_pipe[0]);
+                        close(m_pipe[1]);
+                }
+
+                pthread_cond_destroy(&m_cond);
+                pthread_mutex_destroy(&m_mutex);
+#endif // WIN32
+        }
+
+        void
+        resolver::set_domain(int domain)
+        {
+                if (domain != m_domain) {
+                        m_domain = domain;
+                        m_cache.clear();
+                }
+        }
+
+        void
+        resolver::set_ttl(int ttl, int ttl_fail)
+        {
+                m_ttl      = ttl;
+                m_ttl_fail = ttl_fail;
+        }
+
+        bool
+        resolver::lookup(int domain, const std::string &host, int port,
+                         sockaddr_storage *saddr)
+        {
+                addrinfo  hints;
+                addrinfo* res = NULL;
+                int       err;
+                char      str[20];
+
+                memset(&hints, 0, sizeof(hints));
+
+                hints.ai_family   = domain;
+                hints.ai_flags    = AI_PASSIVE;
+                hints.ai_protocol = IPPROTO_UDP;
+                hints.ai_socktype = SOCK_DGRAM;
+
+                snprintf(str, sizeof(str), "%d", port);
+
+                err = getaddrinfo(host.c_str(), str, &hints, &res);
+                if (err != 0) {
+                        perror("getaddrinfo");
+                        return false;
+                }
+
+                memset(saddr, 0, sizeof(*saddr));
+                memcpy(saddr, res->ai_addr, res->ai_addrlen);
+
+                freeaddrinfo(res);
+
+                return true;
+        }
+
+        bool
+        resolver::get_cache(const _key &key, _entry &ent)
+        {
+                std::map<_key, _entry>::iterator it;
+
+                it = m_cache.find(key);
+                if (it == m_cache.end())
+                        return false;
+
+                if (it->second.expire <= cagetime::now()) {
+                        m_cache.erase(it);
+                        return false;
+                }
+
+                ent = it->second;
+
+                return true;
+        }
+
+        void
+        resolver::put_cache(const _key &key, bool result,
+                            const sockaddr_storage &saddr)
+        {
+                time_t now = cagetime::now();
+
+                if ((int)m_cache.size() >= max_cache &&
+                    m_cache.find(key) == m_cache.end()) {
+                        // drop the expired entries, or the one expiring
+                        // first when none has expired
+                        std::map<_key, _entry>::iterator it, it_min;
+
+                        it_min = m_cache.end();
+                        for (it = m_cache.begin(); it != m_cache.end();) {
+                                if (it->second.expire <= now) {
+                                        m_cache.erase(it++);
+                                        continue;
+                                }
+
+                                if (it_min == m_cache.end() ||
+                                    it->second.expire < it_min->second.expire)
+                                        it_min = it;
+                                ++it;
+                        }
+
+                        if ((int)m_cache.size() >= max_cache)
+                                m_cache.erase(it_min);
+                }
+
+                _entry &ent = m_cache[key];
+
+                ent.result = result;
+                ent.saddr  = saddr;
+                ent.expire = now + (result ? m_ttl : m_ttl_fail);
+        }
+
+        void
+        resolver::clear_cache()
+        {
+                m_cache.clear();
+        }
+
+        bool
+        resolver::resolve_now(const std::string &host, int port,
+                              sockaddr_storage *saddr)
+        {
+                _entry ent;
+                _key   key;
+
+                key.host = host;
+                key.port = port;
+
+                if (get_cache(key, ent)) {
+                        if (ent.result)
+                                *saddr = ent.saddr;
+                        return ent.result;
+                }
+
+                ent.result = lookup(m_domain, host, port, &ent.saddr);
+                put_cache(key, ent.result, ent.saddr);
+
+                if (ent.result)
+                        *saddr = ent.saddr;
+
+                return ent.result;
+        }
+
+        void
+        resolver::resolve(const std::string &host, int port, callback func)
+        {
+                _entry ent;
+                _key   key;
+
+                key.host = host;
+                key.port = port;
+
+                if (get_cache(key, ent)) {
+                        func(ent.result, ent.saddr);
+                        return;
+                }
+
+                // a lookup of the same name is in progress
+                pending_map::iterator it = m_pending.find(key);
+                if (it != m_pending.end()) {
+                        it->second.push_back(func);
+                        return;
+                }
+
+#ifndef WIN32
+                if (start()) {
+                        _request req;
+
+                        req.key    = key;
+                        req.domain = m_domain;
+
+                        m_pending[key].push_back(func);
+
+                        pthread_mutex_lock(&m_mutex);
+                        m_req.push_back(req);
+                        pthread_cond_signal(&m_cond);
+                        pthread_mutex_unlock(&m_mutex);
+
+                        return;
+                }
+#endif // WIN32
+
+                // no helper thread
+                memset(&ent.saddr, 0, sizeof(ent.saddr));
+                ent.result = resolve_now(host, port, &ent.saddr);
+                func(ent.result, ent.saddr);
+        }
+
+        bool
+        resolver::start()
+        {
+#ifndef WIN32
+                if (m_is_started)
+                        return true;
+
+                if (pipe(m_pipe) < 0) {
+                        perror("pipe");
+                        return false;
+                }
+
+                fcntl(m_pipe[0], F_SETFL, O_NONBLOCK);
+                fcntl(m_pipe[1], F_SETFL, O_NONBLOCK);
+
+                if (pthread_create(&m_thread, NULL, resolver_main,
+                                   this) != 0) {
+                        perror("pthread_create");
+                        close(m_pipe[0]);
+                        close(m_pipe[1]);
+                        return false;
+                }
+
+                event_set(&m_event, m_pipe[0], EV_READ | EV_PERSIST,
+                          resolver_callback, this);
+                event_add(&m_event, NULL);
+
+                m_is_started = true;
+
+                return true;
+#else
+                return false;
+#endif // WIN32
+        }
+
+        void
+        resolver::recv_done()
+        {
+#ifndef WIN32
+                std::list<_request> done;
+
+                pthread_mutex_lock(&m_mutex);
+                done.swap(m_done);
+                pthread_mutex_unlock(&m_mutex);
+
+                while (! done.empty()) {
+                        _request &req = done.front();
+                        std::vector<callback> funcs;
+                        pending_map::iterator it;
+
+                        put_cache(req.key, req.result, req.saddr);
+
+                        it = m_pending.find(req.key);
+                        if (it != m_pending.end()) {
+                                funcs.swap(it->second);
+                                m_pending.erase(it);
+                        }
+
+                        // the callbacks may resolve again
+                        for (size_t i = 0; i < funcs.size(); i++)
+                                funcs[i](req.result, req.saddr);
+
+                        done.pop_front();
+                }
+#endif // WIN32
+        }
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2009, Yuuki Takano (ytakanoster@gmail.com).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the writers nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RESOLVER_HPP
+#define RESOLVER_HPP
+
+#include "common.hpp"
+
+#include "cagetime.hpp"
+
+#include <event.h>
+#include <time.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#endif // WIN32
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+namespace libcage {
+        // resolves host names on a helper thread so that getaddrinfo()
+        // does not block the event loop, and caches the results
+        class resolver {
+        public:
+                typedef boost::function<void (bool, sockaddr_storage&)>
+                callback;
+
+                resolver();
+                virtual ~resolver();
+
+                void            set_domain(int domain);
+
+                // seconds to keep successful and failed results
+                void            set_ttl(int ttl, int ttl_fail);
+
+                // func is called on the event loop thread, before
+                // returning when the result is cached
+                void            resolve(const std::string &host, int port,
+                                        callback func);
+
+                // blocking, but uses and fills the cache
+                bool            resolve_now(const std::string &host, int port,
+                                            sockaddr_storage *saddr);
+
+                void            clear_cache();
+
+                friend void     resolver_callback(int fd, short event,
+                                                  void *arg);
+                friend void*    resolver_main(void *arg);
+
+        private:
+                static const int        max_cache;
+
+                class _key {
+                public:
+                        std::string     host;
+                        int             port;
+
+                        bool operator< (const _key &rhs) const
+                        {
+                                if (port != rhs.port)
+                                        return port < rhs.port;
+
+                                return host < rhs.host;
+                        }
+                };
+
+                class _entry {
+                public:
+                        bool                    result;
+                        sockaddr_storage        saddr;
+                        time_t                  expire;
+                };
+
+                class _request {
+                public:
+                        _key                    key;
+                        int                     domain;
+                        bool                    result;
+                        sockaddr_storage        saddr;
+                };
+
+                typedef std::map<_key, std::vector<callback> >  pending_map;
+
+                int                     m_domain;
+                int                     m_ttl;
+                int                     m_ttl_fail;
+                std::map<_key, _entry>  m_cache;
+                pending_map             m_pending;
+
+                // m_req is read by the helper thread, m_done is written
+                // by it. both are guarded by m_mutex
+                std::list<_request>     m_req;
+                std::list<_request>     m_done;
+                bool                    m_is_started;
+                bool                    m_is_stop;
+                int                     m_pipe[2];
+                event                   m_event;
+#ifndef WIN32
+                pthread_t               m_thread;
+                pthread_mutex_t         m_mutex;
+                pthread_cond_t          m_cond;
+#endif // WIN32
+
+                static bool     lookup(int domain, const std::string &host,
+                                       int port, sockaddr_storage *saddr);
+
+                bool            get_cache(const _key &key, _entry &ent);
+                void            put_cache(const _key &key, bool result,
+                                          const sockaddr_storage &saddr);
+                bool            start();
+                void            recv_done();
+        };
+}
+
+#endif // RESOLVER_HPP
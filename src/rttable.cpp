@@ -31,39 +31,205 @@
 
 #include "rttable.hpp"
 
+#include <algorithm>
 #include <set>
 
 #include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
 
 namespace libcage {
-        const int       rttable::max_entry = 20;
         const int       rttable::ping_timeout = 2;
+        const uint32_t  rttable::rtt_unknown  = 200 * 1000;
+        const uint32_t  rttable::rto_initial  = 1000 * 1000;
+        const uint32_t  rttable::rto_min      = 200 * 1000;
+
+        static inline const uint160_t&
+        key_id(rttable::entry_view v)
+        {
+                return v->id;
+        }
+
+        static inline const uint160_t&
+        key_id(const cageaddr *addr)
+        {
+                return *addr->id;
+        }
+
+        // orders candidates by distance, then by their order
+        template <typename K>
+        class dist_less {
+        public:
+                const uint160_t        *m_id;
+
+                bool operator() (const K &lhs, const K &rhs) const
+                {
+                        int c;
+
+                        if (lhs.prefix != rhs.prefix)
+                                return lhs.prefix < rhs.prefix;
+
+                        c = m_id->cmp_distance(key_id(lhs.item),
+                                               key_id(rhs.item));
+                        if (c != 0)
+                                return c < 0;
+
+                        return lhs.order < rhs.order;
+                }
+        };
+
+        // move the nearest num distinct candidates to the front in order
+        // and return how many there are. the nearest ones are selected in
+        // linear time and only they are sorted
+        template <typename K>
+        static int
+        select_nearest(const uint160_t &id, std::vector<K> &cand, int num)
+        {
+                dist_less<K> less;
+                int size = cand.size();
+                int from = 0;
+                int n    = 0;
+
+                less.m_id = &id;
+
+                while (n < num && from < size) {
+                        int k = from + (num - n);
+
+                        if (k > size)
+                                k = size;
+
+                        if (k < size)
+                                std::nth_element(cand.begin() + from,
+                                                 cand.begin() + k,
+                                                 cand.end(), less);
+
+                        std::sort(cand.begin() + from, cand.begin() + k,
+                                  less);
+
+                        // the same ID has the same distance, and sorts
+                        // next to each other
+                        for (int i = from; i < k; i++) {
+                                if (n > 0 &&
+                                    cand[n - 1].prefix == cand[i].prefix &&
+                                    key_id(cand[n - 1].item) ==
+                                    key_id(cand[i].item))
+                                        continue;
+
+                                if (n != i)
+                                        cand[n] = cand[i];
+                                n++;
+                        }
+
+                        from = k;
+                }
+
+                return n;
+        }
+
+        void
+        rttable::entry::from_cageaddr(const cageaddr &addr)
+        {
+                id        = *addr.id;
+                domain    = addr.domain;
+                last_seen = cagetime::now();
+
+                memset(&saddr, 0, sizeof(saddr));
+
+                if (domain == domain_inet) {
+                        in_ptr in = boost::get<in_ptr>(addr.saddr);
+                        memcpy(&saddr.in, in.get(), sizeof(saddr.in));
+                } else if (domain == domain_inet6) {
+                        in6_ptr in6 = boost::get<in6_ptr>(addr.saddr);
+                        memcpy(&saddr.in6, in6.get(), sizeof(saddr.in6));
+                }
+        }
+
+        void
+        rttable::entry::to_cageaddr(cageaddr &addr) const
+        {
+                // the ID and the address share one allocation
+                boost::shared_ptr<entry> e = boost::make_shared<entry>(*this);
+
+                addr.id     = id_ptr(e, &e->id);
+                addr.domain = domain;
+
+                if (domain == domain_inet)
+                        addr.saddr = in_ptr(e, &e->saddr.in);
+                else if (domain == domain_inet6)
+                        addr.saddr = in6_ptr(e, &e->saddr.in6);
+        }
+
+        int
+        rttable::bucket::find(const uint160_t &id) const
+        {
+                for (int n = 0; n < m_num; n++) {
+                        if (m_entries[n].id == id)
+                                return n;
+                }
+
+                return -1;
+        }
+
+        void
+        rttable::bucket::erase(int n)
+        {
+                for (; n < m_num - 1; n++)
+                        m_entries[n] = m_entries[n + 1];
+
+                m_num--;
+        }
+
+        rttable::entry&
+        rttable::bucket::push_back()
+        {
+                if (m_entries.get() == NULL)
+                        m_entries.reset(new entry[max_entry]);
+
+                entry &e = m_entries[m_num++];
+
+                e.loss   = 0;
+                e.srtt   = 0;
+                e.rttvar = 0;
+
+                return e;
+        }
 
         void
         rttable::timer_ping::operator() ()
         {
-                std::list<cageaddr> &row = m_rttable->m_table[m_i];
+                bucket &row = m_rttable->m_table[m_i];
+                int     n;
 
-                row.pop_front();
-                row.push_back(m_addr_new);
+                n = row.find(*m_addr_old.id);
+                if (n >= 0) {
+                        row.erase(n);
+                        m_rttable->m_num_nodes--;
+                }
 
-                m_rttable->m_ping_send.erase(m_i);
-                m_rttable->m_nodes.erase(*m_addr_old.id);
-                m_rttable->m_nodes.insert(*m_addr_new.id);
+                if (row.find(*m_addr_new.id) < 0 && row.m_num < max_entry) {
+                        row.push_back().from_cageaddr(m_addr_new);
+                        m_rttable->m_num_nodes++;
+                }
 
                 // add timed out
                 m_rttable->m_peers.add_timeout(m_addr_old.id);
 
                 // delete this
                 // do not reference menber variables after this code
+                m_rttable->m_ping_send.erase(m_i);
                 m_rttable->m_ping_wait.erase(m_nonce);
         }
 
         rttable::rttable(rand_uint &rnd, const uint160_t &id, timer &t,
-                         peers &p) : m_rnd(rnd), m_id(id), m_timer(t),
-                                     m_peers(p)
+                         peers &p) : m_num_nodes(0), m_rnd(rnd), m_id(id),
+                                     m_timer(t), m_peers(p)
         {
-
+                m_self.id.fill_zero();
+                m_self.domain    = domain_loopback;
+                m_self.loss      = 0;
+                m_self.srtt      = 0;
+                m_self.rttvar    = 0;
+                m_self.last_seen = 0;
+                memset(&m_self.saddr, 0, sizeof(m_self.saddr));
         }
 
         rttable::~rttable()
@@ -74,7 +240,7 @@ namespace libcage {
         bool
         rttable::is_zero()
         {
-                if (m_table.size() == 0)
+                if (m_num_nodes == 0)
                         return true;
                 else
                         return false;
@@ -83,136 +249,166 @@ namespace libcage {
         void
         rttable::add(const cageaddr &addr)
         {
-                int i;
+                int i, n;
 
                 if (*addr.id == m_id)
                         return;
 
                 i = id2i(*addr.id);
 
-                if (i < 0 || m_nodes.find(*addr.id) != m_nodes.end())
+                if (i < 0)
+                        return;
+
+                bucket &row = m_table[i];
+
+                n = row.find(*addr.id);
+                if (n >= 0) {
+                        // move to the tail as the most recently seen,
+                        // keeping the measured RTT and loss
+                        entry e = row.m_entries[n];
+
+                        e.from_cageaddr(addr);
+                        row.erase(n);
+                        row.push_back() = e;
                         return;
+                }
 
-                if (m_table.find(i) == m_table.end()) {
-                        m_table[i].push_back(addr);
-                        m_nodes.insert(*addr.id);
+                if (row.m_num < max_entry) {
+                        row.push_back().from_cageaddr(addr);
+                        m_num_nodes++;
+                } else if (m_ping_send.find(i) != m_ping_send.end()){
+                        return;
                 } else {
-                        std::list<cageaddr>           &row = m_table[i];
-                        std::list<cageaddr>::iterator  it;
-
-                        for (it = row.begin(); it != row.end(); ++it) {
-                                if (*it->id == *addr.id) {
-                                        row.erase(it);
-                                        row.push_back(addr);
-                                        return;
-                                }
+                        uint32_t nonce;
+                        for (;;) {
+                                nonce = m_rnd();
+                                if (m_ping_wait.find(nonce) ==
+                                    m_ping_wait.end())
+                                        break;
                         }
 
 
-                        if ((int)m_table[i].size() < max_entry) {
-                                m_table[i].push_back(addr);
-                                m_nodes.insert(*addr.id);
-                        } else if (m_ping_send.find(i) != m_ping_send.end()){
-                                return;
-                        } else {
-                                uint32_t nonce;
-                                for (;;) {
-                                        nonce = m_rnd();
-                                        if (m_ping_wait.find(nonce) ==
-                                            m_ping_wait.end())
-                                                break;
-                                }
+                        // ping the least recently seen node, or the
+                        // lossiest one, which is likely to be replaced
+                        int        old = 0;
 
+                        for (n = 1; n < row.m_num; n++) {
+                                if (row.m_entries[n].loss >
+                                    row.m_entries[old].loss)
+                                        old = n;
+                        }
 
-                                // start timer
-                                cageaddr  &addr_old(m_table[i].front());
-                                timer_ptr  func(new timer_ping);
-                                timeval    tval;
-                        
-                                func->m_rttable  = this;
-                                func->m_addr_old = addr_old;
-                                func->m_addr_new = addr;
-                                func->m_nonce    = nonce;
-                                func->m_i        = i;
 
-                                tval.tv_sec  = ping_timeout;
-                                tval.tv_usec = 0;
-                                m_timer.set_timer(func.get(), &tval);
+                        // start timer
+                        cageaddr   addr_old;
+                        timer_ptr  func(new timer_ping);
+                        timeval    tval;
 
+                        row.m_entries[old].to_cageaddr(addr_old);
 
-                                // set state
-                                m_ping_wait[nonce] = func;
-                                m_ping_send.insert(i);
+                        func->m_rttable  = this;
+                        func->m_addr_old = addr_old;
+                        func->m_addr_new = addr;
+                        func->m_nonce    = nonce;
+                        func->m_sent     = cagetime::now_usec();
+                        func->m_i        = i;
 
+                        tval.tv_sec  = ping_timeout;
+                        tval.tv_usec = 0;
+                        m_timer.set_timer(func.get(), &tval);
 
-                                // send ping
-                                send_ping(addr_old, nonce);
-                        }
+
+                        // set state
+                        m_ping_wait[nonce] = func;
+                        m_ping_send.insert(i);
+
+
+                        // send ping
+                        send_ping(addr_old, nonce);
                 }
         }
 
         void
         rttable::remove(const uint160_t &id)
         {
-                if (m_nodes.find(id) == m_nodes.end())
-                        return;
-
-                int                  i = id2i(id);
-                std::list<cageaddr> &row = m_table[i];
+                int i = id2i(id);
+                int n;
 
-                std::list<cageaddr>::iterator it;
-                for (it = row.begin(); it != row.end(); ++it) {
-                        if (*it->id == id) {
-                                row.erase(it);
-                                break;
-                        }
-                }
+                if (i < 0)
+                        return;
 
-                if (row.size() == 0)
-                        m_table.erase(i);
+                n = m_table[i].find(id);
+                if (n < 0)
+                        return;
 
-                m_nodes.erase(id);
+                m_table[i].erase(n);
+                m_num_nodes--;
         }
 
         void
         rttable::lookup(const uint160_t &id, int num,
-                        std::vector<cageaddr> &ret)
+                        std::vector<entry_view> &ret)
         {
-                std::set<int> is;
-                int n;
+                uint160_t is;
+                bool      self = false;
+                int       n;
+
+                is.fill_zero();
 
-                n = id2i4lookup(id, num, is);
+                n = id2i4lookup(id, num, is, self);
 
                 if (n < num)
                         id2i4lookupR(id, num - n, is);
 
-                std::vector<int>::iterator    i;
-                std::list<cageaddr>::iterator j;
+                m_cand.clear();
 
-                BOOST_FOREACH(int i, is) {
-                        if (i == -1) {
-                                cageaddr addr;
-                                addr.id  = id_ptr(new uint160_t);
-                                *addr.id = m_id;
+                if (self) {
+                        dist_key<entry_view> key;
 
-                                addr.domain = domain_loopback;
-                                ret.push_back(addr);
-                        } else {
-                                BOOST_FOREACH(cageaddr &addr, m_table[i]) {
-                                        ret.push_back(addr);
-                                }
-                        }
+                        m_self.id = m_id;
+
+                        key.prefix = id.distance_prefix(m_id);
+                        key.order  = 0;
+                        key.item   = &m_self;
+                        m_cand.push_back(key);
                 }
 
-                compare cmp;
-                cmp.m_id = &id;
+                for (int i = 0; i < num_bucket; i++) {
+                        if (! is.get_bit(i))
+                                continue;
 
-                std::sort(ret.begin(), ret.end(), cmp);
+                        bucket &row = m_table[i];
+                        for (int j = 0; j < row.m_num; j++) {
+                                dist_key<entry_view> key;
 
-                while ((int)ret.size() > num) {
-                        ret.pop_back();
+                                key.prefix = id.distance_prefix(
+                                        row.m_entries[j].id);
+                                key.order  = 0;
+                                key.item   = &row.m_entries[j];
+                                m_cand.push_back(key);
+                        }
                 }
 
+                n = select_nearest(id, m_cand, num);
+
+                for (int i = 0; i < n; i++)
+                        ret.push_back(m_cand[i].item);
+        }
+
+        void
+        rttable::lookup(const uint160_t &id, int num,
+                        std::vector<cageaddr> &ret)
+        {
+                m_views.clear();
+
+                lookup(id, num, m_views);
+
+                BOOST_FOREACH(entry_view v, m_views) {
+                        cageaddr addr;
+
+                        v->to_cageaddr(addr);
+                        ret.push_back(addr);
+                }
         }
 
         void
@@ -228,23 +424,16 @@ namespace libcage {
                         return;
                 }
 
+                bool is_same = false;
+
                 if (src.domain == domain_inet) {
                         in_ptr in1, in2;
                         in1 = boost::get<in_ptr>(src.saddr);
                         in2 = boost::get<in_ptr>(t->m_addr_old.saddr);
 
                         if (in1->sin_port == in2->sin_port &&
-                            in1->sin_addr.s_addr == in2->sin_addr.s_addr) {
-                                std::list<cageaddr> &row = m_table[t->m_i];
-                                cageaddr             addr;
-
-                                row.pop_front();
-                                row.push_back(t->m_addr_old);
-
-                                m_timer.unset_timer(t.get());
-                                m_ping_wait.erase(nonce);
-                                m_ping_send.erase(t->m_i);
-                        }
+                            in1->sin_addr.s_addr == in2->sin_addr.s_addr)
+                                is_same = true;
                 } else if (src.domain == domain_inet6) {
                         in6_ptr in6_1, in6_2;
                         in6_1 = boost::get<in6_ptr>(src.saddr);
@@ -252,17 +441,29 @@ namespace libcage {
 
                         if (in6_1->sin6_port == in6_2->sin6_port &&
                             memcmp(&in6_1->sin6_addr, &in6_2->sin6_addr,
-                                   sizeof(in6_addr) == 0)) {
-                                std::list<cageaddr> &row = m_table[t->m_i];
-                                cageaddr             addr;
+                                   sizeof(in6_addr) == 0))
+                                is_same = true;
+                }
+
+                if (is_same) {
+                        bucket &row = m_table[t->m_i];
+                        int     n   = row.find(*src.id);
 
-                                row.pop_front();
-                                row.push_back(t->m_addr_old);
+                        // the old node is alive, move it to the tail
+                        if (n >= 0) {
+                                entry e = row.m_entries[n];
 
-                                m_timer.unset_timer(t.get());
-                                m_ping_wait.erase(nonce);
-                                m_ping_send.erase(t->m_i);
+                                e.last_seen = cagetime::now();
+                                row.erase(n);
+                                row.push_back() = e;
+
+                                add_rtt(*src.id, (uint32_t)(cagetime::now_usec() -
+                                                            t->m_sent));
                         }
+
+                        m_timer.unset_timer(t.get());
+                        m_ping_wait.erase(nonce);
+                        m_ping_send.erase(t->m_i);
                 }
         }
 
@@ -272,80 +473,161 @@ namespace libcage {
 
         }
 
-        int
-        rttable::id2i(const uint160_t &id)
+        rttable::entry*
+        rttable::find_entry(const uint160_t &id)
         {
-                uint160_t d;
-                uint160_t mask;
-                uint160_t zero;
-                int       i;
+                int i = id2i(id);
+                int n;
 
-                d      = m_id ^ id;
-                mask   = 1;
-                mask <<= 159;
-                i      = 159;
+                if (i < 0)
+                        return NULL;
 
-                zero.fill_zero();
+                n = m_table[i].find(id);
+                if (n < 0)
+                        return NULL;
 
-                for (i = 159; i >= 0; i--) {
-                        if ((d & mask) > zero)
-                                break;
-                        mask >>= 1;
+                return &m_table[i].m_entries[n];
+        }
+
+        void
+        rttable::add_rtt(const uint160_t &id, uint32_t usec)
+        {
+                entry *e = find_entry(id);
+
+                if (e == NULL)
+                        return;
+
+                if (usec == 0)
+                        usec = 1;
+
+                // smoothed as TCP does (RFC 6298)
+                if (e->srtt == 0) {
+                        e->srtt   = usec;
+                        e->rttvar = usec / 2;
+                } else {
+                        uint32_t diff;
+
+                        diff = e->srtt > usec ? e->srtt - usec :
+                                usec - e->srtt;
+
+                        e->rttvar = (uint32_t)(((uint64_t)e->rttvar * 3 +
+                                                diff) / 4);
+                        e->srtt   = (uint32_t)(((uint64_t)e->srtt * 7 +
+                                                usec) / 8);
                 }
-                
-                return i;
+
+                // a reply is a successful sample of loss
+                e->loss -= e->loss / 8;
+        }
+
+        void
+        rttable::add_loss(const uint160_t &id)
+        {
+                entry *e = find_entry(id);
+
+                if (e == NULL)
+                        return;
+
+                e->loss += (1000 - e->loss) / 8;
+        }
+
+        // the expected time to get a reply from the node in usec. the RTT
+        // is inflated by the loss rate, as a lost request costs a timeout
+        uint32_t
+        rttable::get_cost(const uint160_t &id)
+        {
+                entry   *e = find_entry(id);
+                uint64_t cost;
+
+                if (e == NULL)
+                        return rtt_unknown;
+
+                if (e->srtt == 0)
+                        cost = rtt_unknown;
+                else
+                        cost = (uint64_t)e->srtt + 4 * (uint64_t)e->rttvar;
+
+                cost = cost * 1000 / (1000 - e->loss);
+
+                if (cost > 0xffffffff)
+                        cost = 0xffffffff;
+
+                return (uint32_t)cost;
+        }
+
+        // the retransmission timeout of TCP (RFC 6298) in usec, used to
+        // give up waiting for a reply from the node
+        uint32_t
+        rttable::get_rto(const uint160_t &id)
+        {
+                entry   *e = find_entry(id);
+                uint64_t rto;
+
+                if (e == NULL || e->srtt == 0)
+                        return rto_initial;
+
+                rto = (uint64_t)e->srtt + 4 * (uint64_t)e->rttvar;
+
+                if (rto < rto_min)
+                        rto = rto_min;
+
+                if (rto > 0xffffffff)
+                        rto = 0xffffffff;
+
+                return (uint32_t)rto;
         }
 
         int
-        rttable::id2i4lookup(const uint160_t &id, int max,
-                             std::set<int> &ret)
+        rttable::id2i(const uint160_t &id)
+        {
+                // the index of the most significant bit of the distance,
+                // -1 for my own ID
+                return 159 - m_id.prefix_len(id);
+        }
+
+        int
+        rttable::id2i4lookup(const uint160_t &id, int max, uint160_t &ret,
+                             bool &self)
         {
                 uint160_t id0 = id;
-                uint160_t id1 = 1;
                 int       i;
                 int       n = 0;
 
                 while (n < max) {
-                        uint160_t id3 = m_id ^ id0;
-                        if (id3.is_zero()) {
+                        if (m_id == id0) {
                                 n++;
-                                ret.insert(-1);
+                                self = true;
                                 break;
                         }
 
                         i = id2i(id0);
-                        if (m_table.find(i) != m_table.end()) {
-                                n += m_table[i].size();
-                                ret.insert(i);
+                        if (m_table[i].m_num > 0 && ! ret.get_bit(i)) {
+                                n += m_table[i].m_num;
+                                ret.flip_bit(i);
                         }
 
-                        uint160_t id2 = id1 << i;
-
-                        id0 ^= id2;
+                        id0.flip_bit(i);
                 }
 
                 return n;
         }
 
         int
-        rttable::id2i4lookupR(const uint160_t &id, int max,
-                              std::set<int> &ret)
+        rttable::id2i4lookupR(const uint160_t &id, int max, uint160_t &ret)
         {
-                std::map<int, std::list<cageaddr> >::iterator it;
-                uint160_t id0 = ~(m_id ^ id);
-                uint160_t id1 = 1;
-                int       n   = 0;
+                uint160_t d = m_id ^ id;
+                int       n = 0;
 
-                for (it = m_table.begin(); it != m_table.end(); ++it) {
+                for (int i = 0; i < num_bucket; i++) {
                         if (n >= max)
                                 break;
 
-                        uint160_t bits = id1 << it->first;
-                        bits &= id0;
+                        if (m_table[i].m_num == 0 || ret.get_bit(i))
+                                continue;
 
-                        if (! bits.is_zero()) {
-                                n += it->second.size();
-                                ret.insert(it->first);
+                        if (! d.get_bit(i)) {
+                                n += m_table[i].m_num;
+                                ret.flip_bit(i);
                         }
                 }
 
@@ -355,30 +637,36 @@ namespace libcage {
         bool
         rttable::has_id(uint160_t &id)
         {
-                return m_nodes.find(id) != m_nodes.end();
+                int i = id2i(id);
+
+                return i >= 0 && m_table[i].find(id) >= 0;
         }
 
         void
         rttable::print_table() const
         {
                 std::string str;
-                std::map<int, std::list<cageaddr> >::const_iterator i;
-                std::list<cageaddr>::const_iterator                 j;
 
-                for (i = m_table.begin(); i != m_table.end(); ++i) {
-                        const std::list<cageaddr> &row = i->second;
-                        printf("  i = %d\n", i->first);
+                for (int i = 0; i < num_bucket; i++) {
+                        const bucket &row = m_table[i];
+
+                        if (row.m_num == 0)
+                                continue;
+
+                        printf("  i = %d\n", i);
 
                         int n = 1;
-                        for (j = row.begin(); j != row.end(); ++j) {
-                                str = j->id->to_string();
+                        for (int k = 0; k < row.m_num; k++) {
+                                const entry *j = &row.m_entries[k];
+
+                                str = j->id.to_string();
                                 printf("    %02d: ID = %s,\n", n, str.c_str());
 
                                 if (j->domain == domain_inet) {
-                                        in_ptr   in;
+                                        const sockaddr_in *in;
                                         uint8_t *addr; 
 
-                                        in = boost::get<in_ptr>(j->saddr);
+                                        in = &j->saddr.in;
 
                                         addr = (uint8_t*)&in->sin_addr.s_addr;
 
@@ -390,10 +678,10 @@ namespace libcage {
                                                ntohs(in->sin_port));
 
                                 } else if (j->domain == domain_inet6) {
-                                        in6_ptr  in6;
+                                        const sockaddr_in6 *in6;
                                         uint8_t *addr;
 
-                                        in6 = boost::get<in6_ptr>(j->saddr);
+                                        in6 = &j->saddr.in6;
 
                                         addr = (uint8_t*)in6->sin6_addr.s6_addr;
 
@@ -419,66 +707,75 @@ namespace libcage {
                              const std::vector<cageaddr> &v1,
                              const std::vector<cageaddr> &v2, int max)
         {
-                std::vector<cageaddr>::const_iterator it1, it2;
-                std::set<uint160_t> already;
-                int                 n = 0;
-
-                it1 = v1.begin();
-                it2 = v2.begin();
+                std::vector<dist_key<const cageaddr*> > cand;
+                int n;
 
-                while (n < max) {
-                        if (it1 == v1.end() && it2 == v2.end()) {
-                                break;
-                        } 
+                cand.resize(v1.size() + v2.size());
 
-                        if (it1 == v1.end()) {
-                                if (already.find(*it2->id) == already.end()) {
-                                        dst.push_back(*it2);
-                                        already.insert(*it2->id);
-                                }
-                                ++it2;
-                        } else if (it2 == v2.end()) {
-                                if (already.find(*it1->id) == already.end()) {
-                                        dst.push_back(*it1);
-                                        already.insert(*it1->id);
-                                }
-                                ++it1;
-                        } else if (*it1->id == *it2->id) {
-                                if (already.find(*it1->id) == already.end()) {
-                                        dst.push_back(*it1);
-                                        already.insert(*it1->id);
-                                }
-                                ++it1;
-                                ++it2;
-                        } else if ((*it1->id ^ id) < (*it2->id ^ id)) {
-                                if (already.find(*it1->id) == already.end()) {
-                                        dst.push_back(*it1);
-                                        already.insert(*it1->id);
-                                }
-                                ++it1;
-                        } else {
-                                if (already.find(*it2->id) == already.end()) {
-                                        dst.push_back(*it2);
-                                        already.insert(*it2->id);
-                                }
-                                ++it2;
-                        }
+                // a node in both v1 and v2 is taken from v1
+                n = 0;
+                BOOST_FOREACH(const cageaddr &addr, v1) {
+                        cand[n].prefix = id.distance_prefix(*addr.id);
+                        cand[n].order  = n;
+                        cand[n].item   = &addr;
+                        n++;
+                }
 
+                BOOST_FOREACH(const cageaddr &addr, v2) {
+                        cand[n].prefix = id.distance_prefix(*addr.id);
+                        cand[n].order  = n;
+                        cand[n].item   = &addr;
                         n++;
                 }
+
+                n = select_nearest(id, cand, max);
+
+                for (int i = 0; i < n; i++)
+                        dst.push_back(*cand[i].item);
         }
 
         int
         rttable::get_size()
         {
-                std::map<int, std::list<cageaddr> >::iterator it;
-                int num = 0;
+                return m_num_nodes;
+        }
+
+        void
+        write_nodes_inet(msg_inet *min,
+                         const std::vector<rttable::entry_view> &nodes)
+        {
+                BOOST_FOREACH(rttable::entry_view v, nodes) {
+                        if (v->domain == domain_loopback) {
+                                min->port = 0;
+                                min->addr = 0;
+                        } else {
+                                min->port = v->saddr.in.sin_port;
+                                min->addr = v->saddr.in.sin_addr.s_addr;
+                        }
+                        v->id.to_binary(min->id, sizeof(min->id));
 
-                for (it = m_table.begin(); it != m_table.end(); ++it) {
-                        num += it->second.size();
+                        min++;
                 }
+        }
 
-                return num;
+        void
+        write_nodes_inet6(msg_inet6 *min6,
+                          const std::vector<rttable::entry_view> &nodes)
+        {
+                BOOST_FOREACH(rttable::entry_view v, nodes) {
+                        if (v->domain == domain_loopback) {
+                                min6->port = 0;
+                                memset(min6->addr, 0, sizeof(min6->addr));
+                        } else {
+                                min6->port = v->saddr.in6.sin6_port;
+                                memcpy(min6->addr,
+                                       v->saddr.in6.sin6_addr.s6_addr,
+                                       sizeof(min6->addr));
+                        }
+                        v->id.to_binary(min6->id, sizeof(min6->id));
+
+                        min6++;
+                }
         }
 
 #ifdef DEBUG
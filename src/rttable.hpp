@@ -41,6 +41,8 @@
 #include <set>
 #include <vector>
 
+#include <boost/scoped_array.hpp>
+
 #include "bn.hpp"
 #include "cagetypes.hpp"
 #include "peers.hpp"
@@ -50,6 +52,32 @@
 namespace libcage {
         class rttable {
         public:
+                static const int        max_entry = 20;
+                static const int        num_bucket = 160;
+
+                // a node stored in the table by value
+                class entry {
+                public:
+                        uint160_t       id;
+                        uint16_t        domain;
+                        uint16_t        loss;      // permille, smoothed
+                        uint32_t        srtt;      // usec, 0 if unknown
+                        uint32_t        rttvar;    // usec
+                        time_t          last_seen;
+
+                        union {
+                                sockaddr_in     in;
+                                sockaddr_in6    in6;
+                        } saddr;
+
+                        void            from_cageaddr(const cageaddr &addr);
+                        void            to_cageaddr(cageaddr &addr) const;
+                };
+
+                // a view of an entry. it is valid until the table is
+                // modified
+                typedef const entry    *entry_view;
+
                 rttable(rand_uint &rnd, const uint160_t &id, timer &t,
                         peers &p);
                 virtual ~rttable();
@@ -58,9 +86,16 @@ namespace libcage {
                 void            remove(const uint160_t &id);
                 void            lookup(const uint160_t &id, int num, 
                                        std::vector<cageaddr> &ret);
+                void            lookup(const uint160_t &id, int num, 
+                                       std::vector<entry_view> &ret);
 
                 void            recv_ping_reply(cageaddr &src, uint32_t nonce);
 
+                void            add_rtt(const uint160_t &id, uint32_t usec);
+                void            add_loss(const uint160_t &id);
+                uint32_t        get_cost(const uint160_t &id);
+                uint32_t        get_rto(const uint160_t &id);
+
                 void            print_table() const;
                 bool            is_zero();
                 int             get_size();
@@ -82,14 +117,23 @@ namespace libcage {
                         bool operator() (const cageaddr &lhs,
                                          const cageaddr &rhs) const
                         {
-                                return (*m_id ^ *lhs.id) < (*m_id ^ *rhs.id);
+                                return m_id->cmp_distance(*lhs.id,
+                                                          *rhs.id) < 0;
+                        }
+
+                        bool operator() (entry_view lhs, entry_view rhs) const
+                        {
+                                return m_id->cmp_distance(lhs->id,
+                                                          rhs->id) < 0;
                         }
                 };
 
 
         private:
-                static const int        max_entry;
                 static const int        ping_timeout;
+                static const uint32_t   rtt_unknown;
+                static const uint32_t   rto_initial;
+                static const uint32_t   rto_min;
 
 
                 class timer_ping : public timer::callback {
@@ -100,6 +144,7 @@ namespace libcage {
                         cageaddr        m_addr_old;
                         cageaddr        m_addr_new;
                         uint32_t        m_nonce;
+                        uint64_t        m_sent;
                         int             m_i;
                 };
 
@@ -107,10 +152,38 @@ namespace libcage {
 
                 typedef boost::shared_ptr<timer_ping>   timer_ptr;
 
-                std::map<int, std::list<cageaddr> >  m_table;
+                // entries are ordered from the least recently seen. the
+                // array is allocated when the first entry is added
+                class bucket {
+                public:
+                        bucket() : m_num(0) { }
+
+                        boost::scoped_array<entry>      m_entries;
+                        int                             m_num;
+
+                        int             find(const uint160_t &id) const;
+                        void            erase(int n);
+                        entry&          push_back();
+                };
+
+                // a candidate of lookup or merge_nodes keyed by the top 64
+                // bits of its distance, which are computed once. the rest
+                // of the distance is compared only when they are the same
+                template <typename T>
+                class dist_key {
+                public:
+                        uint64_t        prefix;
+                        int             order;
+                        T               item;
+                };
+
+                bucket                  m_table[num_bucket];
                 std::map<uint32_t, timer_ptr>        m_ping_wait;
                 std::set<int>           m_ping_send;
-                std::set<uint160_t>     m_nodes;
+                int                     m_num_nodes;
+                entry                   m_self;
+                std::vector<entry_view> m_views;
+                std::vector<dist_key<entry_view> >      m_cand;
 
                 rand_uint              &m_rnd;
                 const uint160_t        &m_id;
@@ -118,16 +191,22 @@ namespace libcage {
                 peers                  &m_peers;
 
                 int             id2i(const uint160_t &id);
+                entry*          find_entry(const uint160_t &id);
                 int             id2i4lookup(const uint160_t &id, int max,
-                                            std::set<int> &ret);
+                                            uint160_t &ret, bool &self);
                 int             id2i4lookupR(const uint160_t &id, int max,
-                                             std::set<int> &ret);
+                                             uint160_t &ret);
 
 #ifdef DEBUG
         public:
                 static void     test_rttable();
 #endif // DEBUG
         };
+
+        void            write_nodes_inet(msg_inet *min,
+                                         const std::vector<rttable::entry_view> &nodes);
+        void            write_nodes_inet6(msg_inet6 *min6,
+                                          const std::vector<rttable::entry_view> &nodes);
 }
 
 #endif // RTTABLE_HPP
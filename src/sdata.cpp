@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2009, Yuuki Takano (ytakanoster@gmail.com).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the writers nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sdata.hpp"
+
+#include "cagetime.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+namespace libcage {
+        skey_ptr
+        skey::construct(const uint160_t &id, const void *key, uint16_t keylen)
+        {
+                void *p = ::operator new(sizeof(skey) + keylen);
+                skey *k = new (p) skey;
+
+                k->m_id     = id;
+                k->m_keylen = keylen;
+                memcpy(k->m_key, key, keylen);
+
+                return skey_ptr(k);
+        }
+
+        bool
+        skey::is_key(const void *key, uint16_t keylen) const
+        {
+                return m_keylen == keylen && memcmp(m_key, key, keylen) == 0;
+        }
+
+        void
+        intrusive_ptr_add_ref(skey *k)
+        {
+                k->m_refc++;
+        }
+
+        void
+        intrusive_ptr_release(skey *k)
+        {
+                k->m_refc--;
+                if (k->m_refc == 0) {
+                        k->~skey();
+                        ::operator delete(k);
+                }
+        }
+
+        sval_ptr
+        sval::construct(const void *value, uint16_t valuelen,
+                        const uint160_t &src)
+        {
+                void *p = ::operator new(sizeof(sval) + valuelen);
+                sval *v = new (p) sval;
+
+                v->m_src      = src;
+                v->m_valuelen = valuelen;
+                memcpy(v->m_value, value, valuelen);
+
+                return sval_ptr(v);
+        }
+
+        bool
+        sval::is_recvd(const uint160_t &id) const
+        {
+                uint32_t h = (uint32_t)id.hash_value();
+
+                if (m_recvd == NULL)
+                        return false;
+
+                for (uint32_t i = 1; i <= m_recvd[0]; i++) {
+                        if (m_recvd[i] == h)
+                                return true;
+                }
+
+                return false;
+        }
+
+        void
+        sval::insert_recvd(const uint160_t &id)
+        {
+                uint32_t  num = m_recvd == NULL ? 0 : m_recvd[0];
+                uint32_t *p;
+
+                if (is_recvd(id))
+                        return;
+
+                p = (uint32_t*)realloc(m_recvd, sizeof(*p) * (num + 2));
+                if (p == NULL)
+                        return;
+
+                p[0]       = num + 1;
+                p[num + 1] = (uint32_t)id.hash_value();
+
+                m_recvd = p;
+        }
+
+        uint16_t
+        sval::remaining_ttl() const
+        {
+                time_t diff = cagetime::now() - stored_time;
+
+                return diff < ttl ? ttl - diff : 0;
+        }
+
+        bool
+        sval::operator< (const sval &rhs) const
+        {
+                if (m_valuelen != rhs.m_valuelen)
+                        return m_valuelen < rhs.m_valuelen;
+
+                return memcmp(m_value, rhs.m_value, m_valuelen) < 0;
+        }
+
+        bool
+        sval::operator== (const sval &rhs) const
+        {
+                return m_valuelen == rhs.m_valuelen &&
+                        memcmp(m_value, rhs.m_value, m_valuelen) == 0;
+        }
+
+        void
+        intrusive_ptr_add_ref(sval *v)
+        {
+                v->m_refc++;
+        }
+
+        void
+        intrusive_ptr_release(sval *v)
+        {
+                v->m_refc--;
+                if (v->m_refc == 0) {
+                        free(v->m_recvd);
+                        v->~sval();
+                        ::operator delete(v);
+                }
+        }
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2009, Yuuki Takano (ytakanoster@gmail.com).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the writers nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SDATA_HPP
+#define SDATA_HPP
+
+#include "common.hpp"
+
+#include "bn.hpp"
+
+#include <stdint.h>
+#include <time.h>
+
+#include <set>
+
+#include <boost/intrusive_ptr.hpp>
+
+namespace libcage {
+        class skey;
+        class sval;
+
+        void    intrusive_ptr_add_ref(skey *k);
+        void    intrusive_ptr_release(skey *k);
+        void    intrusive_ptr_add_ref(sval *v);
+        void    intrusive_ptr_release(sval *v);
+
+        typedef boost::intrusive_ptr<skey> skey_ptr;
+        typedef boost::intrusive_ptr<sval> sval_ptr;
+
+        // the id and the key of stored values in one allocation, shared
+        // by the values of the key and their entries in the expiry heap
+        class skey {
+        public:
+                static skey_ptr construct(const uint160_t &id, const void *key,
+                                          uint16_t keylen);
+
+                const uint160_t&        get_id() const { return m_id; }
+                const char*             get_key() const { return m_key; }
+                uint16_t                get_keylen() const { return m_keylen; }
+
+                bool            is_key(const void *key, uint16_t keylen) const;
+
+                friend void     intrusive_ptr_add_ref(skey *k);
+                friend void     intrusive_ptr_release(skey *k);
+
+        private:
+                skey() : m_refc(0), m_keylen(0) { }
+
+                uint160_t       m_id;
+                int32_t         m_refc;
+                uint16_t        m_keylen;
+                char            m_key[1];
+        };
+
+        // a stored value with what is kept of it in one allocation. the
+        // nodes which have it are kept as 32 bit hashes of their ids, in
+        // an array allocated when the first is added
+        class sval {
+        public:
+                static sval_ptr construct(const void *value, uint16_t valuelen,
+                                          const uint160_t &src);
+
+                const char*             get_value() const { return m_value; }
+                uint16_t                get_valuelen() const
+                {
+                        return m_valuelen;
+                }
+                const uint160_t&        get_src() const { return m_src; }
+
+                bool            is_recvd(const uint160_t &id) const;
+                void            insert_recvd(const uint160_t &id);
+
+                // 0 when expired
+                uint16_t        remaining_ttl() const;
+
+                // by the bytes of the values
+                bool            operator< (const sval &rhs) const;
+                bool            operator== (const sval &rhs) const;
+
+                friend void     intrusive_ptr_add_ref(sval *v);
+                friend void     intrusive_ptr_release(sval *v);
+
+                time_t          stored_time;
+                time_t          expire_at;      // of its entry in m_expiry
+                uint64_t        pos;            // in the sstore, 0 if none
+                uint16_t        ttl;
+                int8_t          original;
+                bool            is_unique;
+
+        private:
+                sval() : stored_time(0), expire_at(0), pos(0), ttl(0),
+                         original(0), is_unique(false), m_recvd(NULL),
+                         m_refc(0), m_valuelen(0) { }
+
+                uint32_t       *m_recvd;        // the number, then hashes
+                uint160_t       m_src;
+                int32_t         m_refc;
+                uint16_t        m_valuelen;
+                char            m_value[1];
+        };
+
+        class sval_less {
+        public:
+                bool operator() (const sval_ptr &lhs,
+                                 const sval_ptr &rhs) const
+                {
+                        return *lhs < *rhs;
+                }
+        };
+
+        typedef std::set<sval_ptr, sval_less> sval_set;
+}
+
+#endif // SDATA_HPP
@@ -0,0 +1,516 @@
+/*
+ * Copyright (c) 2009, Yuuki Takano (ytakanoster@gmail.com).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the writers nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sstore.hpp"
+
+#include "cagetime.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+  #include <dirent.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/types.h>
+#endif // WIN32
+
+namespace libcage {
+        const size_t    sstore_log::default_seg_bytes = 64 * 1024 * 1024;
+        const uint32_t  sstore_log::log_magic         = 0x43414753; // CAGS
+        const uint32_t  sstore_log::log_version       = 1;
+        const size_t    sstore_log::compact_step      = 4 * 1024 * 1024;
+        const uint8_t   sstore_log::rec_erased        = 0x01;
+        const uint8_t   sstore_log::rec_unique        = 0x02;
+
+        sstore_log::sstore_log(const std::string &dir, size_t seg_bytes) :
+                m_dir(dir),
+                m_seg_bytes(seg_bytes),
+                m_active(0),
+                m_compact(0),
+                m_compact_off(0)
+        {
+                // a record of the largest key and value must fit
+                if (m_seg_bytes < 1024 * 1024)
+                        m_seg_bytes = 1024 * 1024;
+        }
+
+        sstore_log::~sstore_log()
+        {
+                close();
+        }
+
+        bool
+        sstore_log::open()
+        {
+#ifdef WIN32
+                return false;
+#else
+                DIR    *dir;
+                dirent *ent;
+
+                if (mkdir(m_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+                        perror("mkdir");
+                        return false;
+                }
+
+                dir = opendir(m_dir.c_str());
+                if (dir == NULL) {
+                        perror("opendir");
+                        return false;
+                }
+
+                // the segments are named by their number, 00000001.log
+                while ((ent = readdir(dir)) != NULL) {
+                        unsigned long num;
+                        char         *end;
+
+                        if (strlen(ent->d_name) != 12 ||
+                            strcmp(ent->d_name + 8, ".log") != 0)
+                                continue;
+
+                        num = strtoul(ent->d_name, &end, 16);
+                        if (end != ent->d_name + 8 || num == 0)
+                                continue;
+
+                        if (! open_seg((uint32_t)num, false)) {
+                                closedir(dir);
+                                close();
+                                return false;
+                        }
+                }
+
+                closedir(dir);
+
+                return true;
+#endif // WIN32
+        }
+
+        void
+        sstore_log::close()
+        {
+                while (! m_segs.empty())
+                        close_seg(m_segs.begin(), false);
+
+                m_active  = 0;
+                m_compact = 0;
+        }
+
+        std::string
+        sstore_log::seg_path(uint32_t num) const
+        {
+                char name[16];
+
+                snprintf(name, sizeof(name), "%08x.log", num);
+
+                return m_dir + "/" + name;
+        }
+
+        bool
+        sstore_log::open_seg(uint32_t num, bool is_new)
+        {
+#ifdef WIN32
+                return false;
+#else
+                std::string path = seg_path(num);
+                segment     seg;
+                seg_hdr    *hdr;
+
+                if (is_new) {
+                        seg.fd = ::open(path.c_str(),
+                                        O_RDWR | O_CREAT | O_EXCL, 0644);
+                        if (seg.fd < 0) {
+                                perror("open");
+                                return false;
+                        }
+
+                        if (ftruncate(seg.fd, m_seg_bytes) < 0) {
+                                perror("ftruncate");
+                                ::close(seg.fd);
+                                unlink(path.c_str());
+                                return false;
+                        }
+
+                        seg.len = m_seg_bytes;
+                } else {
+                        struct stat st;
+
+                        seg.fd = ::open(path.c_str(), O_RDWR);
+                        if (seg.fd < 0) {
+                                perror("open");
+                                return false;
+                        }
+
+                        if (fstat(seg.fd, &st) < 0 ||
+                            st.st_size < (off_t)sizeof(seg_hdr) ||
+                            st.st_size > 0xffffffffLL) {
+                                fprintf(stderr, "%s: not a segment\n",
+                                        path.c_str());
+                                ::close(seg.fd);
+                                return false;
+                        }
+
+                        seg.len = st.st_size;
+                }
+
+                seg.addr = (char*)mmap(NULL, seg.len, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED, seg.fd, 0);
+                if (seg.addr == MAP_FAILED) {
+                        perror("mmap");
+                        ::close(seg.fd);
+                        return false;
+                }
+
+                hdr = (seg_hdr*)seg.addr;
+
+                if (is_new) {
+                        hdr->magic   = log_magic;
+                        hdr->version = log_version;
+                        hdr->seg     = num;
+                } else if (hdr->magic != log_magic ||
+                           hdr->version != log_version || hdr->seg != num) {
+                        fprintf(stderr, "%s: not a segment\n", path.c_str());
+                        munmap(seg.addr, seg.len);
+                        ::close(seg.fd);
+                        return false;
+                }
+
+                // load() finds the end of an old one
+                seg.end = sizeof(seg_hdr);
+
+                m_segs[num] = seg;
+
+                return true;
+#endif // WIN32
+        }
+
+        void
+        sstore_log::close_seg(seg_map::iterator it, bool is_unlink)
+        {
+#ifndef WIN32
+                munmap(it->second.addr, it->second.len);
+                ::close(it->second.fd);
+
+                if (is_unlink)
+                        unlink(seg_path(it->first).c_str());
+#endif // WIN32
+
+                m_segs.erase(it);
+        }
+
+        sstore_log::rec_hdr*
+        sstore_log::get_rec(uint64_t pos)
+        {
+                seg_map::iterator it;
+                size_t off = (size_t)(pos & 0xffffffff);
+
+                it = m_segs.find((uint32_t)(pos >> 32));
+                if (it == m_segs.end() || off >= it->second.end)
+                        return NULL;
+
+                return (rec_hdr*)(it->second.addr + off);
+        }
+
+        uint64_t
+        sstore_log::append(const rec_hdr &hdr, const void *key,
+                           const void *value)
+        {
+                seg_map::iterator it;
+                rec_hdr *rec;
+                size_t   size;
+                size_t   off;
+
+                size  = sizeof(hdr) + hdr.keylen + hdr.valuelen;
+                size += (8 - size % 8) % 8;
+
+                it = m_segs.find(m_active);
+                if (it == m_segs.end() ||
+                    it->second.end + size > it->second.len) {
+                        uint32_t num = 1;
+
+                        if (! m_segs.empty())
+                                num = m_segs.rbegin()->first + 1;
+
+                        if (! open_seg(num, true))
+                                return 0;
+
+                        m_active = num;
+                        it = m_segs.find(num);
+                }
+
+                segment &seg = it->second;
+
+                off = seg.end;
+                rec = (rec_hdr*)(seg.addr + off);
+
+                memcpy(rec, &hdr, sizeof(hdr));
+                rec->size = 0;
+
+                memcpy((char*)(rec + 1), key, hdr.keylen);
+                memcpy((char*)(rec + 1) + hdr.keylen, value, hdr.valuelen);
+                memset((char*)(rec + 1) + hdr.keylen + hdr.valuelen, 0,
+                       size - sizeof(hdr) - hdr.keylen - hdr.valuelen);
+
+                rec->size = (uint32_t)size;
+
+                seg.end  += size;
+                seg.live += size;
+
+                return to_pos(m_active, off);
+        }
+
+        void
+        sstore_log::load(callback_load func)
+        {
+                seg_map::iterator it;
+                time_t now = cagetime::now();
+
+                for (it = m_segs.begin(); it != m_segs.end(); ++it) {
+                        segment &seg = it->second;
+                        size_t   off = sizeof(seg_hdr);
+
+#ifndef WIN32
+                        madvise(seg.addr, seg.len, MADV_SEQUENTIAL);
+#endif // WIN32
+
+                        while (off + sizeof(rec_hdr) <= seg.len) {
+                                rec_hdr *rec = (rec_hdr*)(seg.addr + off);
+                                const char *key = (const char*)(rec + 1);
+                                uint160_t id, src;
+                                sval_ptr  val;
+
+                                // the end, or a record not written to the
+                                // end when the process stopped
+                                if (rec->size < sizeof(rec_hdr) ||
+                                    rec->size % 8 != 0 ||
+                                    rec->size > seg.len - off ||
+                                    sizeof(rec_hdr) + rec->keylen +
+                                    rec->valuelen > rec->size)
+                                        break;
+
+                                seg.end = off + rec->size;
+
+                                if (rec->flags & rec_erased) {
+                                        off += rec->size;
+                                        continue;
+                                }
+
+                                if (rec->expire <= now) {
+                                        rec->flags |= rec_erased;
+                                        off += rec->size;
+                                        continue;
+                                }
+
+                                id.from_binary(rec->id, sizeof(rec->id));
+                                src.from_binary(rec->src, sizeof(rec->src));
+
+                                val = sval::construct(key + rec->keylen,
+                                                      rec->valuelen, src);
+
+                                val->stored_time = now;
+                                val->pos         = to_pos(it->first, off);
+                                val->original    = rec->original;
+                                val->is_unique   = (rec->flags &
+                                                    rec_unique) != 0;
+
+                                if (rec->expire - now > 0xffff)
+                                        val->ttl = 0xffff;
+                                else
+                                        val->ttl = (uint16_t)(rec->expire -
+                                                              now);
+
+                                seg.live += rec->size;
+                                off      += rec->size;
+
+                                func(id, key, rec->keylen, val);
+                        }
+
+#ifndef WIN32
+                        madvise(seg.addr, seg.len, MADV_NORMAL);
+#endif // WIN32
+                }
+
+                if (! m_segs.empty())
+                        m_active = m_segs.rbegin()->first;
+        }
+
+        void
+        sstore_log::add(const skey &key, sval &val)
+        {
+                rec_hdr hdr;
+
+                memset(&hdr, 0, sizeof(hdr));
+
+                hdr.expire   = val.stored_time + val.ttl;
+                hdr.keylen   = key.get_keylen();
+                hdr.valuelen = val.get_valuelen();
+                hdr.original = val.original;
+
+                if (val.is_unique)
+                        hdr.flags |= rec_unique;
+
+                key.get_id().to_binary(hdr.id, sizeof(hdr.id));
+                val.get_src().to_binary(hdr.src, sizeof(hdr.src));
+
+                val.pos = append(hdr, key.get_key(), val.get_value());
+        }
+
+        void
+        sstore_log::update(const skey &key, sval &val)
+        {
+                rec_hdr *rec = get_rec(val.pos);
+
+                if (rec == NULL)
+                        return;
+
+                rec->expire   = val.stored_time + val.ttl;
+                rec->original = val.original;
+        }
+
+        void
+        sstore_log::erase(const skey &key, sval &val)
+        {
+                rec_hdr *rec = get_rec(val.pos);
+
+                if (rec == NULL || rec->flags & rec_erased)
+                        return;
+
+                rec->flags |= rec_erased;
+                m_segs[(uint32_t)(val.pos >> 32)].live -= rec->size;
+
+                val.pos = 0;
+        }
+
+        void
+        sstore_log::compact(callback_find find)
+        {
+                seg_map::iterator it;
+                size_t step = 0;
+
+                // the segment with the least live records, if they are
+                // half of it or less
+                if (m_compact == 0) {
+                        double min_ratio = 0.5;
+
+                        for (it = m_segs.begin(); it != m_segs.end(); ++it) {
+                                size_t used = it->second.end - sizeof(seg_hdr);
+                                double ratio;
+
+                                if (it->first == m_active)
+                                        continue;
+
+                                ratio = used ? (double)it->second.live / used
+                                             : 0.0;
+                                if (ratio <= min_ratio) {
+                                        min_ratio = ratio;
+                                        m_compact = it->first;
+                                }
+                        }
+
+                        if (m_compact == 0)
+                                return;
+
+                        m_compact_off = sizeof(seg_hdr);
+                }
+
+                it = m_segs.find(m_compact);
+                if (it == m_segs.end()) {
+                        m_compact = 0;
+                        return;
+                }
+
+                segment &seg = it->second;
+
+                while (m_compact_off < seg.end && step < compact_step) {
+                        rec_hdr *rec = (rec_hdr*)(seg.addr + m_compact_off);
+                        const char *key   = (const char*)(rec + 1);
+                        const char *value = key + rec->keylen;
+                        uint64_t pos = to_pos(m_compact, m_compact_off);
+
+                        if (! (rec->flags & rec_erased)) {
+                                uint160_t id;
+                                sval     *val;
+
+                                id.from_binary(rec->id, sizeof(rec->id));
+
+                                // the records of the values not in dht
+                                // are left behind
+                                val = find(id, key, rec->keylen, value,
+                                           rec->valuelen);
+                                if (val != NULL && val->pos == pos) {
+                                        uint64_t to;
+
+                                        to = append(*rec, key, value);
+                                        if (to == 0)
+                                                return;
+
+                                        val->pos = to;
+                                }
+                        }
+
+                        step          += rec->size;
+                        m_compact_off += rec->size;
+                }
+
+                if (m_compact_off >= seg.end) {
+                        close_seg(it, true);
+                        m_compact = 0;
+                }
+        }
+
+        uint64_t
+        sstore_log::get_bytes() const
+        {
+                seg_map::const_iterator it;
+                uint64_t bytes = 0;
+
+                for (it = m_segs.begin(); it != m_segs.end(); ++it)
+                        bytes += it->second.end;
+
+                return bytes;
+        }
+
+        uint64_t
+        sstore_log::get_live_bytes() const
+        {
+                seg_map::const_iterator it;
+                uint64_t bytes = 0;
+
+                for (it = m_segs.begin(); it != m_segs.end(); ++it)
+                        bytes += it->second.live;
+
+                return bytes;
+        }
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2009, Yuuki Takano (ytakanoster@gmail.com).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the writers nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SSTORE_HPP
+#define SSTORE_HPP
+
+#include "common.hpp"
+
+#include "bn.hpp"
+#include "sdata.hpp"
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace libcage {
+        // where the values stored by dht are kept. dht keeps them in
+        // memory to answer the requests, and tells the sstore about each
+        // value added, changed and removed so that it can give them back
+        // when the node starts again
+        class sstore {
+        public:
+                // a value kept from the last run, with its remaining ttl
+                // from now
+                typedef boost::function<void (const uint160_t &id,
+                                              const void *key,
+                                              uint16_t keylen,
+                                              sval_ptr val)>
+                callback_load;
+
+                // the value of dht for a record, NULL if it has none
+                typedef boost::function<sval* (const uint160_t &id,
+                                               const void *key,
+                                               uint16_t keylen,
+                                               const void *value,
+                                               uint16_t valuelen)>
+                callback_find;
+
+                virtual ~sstore() { }
+
+                virtual void    load(callback_load func) = 0;
+
+                virtual void    add(const skey &key, sval &val) = 0;
+
+                // the ttl or the original of val was changed
+                virtual void    update(const skey &key, sval &val) = 0;
+                virtual void    erase(const skey &key, sval &val) = 0;
+
+                // a step of the background work, called every few seconds
+                virtual void    compact(callback_find find) = 0;
+        };
+
+        typedef boost::shared_ptr<sstore> sstore_ptr;
+
+        // the values are lost when the node stops
+        class sstore_mem : public sstore {
+        public:
+                virtual void    load(callback_load func) { }
+                virtual void    add(const skey &key, sval &val) { }
+                virtual void    update(const skey &key, sval &val) { }
+                virtual void    erase(const skey &key, sval &val) { }
+                virtual void    compact(callback_find find) { }
+        };
+
+        // an append only log of the values in segment files of dir, which
+        // are mapped to memory. a value removed or changed is marked in
+        // its record, and the live records of a segment mostly removed
+        // are moved to the end of the log by compact(). the page cache
+        // has the records written when the process exits, so they survive
+        // a crash of the process but not of the host
+        class sstore_log : public sstore {
+        public:
+                static const size_t     default_seg_bytes;
+
+                sstore_log(const std::string &dir,
+                           size_t seg_bytes = default_seg_bytes);
+                virtual ~sstore_log();
+
+                // maps the segments of dir, making dir if it does not
+                // exist
+                bool            open();
+                void            close();
+
+                virtual void    load(callback_load func);
+                virtual void    add(const skey &key, sval &val);
+                virtual void    update(const skey &key, sval &val);
+                virtual void    erase(const skey &key, sval &val);
+                virtual void    compact(callback_find find);
+
+                // the bytes of the segments and of their live records
+                uint64_t        get_bytes() const;
+                uint64_t        get_live_bytes() const;
+
+        private:
+                static const uint32_t   log_magic;
+                static const uint32_t   log_version;
+                static const size_t     compact_step;
+
+                // at the top of a segment
+                struct seg_hdr {
+                        uint32_t        magic;
+                        uint32_t        version;
+                        uint32_t        seg;
+                        uint32_t        reserved;
+                };
+
+                // followed by the key and the value, padded to 8 bytes.
+                // size is written last, a record of size 0 is the end
+                struct rec_hdr {
+                        int64_t         expire;
+                        uint32_t        size;
+                        uint16_t        keylen;
+                        uint16_t        valuelen;
+                        uint8_t         flags;
+                        int8_t          original;
+                        uint16_t        reserved;
+                        uint8_t         id[20];
+                        uint8_t         src[20];
+                };
+
+                static const uint8_t    rec_erased;
+                static const uint8_t    rec_unique;
+
+                class segment {
+                public:
+                        int             fd;
+                        char           *addr;
+                        size_t          len;
+                        size_t          end;    // of the records
+                        size_t          live;   // bytes of the live records
+
+                        segment() : fd(-1), addr(NULL), len(0), end(0),
+                                    live(0) { }
+                };
+
+                typedef std::map<uint32_t, segment> seg_map;
+
+                bool            open_seg(uint32_t num, bool is_new);
+                void            close_seg(seg_map::iterator it,
+                                          bool is_unlink);
+                std::string     seg_path(uint32_t num) const;
+                rec_hdr*        get_rec(uint64_t pos);
+                uint64_t        append(const rec_hdr &hdr, const void *key,
+                                       const void *value);
+
+                static uint64_t to_pos(uint32_t seg, size_t off)
+                {
+                        return ((uint64_t)seg << 32) | off;
+                }
+
+                std::string     m_dir;
+                size_t          m_seg_bytes;
+                seg_map         m_segs;
+                uint32_t        m_active;       // appended to, 0 if none
+                uint32_t        m_compact;      // being compacted
+                size_t          m_compact_off;
+        };
+}
+
+#endif // SSTORE_HPP
@@ -31,54 +31,339 @@
 
 #include "timer.hpp"
 
+#include <string.h>
+
 #include <iostream>
 
 namespace libcage {
+        static int
+        first_bit(uint64_t word)
+        {
+#ifdef __GNUC__
+                return __builtin_ctzll(word);
+#else
+                int n = 0;
+
+                while (! (word & 1)) {
+                        word >>= 1;
+                        n++;
+                }
+
+                return n;
+#endif // __GNUC__
+        }
+
         void
         timer_callback(int fd, short event, void *arg)
         {
-                timer::callback &func = *(timer::callback*)arg;
-                timer *t = func.get_timer();
+                cagetime::dispatch d;
+                timer   *t = (timer*)arg;
+                uint64_t tick;
 
-                t->m_events.erase(&func);
+                // callbacks fired by run() must not reschedule, the next
+                // wake up is decided once everything has run
+                t->m_is_sched   = true;
+                t->m_sched_tick = 0;
 
-                func();
+                t->run(cagetime::now_usec() / 1000);
+
+                t->m_is_sched = false;
+
+                if (t->next_tick(tick))
+                        t->schedule(tick);
+        }
+
+        timer::callback::~callback()
+        {
+                if (m_next != NULL && m_timer != NULL)
+                        m_timer->unset_timer(this);
+        }
+
+        timer::timer() : m_cur(cagetime::now_usec() / 1000), m_num(0),
+                         m_is_ev_init(false), m_is_sched(false),
+                         m_sched_tick(0)
+        {
+                for (int i = 0; i < num_levels * num_slots; i++) {
+                        m_wheel[i].m_prev = &m_wheel[i];
+                        m_wheel[i].m_next = &m_wheel[i];
+                }
+
+                memset(m_bitmap, 0, sizeof(m_bitmap));
         }
 
         timer::~timer()
         {
-                boost::unordered_map<callback*,
-                        boost::shared_ptr<event> >::iterator it;
+                for (int i = 0; i < num_levels * num_slots; i++) {
+                        node *head = &m_wheel[i];
 
-                for (it = m_events.begin(); it != m_events.end(); ++it) {
-                        evtimer_del(it->second.get());
+                        while (head->m_next != head)
+                                unlink((callback*)head->m_next);
                 }
+
+                if (m_is_sched)
+                        evtimer_del(&m_event);
         }
 
         void
         timer::set_timer(callback *func, timeval *t)
         {
-                typedef boost::shared_ptr<event> ev_ptr;
-                ev_ptr ev = ev_ptr(new event);
+                uint64_t now, tick;
 
-                // delete old event
+                // delete old timer
                 unset_timer(func);
 
-                func->m_timer = this;
+                now = cagetime::now_usec();
+
+                // the wheel does not move while nothing is armed
+                if (m_num == 0 && now / 1000 > m_cur)
+                        m_cur = now / 1000;
 
-                // add new event
-                m_events[func] = ev;
-                evtimer_set(ev.get(), timer_callback, func);
-                evtimer_add(ev.get(), t);
+                func->m_timer  = this;
+                func->m_expire = now + (uint64_t)t->tv_sec * 1000000 +
+                                 t->tv_usec;
+                func->m_expire = (func->m_expire + 999) / 1000;
+
+                if (func->m_expire < m_cur)
+                        func->m_expire = m_cur;
+
+                add(func);
+                m_num++;
+
+                tick = event_tick(func);
+                if (! m_is_sched || tick < m_sched_tick)
+                        schedule(tick);
         }
 
         void
         timer::unset_timer(callback *func)
         {
-                if (m_events.find(func) != m_events.end()) {
-                        evtimer_del(m_events[func].get());
-                        m_events.erase(func);
+                if (func->m_next == NULL || func->m_timer != this)
+                        return;
+
+                // the libevent timer is left as it is. an early wake up
+                // finds nothing to run and sleeps again
+                unlink(func);
+                m_num--;
+        }
+
+        void
+        timer::add(callback *func)
+        {
+                uint64_t delta = func->m_expire - m_cur;
+                node    *head;
+                int      level;
+                int      idx;
+
+                for (level = 0; level < num_levels - 1; level++) {
+                        if (delta < ((uint64_t)1 << (level_bits * (level + 1))))
+                                break;
+                }
+
+                if (delta >= ((uint64_t)1 << (level_bits * num_levels)))
+                        func->m_expire = m_cur +
+                                ((uint64_t)1 << (level_bits * num_levels)) - 1;
+
+                idx  = (func->m_expire >> (level_bits * level)) & slot_mask;
+                idx += level * num_slots;
+                head = &m_wheel[idx];
+
+                func->m_slot = idx;
+                func->m_prev = head->m_prev;
+                func->m_next = head;
+                head->m_prev->m_next = func;
+                head->m_prev = func;
+
+                m_bitmap[idx / 64] |= (uint64_t)1 << (idx % 64);
+        }
+
+        void
+        timer::unlink(callback *func)
+        {
+                func->m_prev->m_next = func->m_next;
+                func->m_next->m_prev = func->m_prev;
+
+                if (func->m_slot >= 0) {
+                        node *head = &m_wheel[func->m_slot];
+
+                        if (head->m_next == head)
+                                m_bitmap[func->m_slot / 64] &=
+                                        ~((uint64_t)1 << (func->m_slot % 64));
+                }
+
+                func->m_prev = NULL;
+                func->m_next = NULL;
+                func->m_slot = -1;
+        }
+
+        void
+        timer::cascade(int level)
+        {
+                int   idx = (m_cur >> (level_bits * level)) & slot_mask;
+                node *head = &m_wheel[level * num_slots + idx];
+
+                // m_cur has reached the slot, so every entry moves to a
+                // lower level
+                while (head->m_next != head) {
+                        callback *func = (callback*)head->m_next;
+
+                        unlink(func);
+                        add(func);
+                }
+        }
+
+        void
+        timer::run(uint64_t now)
+        {
+                uint64_t tick;
+
+                while (next_tick(tick) && tick <= now) {
+                        node  fired;
+                        node *head;
+                        int   level;
+
+                        m_cur = tick;
+
+                        for (level = num_levels - 1; level > 0; level--) {
+                                uint64_t mask;
+                                mask = ((uint64_t)1 << (level_bits * level)) - 1;
+                                if ((m_cur & mask) == 0)
+                                        break;
+                        }
+
+                        for (; level > 0; level--)
+                                cascade(level);
+
+                        // move the expired slot aside, callbacks may arm
+                        // or cancel other timers while it is processed
+                        head = &m_wheel[m_cur & slot_mask];
+
+                        if (head->m_next == head) {
+                                m_cur++;
+                                continue;
+                        }
+
+                        fired.m_next = head->m_next;
+                        fired.m_prev = head->m_prev;
+                        fired.m_next->m_prev = &fired;
+                        fired.m_prev->m_next = &fired;
+                        head->m_next = head;
+                        head->m_prev = head;
+
+                        m_bitmap[(m_cur & slot_mask) / 64] &=
+                                ~((uint64_t)1 << ((m_cur & slot_mask) % 64));
+
+                        for (node *n = fired.m_next; n != &fired;
+                             n = n->m_next) {
+                                ((callback*)n)->m_slot = -1;
+                        }
+
+                        m_cur++;
+
+                        while (fired.m_next != &fired) {
+                                callback *func = (callback*)fired.m_next;
+
+                                unlink(func);
+                                m_num--;
+
+                                (*func)();
+                        }
+                }
+
+                if (m_num == 0 && now > m_cur)
+                        m_cur = now;
+        }
+
+        int
+        timer::next_bit(int level, int from)
+        {
+                const uint64_t *bm = &m_bitmap[level * num_slots / 64];
+                int             words = num_slots / 64;
+                int             w = from / 64;
+                uint64_t        word;
+
+                // search from the slot "from" to the end, then wrap around
+                word = bm[w] & (~(uint64_t)0 << (from % 64));
+                if (word)
+                        return w * 64 + first_bit(word);
+
+                for (int i = 1; i <= words; i++) {
+                        int n = (w + i) % words;
+
+                        word = bm[n];
+                        if (i == words)
+                                word &= ~(~(uint64_t)0 << (from % 64));
+
+                        if (word)
+                                return n * 64 + first_bit(word);
+                }
+
+                return -1;
+        }
+
+        bool
+        timer::next_tick(uint64_t &tick)
+        {
+                bool found = false;
+
+                if (m_num == 0)
+                        return false;
+
+                for (int level = 0; level < num_levels; level++) {
+                        uint64_t shift = level_bits * level;
+                        uint64_t base;
+                        uint64_t t;
+                        int      from;
+                        int      idx;
+
+                        // the first slot boundary of this level which is
+                        // not processed yet
+                        base = ((m_cur + ((uint64_t)1 << shift) - 1) >> shift);
+                        from = base & slot_mask;
+
+                        idx = next_bit(level, from);
+                        if (idx < 0)
+                                continue;
+
+                        t = (base + ((idx - from) & slot_mask)) << shift;
+
+                        if (! found || t < tick) {
+                                tick  = t;
+                                found = true;
+                        }
                 }
+
+                return found;
+        }
+
+        uint64_t
+        timer::event_tick(callback *func)
+        {
+                uint64_t shift = level_bits * (func->m_slot / num_slots);
+
+                return (func->m_expire >> shift) << shift;
+        }
+
+        void
+        timer::schedule(uint64_t tick)
+        {
+                timeval  tval;
+                uint64_t now = cagetime::now_usec();
+                uint64_t usec;
+
+                if (! m_is_ev_init) {
+                        evtimer_set(&m_event, timer_callback, this);
+                        m_is_ev_init = true;
+                }
+
+                usec = tick * 1000 > now ? tick * 1000 - now : 0;
+
+                tval.tv_sec  = usec / 1000000;
+                tval.tv_usec = usec % 1000000;
+
+                evtimer_add(&m_event, &tval);
+
+                m_is_sched   = true;
+                m_sched_tick = tick;
         }
 
 #ifdef DEBUG
@@ -34,29 +34,47 @@
 
 #include "common.hpp"
 
+#include "cagetime.hpp"
+
 #include <event.h>
 
-#include <boost/shared_ptr.hpp>
-#include <boost/unordered_map.hpp>
+#include <stdint.h>
 
 namespace libcage {
+        // hierarchical timing wheel driven by a single libevent timer.
+        // arming and cancelling a callback only links or unlinks the
+        // list node embedded in it
         class timer {
+        private:
+                class node {
+                public:
+                        node() : m_prev(NULL), m_next(NULL) {}
+
+                        node   *m_prev;
+                        node   *m_next;
+                };
+
         public:
-                class callback {
+                class callback : public node {
                 public:
                         virtual void    operator() () = 0;
 
-                        callback() {}
-                        virtual ~callback() {}
+                        callback() : m_timer(NULL), m_slot(-1) {}
+                        virtual ~callback();
 
                         timer  *get_timer() { return m_timer; }
 
                         friend class    timer;
 
                 private:
-                        timer  *m_timer;
+                        timer          *m_timer;
+                        uint64_t        m_expire;
+
+                        // index into m_wheel, -1 when not in the wheel
+                        int             m_slot;
                 };
 
+                timer();
                 virtual ~timer();
 
 
@@ -66,8 +84,35 @@ namespace libcage {
                 void            unset_timer(callback *func);
 
         private:
-                boost::unordered_map<callback*,
-                                     boost::shared_ptr<event> >  m_events;
+                // the wheel links to itself, so a timer must not be copied
+                timer(const timer &rhs);
+                timer&          operator =(const timer &rhs);
+
+                static const int        level_bits = 8;
+                static const int        num_levels = 4;
+                static const int        num_slots  = 1 << level_bits;
+                static const int        slot_mask  = num_slots - 1;
+
+                // a tick is a millisecond. m_cur is the first tick not
+                // processed yet
+                node            m_wheel[num_levels * num_slots];
+                uint64_t        m_bitmap[num_levels * num_slots / 64];
+                uint64_t        m_cur;
+                int             m_num;
+
+                event           m_event;
+                bool            m_is_ev_init;
+                bool            m_is_sched;
+                uint64_t        m_sched_tick;
+
+                void            add(callback *func);
+                void            unlink(callback *func);
+                void            cascade(int level);
+                void            run(uint64_t now);
+                bool            next_tick(uint64_t &tick);
+                uint64_t        event_tick(callback *func);
+                int             next_bit(int level, int from);
+                void            schedule(uint64_t tick);
 
 
 #ifdef DEBUG
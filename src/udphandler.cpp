@@ -32,19 +32,91 @@
 #include "udphandler.hpp"
 
 #include "cagetypes.hpp"
+#include "uring.hpp"
 
 #include <stdio.h>
 #include <string.h>
 #include <memory.h>
 
 #ifndef WIN32
+#include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
 #endif
 
+#include <errno.h>
+
 #include <iterator>
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define HAVE_RECVMMSG
+#define HAVE_SENDMMSG
+#endif
+
+#if !defined(WIN32) && defined(SO_REUSEPORT)
+#define HAVE_RX_THREADS
+#endif
+
 namespace libcage {
+        const int       udphandler::recv_batch_max     = 64;
+        const int       udphandler::recv_batch_default = 32;
+        const int       udphandler::tx_batch_max       = 64;
+        const int       udphandler::rx_threads_max     = 16;
+        const int       udphandler::rxq_max            = 4096;
+
+#ifdef HAVE_IO_URING
+        class udphandler::uring_state {
+        public:
+                static const int        num_entries = 256;
+                static const int        num_bufs    = 128;
+                static const int        num_slots   = 128;
+                static const int        buf_group   = 0;
+                static const uint64_t   recv_tag    = 0;
+
+                class tx_slot {
+                public:
+                        packetbuf_ptr           m_pbuf;
+                        msghdr                  m_msg;
+                        iovec                   m_iov;
+                        sockaddr_storage        m_addr;
+                };
+
+                uring           m_ring;
+                msghdr          m_recv_msg;
+                bool            m_is_armed;
+                int             m_num_queued;
+
+                // m_bufs[bid] is the packetbuf lent to the kernel as
+                // buffer bid. the array of slots is never resized, the
+                // kernel holds pointers to it
+                std::vector<packetbuf_ptr>      m_bufs;
+                std::vector<tx_slot>            m_slots;
+                std::vector<int>                m_free;
+
+                uring_state() : m_is_armed(false), m_num_queued(0),
+                                m_bufs(num_bufs), m_slots(num_slots)
+                {
+                        memset(&m_recv_msg, 0, sizeof(m_recv_msg));
+
+                        // room for both of sockaddr_in and sockaddr_in6
+                        m_recv_msg.msg_namelen = sizeof(sockaddr_in6);
+
+                        for (int i = num_slots - 1; i >= 0; i--)
+                                m_free.push_back(i);
+                }
+
+                void provide_buf(int bid)
+                {
+                        packetbuf_ptr pbuf = packetbuf::construct();
+
+                        pbuf->use_whole();
+                        m_bufs[bid] = pbuf;
+                        m_ring.add_buf(pbuf->get_data(), pbuf->get_len(),
+                                       bid);
+                }
+        };
+#endif // HAVE_IO_URING
+
 #ifndef WIN32
         int
         closesocket(SOCKET fd)
@@ -56,8 +128,144 @@ namespace libcage {
         void
         udp_callback(int fd, short event, void *arg)
         {
-                udphandler           &udp  = *(udphandler*)arg;
-                udphandler::callback &func = *udp.m_callback;
+                cagetime::dispatch d;
+                udphandler &udp = *(udphandler*)arg;
+
+                if (event == EV_TIMEOUT) {
+                        packetbuf_ptr pbuf = packetbuf::construct();
+                        (*udp.m_callback)(udp, pbuf, NULL, 0, true);
+                        udp.flush();
+                        return;
+                }
+
+#ifdef HAVE_IO_URING
+                // fd is the ring, readable when completions are queued
+                if (udp.m_uring != NULL) {
+                        udp.recv_uring();
+                        udp.flush();
+                        return;
+                }
+#endif // HAVE_IO_URING
+
+#ifdef HAVE_RECVMMSG
+                if (udp.m_recv_batch > 1)
+                        udp.recv_batch(fd);
+                else
+                        udp.recv_one(fd);
+#else
+                udp.recv_one(fd);
+#endif // HAVE_RECVMMSG
+
+                // send replies produced while handling the datagrams
+                udp.flush();
+        }
+
+        void
+        udp_tx_callback(int fd, short event, void *arg)
+        {
+                udphandler &udp = *(udphandler*)arg;
+
+                udp.m_is_tx_sched = false;
+                udp.flush();
+        }
+
+#ifdef HAVE_RX_THREADS
+        void
+        udp_rxq_callback(int fd, short event, void *arg)
+        {
+                cagetime::dispatch d;
+                udphandler &udp = *(udphandler*)arg;
+                char        buf[64];
+
+                while (read(fd, buf, sizeof(buf)) > 0);
+
+                udp.recv_rxq();
+                udp.flush();
+        }
+
+        void*
+        udp_worker_main(void *arg)
+        {
+                udphandler::worker &w   = *(udphandler::worker*)arg;
+                udphandler         &udp = *w.m_udp;
+                const int           num = 32;
+                char                bufs[num][2048];
+                sockaddr_storage    from[num];
+                int                 lens[num];
+                int                 fromlens[num];
+                int                 n, i;
+
+#ifdef HAVE_RECVMMSG
+                mmsghdr msgs[num];
+                iovec   iov[num];
+#endif // HAVE_RECVMMSG
+
+                while (! udp.m_rx_stop) {
+#ifdef HAVE_RECVMMSG
+                        memset(msgs, 0, sizeof(msgs));
+
+                        for (i = 0; i < num; i++) {
+                                iov[i].iov_base = bufs[i];
+                                iov[i].iov_len  = sizeof(bufs[i]);
+
+                                msgs[i].msg_hdr.msg_iov     = &iov[i];
+                                msgs[i].msg_hdr.msg_iovlen  = 1;
+                                msgs[i].msg_hdr.msg_name    = &from[i];
+                                msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+                        }
+
+                        // block for the first datagram only. the socket has
+                        // a receive timeout so that m_rx_stop is polled
+                        n = recvmmsg(w.m_socket, msgs, num, MSG_WAITFORONE,
+                                     NULL);
+
+                        for (i = 0; i < n; i++) {
+                                lens[i]     = msgs[i].msg_len;
+                                fromlens[i] = msgs[i].msg_hdr.msg_namelen;
+                        }
+#else
+                        socklen_t fromlen = sizeof(from[0]);
+                        ssize_t   len;
+
+                        len = recvfrom(w.m_socket, bufs[0], sizeof(bufs[0]),
+                                       0, (sockaddr*)&from[0], &fromlen);
+
+                        n = len < 0 ? -1 : 1;
+                        lens[0]     = len;
+                        fromlens[0] = fromlen;
+#endif // HAVE_RECVMMSG
+
+                        if (n < 0) {
+                                if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                                    errno != EINTR)
+                                        perror("recvmmsg");
+                                continue;
+                        }
+
+                        for (i = 0; i < n; i++) {
+                                sockaddr *saddr = (sockaddr*)&from[i];
+
+                                if (lens[i] <= 0)
+                                        continue;
+
+                                if (udp.m_worker_callback != NULL &&
+                                    ! (*udp.m_worker_callback)(w, bufs[i],
+                                                               lens[i], saddr,
+                                                               fromlens[i]))
+                                        continue;
+
+                                udp.push_rxq(bufs[i], lens[i], saddr,
+                                             fromlens[i]);
+                        }
+                }
+
+                return NULL;
+        }
+#endif // HAVE_RX_THREADS
+
+        void
+        udphandler::recv_one(SOCKET fd)
+        {
                 sockaddr_storage      from;
                 packetbuf_ptr         pbuf = packetbuf::construct();
 
@@ -69,12 +277,6 @@ namespace libcage {
                 int fromlen;
 #endif // WIN32
 
-                if (event == EV_TIMEOUT) {
-                        func(udp, pbuf, NULL, 0, true);
-                        return;
-                }
-
-
                 memset(&from, 0, sizeof(from));
                 fromlen = sizeof(from);
 
@@ -101,16 +303,121 @@ namespace libcage {
                         return;
                 }
 
-                func(udp, pbuf, (sockaddr*)&from, (int)fromlen, false);
+                (*m_callback)(*this, pbuf, (sockaddr*)&from, (int)fromlen,
+                              false);
         }
 
-        udphandler::udphandler() : m_callback(NULL), m_opened(false)
+#ifdef HAVE_RECVMMSG
+        void
+        udphandler::recv_batch(SOCKET fd)
         {
+                mmsghdr          msgs[recv_batch_max];
+                iovec            iov[recv_batch_max];
+                sockaddr_storage from[recv_batch_max];
+                int              num = m_recv_batch;
+                int              n, i;
+
+                while ((int)m_rbufs.size() < num)
+                        m_rbufs.push_back(packetbuf::construct());
+
+                memset(msgs, 0, sizeof(msgs[0]) * num);
+
+                for (i = 0; i < num; i++) {
+                        packetbuf_ptr &pbuf = m_rbufs[i];
 
+                        pbuf->use_whole();
+
+                        iov[i].iov_base = pbuf->get_data();
+                        iov[i].iov_len  = pbuf->get_len();
+
+                        msgs[i].msg_hdr.msg_iov     = &iov[i];
+                        msgs[i].msg_hdr.msg_iovlen  = 1;
+                        msgs[i].msg_hdr.msg_name    = &from[i];
+                        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+                }
+
+                // do not block when fewer than num datagrams are queued
+                n = recvmmsg(fd, msgs, num, MSG_DONTWAIT, NULL);
+                if (n < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                perror("recvmmsg");
+                        return;
+                }
+
+                for (i = 0; i < n; i++) {
+                        packetbuf_ptr pbuf = m_rbufs[i];
+
+                        m_rbufs[i] = packetbuf::construct();
+
+                        if (msgs[i].msg_len == 0)
+                                continue;
+
+                        // the callback may be unset while handling the burst
+                        if (m_callback == NULL)
+                                return;
+
+                        pbuf->set_len(msgs[i].msg_len);
+
+                        (*m_callback)(*this, pbuf, (sockaddr*)&from[i],
+                                      (int)msgs[i].msg_hdr.msg_namelen, false);
+                }
+        }
+#else
+        void
+        udphandler::recv_batch(SOCKET fd)
+        {
+                recv_one(fd);
+        }
+#endif // HAVE_RECVMMSG
+
+        void
+        udphandler::set_recv_batch(int num)
+        {
+#ifdef HAVE_RECVMMSG
+                if (num > recv_batch_max)
+                        num = recv_batch_max;
+                else if (num < 1)
+                        num = 1;
+#else
+                num = 1;
+#endif // HAVE_RECVMMSG
+
+                m_recv_batch = num;
+
+                if ((int)m_rbufs.size() > num)
+                        m_rbufs.resize(num);
+        }
+
+        udphandler::udphandler() : m_callback(NULL), m_has_tout(false),
+                                   m_opened(false),
+                                   m_txq_len(0), m_is_txq(false),
+                                   m_is_tx_sched(false),
+                                   m_num_rx_threads(1),
+                                   m_worker_callback(NULL),
+                                   m_rxq_len(0), m_rxq_notified(false),
+                                   m_rx_stop(false), m_is_uring(false),
+                                   m_uring(NULL)
+        {
+#ifndef WIN32
+                pthread_mutex_init(&m_rxq_mutex, NULL);
+#endif // WIN32
+
+                set_recv_batch(recv_batch_default);
+
+                memset(&m_tx_stats, 0, sizeof(m_tx_stats));
         }
 
         udphandler::~udphandler()
         {
+                if (m_opened)
+                        flush();
+
+                if (m_is_tx_sched)
+                        evtimer_del(&m_tx_event);
+
+                stop_workers();
+                stop_uring();
+
                 if (m_opened)
                         closesocket(m_socket);
 
@@ -118,6 +425,10 @@ namespace libcage {
                         unset_callback();
                         event_del(&m_event);
                 }
+
+#ifndef WIN32
+                pthread_mutex_destroy(&m_rxq_mutex);
+#endif // WIN32
         }
 
         void
@@ -141,36 +452,107 @@ namespace libcage {
         udphandler::get_sockaddr(sockaddr_storage *saddr, std::string host,
                                  int port)
         {
-                addrinfo  hints;
-                addrinfo* res = NULL;
-                int       err;
-                char      str[20];
+                return m_resolver.resolve_now(host, port, saddr);
+        }
 
-                memset(&hints, 0, sizeof(hints));
+        void
+        udphandler::resolve(std::string host, int port,
+                            resolver::callback func)
+        {
+                m_resolver.resolve(host, port, func);
+        }
 
-                hints.ai_family   = m_domain;
-                hints.ai_flags    = AI_PASSIVE;
-                hints.ai_protocol = IPPROTO_UDP;
-                hints.ai_socktype = SOCK_DGRAM;
+        void
+        udphandler::set_resolver_ttl(int ttl, int ttl_fail)
+        {
+                m_resolver.set_ttl(ttl, ttl_fail);
+        }
 
-                snprintf(str, sizeof(str), "%d", port);
+        void
+        udphandler::send_func::operator() (bool result,
+                                           sockaddr_storage &saddr)
+        {
+                if (! result)
+                        return;
 
-                err = getaddrinfo(host.c_str(), str, &hints, &res);
-                if (err != 0) {
-                        perror("getaddrinfo");
-                        return false;
+                if (saddr.ss_family == PF_INET) {
+                        p_udp->sendto(buf.get(), len, (sockaddr*)&saddr,
+                                      sizeof(sockaddr_in));
+                } else if (saddr.ss_family == PF_INET6) {
+                        p_udp->sendto(buf.get(), len, (sockaddr*)&saddr,
+                                      sizeof(sockaddr_in6));
                 }
+        }
 
-                memcpy(saddr, res->ai_addr, res->ai_addrlen);
+        void
+        udphandler::sendto(const void *msg, int len, const sockaddr* to,
+                           int tolen)
+        {
+#ifdef HAVE_IO_URING
+                if (m_uring != NULL && send_uring(msg, len, to, tolen))
+                        return;
+#endif // HAVE_IO_URING
 
-                freeaddrinfo(res);
+                if (! m_is_txq) {
+                        send_now(msg, len, to, tolen);
+                        return;
+                }
 
-                return true;
+                if (m_txq_len == (int)m_txq.size())
+                        m_txq.resize(m_txq_len + 1);
+
+                tx_entry &ent = m_txq[m_txq_len];
+                const char *p = (const char*)msg;
+
+                ent.m_buf.assign(p, p + len);
+                memcpy(&ent.m_addr, to, tolen);
+                ent.m_addrlen = tolen;
+
+                m_txq_len++;
+
+                if (m_txq_len >= tx_batch_max)
+                        flush();
+                else
+                        sched_flush();
         }
 
         void
-        udphandler::sendto(const void *msg, int len, const sockaddr* to,
-                           int tolen)
+        udphandler::sched_flush()
+        {
+                // sends issued outside of the receive callback, e.g. by
+                // timers, are flushed on the next loop
+                if (! m_is_tx_sched) {
+                        timeval tval;
+
+                        tval.tv_sec  = 0;
+                        tval.tv_usec = 0;
+
+                        // set here rather than in the constructor, which
+                        // may run before the event base is initialized
+                        evtimer_set(&m_tx_event, udp_tx_callback, this);
+                        evtimer_add(&m_tx_event, &tval);
+                        m_is_tx_sched = true;
+                }
+        }
+
+        void
+        udphandler::count_flush(int num)
+        {
+                int i;
+
+                m_tx_stats.num_flush++;
+                m_tx_stats.num_dgram += num;
+
+                if (num > m_tx_stats.max_batch)
+                        m_tx_stats.max_batch = num;
+
+                for (i = 0; (2 << i) <= num; i++);
+                m_tx_stats.hist[i]++;
+        }
+
+        void
+        udphandler::send_now(const void *msg, int len, const sockaddr* to,
+                             int tolen)
         {
 #ifndef WIN32
                 socklen_t slen = tolen;
@@ -196,48 +578,116 @@ namespace libcage {
         }
 
         void
-        udphandler::sendto(const void *msg, int len, std::string host, int port)
+        udphandler::flush()
         {
-                sockaddr_storage saddr;
-                if (! get_sockaddr(&saddr, host, port))
+                int num = m_txq_len;
+                int i;
+
+                if (m_is_tx_sched) {
+                        evtimer_del(&m_tx_event);
+                        m_is_tx_sched = false;
+                }
+
+#ifdef HAVE_IO_URING
+                if (m_uring != NULL) {
+                        int queued = m_uring->m_num_queued;
+
+                        m_uring->m_num_queued = 0;
+                        m_uring->m_ring.submit();
+
+                        if (queued > 0)
+                                count_flush(queued);
+                }
+#endif // HAVE_IO_URING
+
+                if (num == 0)
                         return;
 
-#ifndef WIN32
-                ssize_t sendlen = 0;
-                size_t  l = len;
-#else
-                int sendlen = 0;
-                int l = len;
-#endif // WIN32
+                m_txq_len = 0;
+
+#ifdef HAVE_SENDMMSG
+                mmsghdr msgs[tx_batch_max];
+                iovec   iov[tx_batch_max];
+
+                memset(msgs, 0, sizeof(msgs[0]) * num);
+
+                for (i = 0; i < num; i++) {
+                        tx_entry &ent = m_txq[i];
 
-                if (m_domain == PF_INET) {
-                        sendlen = ::sendto(m_socket, msg, l, 0,
-                                           (sockaddr*)&saddr,
-                                           sizeof(sockaddr_in));
-                } else if (m_domain == PF_INET6) {
-                        sendlen = ::sendto(m_socket, msg, l, 0,
-                                           (sockaddr*)&saddr,
-                                           sizeof(sockaddr_in6));
+                        iov[i].iov_base = &ent.m_buf[0];
+                        iov[i].iov_len  = ent.m_buf.size();
+
+                        msgs[i].msg_hdr.msg_iov     = &iov[i];
+                        msgs[i].msg_hdr.msg_iovlen  = 1;
+                        msgs[i].msg_hdr.msg_name    = &ent.m_addr;
+                        msgs[i].msg_hdr.msg_namelen = ent.m_addrlen;
                 }
 
-#ifndef WIN32
-                if (sendlen < 0) {
-                        perror("sendto");
+                i = 0;
+                while (i < num) {
+                        int n = sendmmsg(m_socket, msgs + i, num - i, 0);
+
+                        if (n < 0) {
+                                // the datagram at i failed, skip it
+                                perror("sendmmsg");
+                                i++;
+                        } else {
+                                i += n;
+                        }
                 }
 #else
-                if (sendlen == SOCKET_ERROR) {
-                        perror("sendto");
+                for (i = 0; i < num; i++) {
+                        tx_entry &ent = m_txq[i];
+
+                        send_now(&ent.m_buf[0], ent.m_buf.size(),
+                                 (sockaddr*)&ent.m_addr, ent.m_addrlen);
                 }
-#endif // WIN32
+#endif // HAVE_SENDMMSG
+
+                count_flush(num);
+        }
+
+        void
+        udphandler::set_tx_queue(bool enable)
+        {
+                if (! enable)
+                        flush();
+
+                m_is_txq = enable;
+        }
+
+        void
+        udphandler::sendto(const void *msg, int len, std::string host, int port)
+        {
+                send_func func;
+
+                // the message is sent once the name is resolved
+                func.p_udp = this;
+                func.buf   = boost::shared_array<char>(new char[len]);
+                func.len   = len;
+
+                memcpy(func.buf.get(), msg, len);
+
+                m_resolver.resolve(host, port, func);
         }
 
         void
         udphandler::set_callback(udphandler::callback *func, timeval *tout)
         {
                 m_callback = func;
+
+                // kept to move the event when io_uring is given up
+                m_has_tout = (tout != NULL);
+                if (tout != NULL)
+                        m_tout = *tout;
+
 #ifdef WIN32
                 event_set(&m_event, (int)m_socket, EV_READ | EV_PERSIST,
                           udp_callback, this);
+#elif defined(HAVE_IO_URING)
+                event_set(&m_event, m_uring != NULL ?
+                                  m_uring->m_ring.get_fd() : m_socket,
+                          EV_READ | EV_PERSIST, udp_callback, this);
 #else
                 event_set(&m_event, m_socket, EV_READ | EV_PERSIST,
                           udp_callback, this);
@@ -261,25 +711,37 @@ namespace libcage {
         }
 
         bool
-        udphandler::open(int domain, int port)
+        udphandler::open_socket(SOCKET &sock, int domain, int port)
         {
-                if (m_opened)
-                        return false;
-
-                m_socket = socket(domain, SOCK_DGRAM, 0);
+                sock = socket(domain, SOCK_DGRAM, 0);
 
 #ifndef WIN32
-                if (m_socket < 0) {
+                if (sock < 0) {
                         perror("socket");
                         return false;
                 }
 #else
-                if (m_socket == INVALID_SOCKET) {
+                if (sock == INVALID_SOCKET) {
                         perror("socket");
                         return false;
                 }
 #endif // WIN32
 
+                int             optval;
+
+#ifdef HAVE_RX_THREADS
+                // all the sockets of the node share the port
+                if (m_num_rx_threads > 1) {
+                        optval = 1;
+                        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                                       &optval, sizeof(optval)) < 0) {
+                                perror("setsockopt");
+                                closesocket(sock);
+                                return false;
+                        }
+                }
+#endif // HAVE_RX_THREADS
+
                 // bind port
                 addrinfo  hints;
                 addrinfo* res = NULL;
@@ -298,40 +760,518 @@ namespace libcage {
                 err = getaddrinfo(NULL, str, &hints, &res);
                 if (err != 0) {
                         perror("getaddrinfo");
-                        closesocket(m_socket);
+                        closesocket(sock);
                         return false;
                 }
 
-                if (bind(m_socket, res->ai_addr, res->ai_addrlen) < 0) {
+                if (bind(sock, res->ai_addr, res->ai_addrlen) < 0) {
                         perror("bind");
-                        closesocket(m_socket);
+                        freeaddrinfo(res);
+                        closesocket(sock);
                         return false;
                 }
 
                 freeaddrinfo(res);
 
                 // set SO_REUSEADDR
-                int             optval;
                 optval = 1;
-                setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR,
+                setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
                            &optval, sizeof (optval));
 
+                return true;
+        }
+
+        bool
+        udphandler::open(int domain, int port)
+        {
+                if (m_opened)
+                        return false;
+
+                if (! open_socket(m_socket, domain, port))
+                        return false;
 
                 m_opened = true;
                 m_domain = domain;
 
+                m_resolver.set_domain(domain);
+
+                if (m_is_uring)
+                        start_uring();
+
+                // port 0 means an ephemeral port, which the workers share
+                if (m_num_rx_threads > 1 &&
+                    ! start_workers(domain, ntohs(get_port()))) {
+                        stop_uring();
+                        closesocket(m_socket);
+                        m_opened = false;
+                        return false;
+                }
+
                 return true;
         }
 
         void
         udphandler::close()
         {
+                flush();
                 unset_callback();
+                stop_workers();
+                stop_uring();
 
                 closesocket(m_socket);
                 m_opened = false;
         }
 
+        void
+        udphandler::set_rx_threads(int num, worker_callback *func)
+        {
+                if (m_opened)
+                        return;
+
+#ifdef HAVE_RX_THREADS
+                if (num > rx_threads_max)
+                        num = rx_threads_max;
+                else if (num < 1)
+                        num = 1;
+#else
+                num = 1;
+#endif // HAVE_RX_THREADS
+
+                m_num_rx_threads  = num;
+                m_worker_callback = func;
+        }
+
+        bool
+        udphandler::start_workers(int domain, int port)
+        {
+#ifdef HAVE_RX_THREADS
+                int i;
+
+                if (pipe(m_rxq_pipe) < 0) {
+                        perror("pipe");
+                        return false;
+                }
+
+                fcntl(m_rxq_pipe[0], F_SETFL, O_NONBLOCK);
+                fcntl(m_rxq_pipe[1], F_SETFL, O_NONBLOCK);
+
+                event_set(&m_rxq_event, m_rxq_pipe[0], EV_READ | EV_PERSIST,
+                          udp_rxq_callback, this);
+                event_add(&m_rxq_event, NULL);
+
+                m_rx_stop      = false;
+                m_rxq_notified = false;
+                m_rxq_len      = 0;
+
+                // the threads hold pointers to the elements
+                m_workers.reserve(m_num_rx_threads - 1);
+
+                for (i = 1; i < m_num_rx_threads; i++) {
+                        worker  w;
+                        timeval tval;
+
+                        w.m_udp = this;
+
+                        if (! open_socket(w.m_socket, domain, port)) {
+                                stop_workers();
+                                return false;
+                        }
+
+                        tval.tv_sec  = 0;
+                        tval.tv_usec = 100 * 1000;
+                        setsockopt(w.m_socket, SOL_SOCKET, SO_RCVTIMEO,
+                                   &tval, sizeof(tval));
+
+                        m_workers.push_back(w);
+
+                        worker &wref = m_workers.back();
+                        if (pthread_create(&wref.m_thread, NULL,
+                                           udp_worker_main, &wref) != 0) {
+                                perror("pthread_create");
+                                closesocket(wref.m_socket);
+                                m_workers.pop_back();
+                                stop_workers();
+                                return false;
+                        }
+                }
+
+                return true;
+#else
+                return false;
+#endif // HAVE_RX_THREADS
+        }
+
+        void
+        udphandler::stop_workers()
+        {
+#ifdef HAVE_RX_THREADS
+                if (m_num_rx_threads <= 1 || ! m_opened)
+                        return;
+
+                m_rx_stop = true;
+
+                for (size_t i = 0; i < m_workers.size(); i++) {
+                        pthread_join(m_workers[i].m_thread, NULL);
+                        closesocket(m_workers[i].m_socket);
+                }
+
+                m_workers.clear();
+
+                event_del(&m_rxq_event);
+                ::close(m_rxq_pipe[0]);
+                ::close(m_rxq_pipe[1]);
+
+                m_rxq_len = 0;
+#endif // HAVE_RX_THREADS
+        }
+
+        void
+        udphandler::push_rxq(const void *buf, int len, sockaddr *from,
+                             int fromlen)
+        {
+#ifdef HAVE_RX_THREADS
+                const char *p = (const char*)buf;
+                bool        wake = false;
+
+                pthread_mutex_lock(&m_rxq_mutex);
+
+                // drop when the event loop cannot keep up
+                if (m_rxq_len < rxq_max) {
+                        if (m_rxq_len == (int)m_rxq.size())
+                                m_rxq.resize(m_rxq_len + 1);
+
+                        rx_entry &ent = m_rxq[m_rxq_len];
+
+                        ent.m_buf.assign(p, p + len);
+                        memcpy(&ent.m_addr, from, fromlen);
+                        ent.m_addrlen = fromlen;
+
+                        m_rxq_len++;
+
+                        if (! m_rxq_notified) {
+                                m_rxq_notified = true;
+                                wake = true;
+                        }
+                }
+
+                pthread_mutex_unlock(&m_rxq_mutex);
+
+                if (wake) {
+                        char c = 0;
+                        if (write(m_rxq_pipe[1], &c, 1) < 0)
+                                perror("write");
+                }
+#endif // HAVE_RX_THREADS
+        }
+
+        void
+        udphandler::recv_rxq()
+        {
+#ifdef HAVE_RX_THREADS
+                int num, i;
+
+                pthread_mutex_lock(&m_rxq_mutex);
+
+                m_rxq.swap(m_rxq_work);
+                num = m_rxq_len;
+
+                m_rxq_len      = 0;
+                m_rxq_notified = false;
+
+                pthread_mutex_unlock(&m_rxq_mutex);
+
+                for (i = 0; i < num; i++) {
+                        rx_entry     &ent  = m_rxq_work[i];
+                        packetbuf_ptr pbuf = packetbuf::construct();
+                        int           len  = ent.m_buf.size();
+
+                        if (m_callback == NULL)
+                                return;
+
+                        pbuf->use_whole();
+                        if (len > pbuf->get_len())
+                                len = pbuf->get_len();
+
+                        memcpy(pbuf->get_data(), &ent.m_buf[0], len);
+                        pbuf->set_len(len);
+
+                        (*m_callback)(*this, pbuf, (sockaddr*)&ent.m_addr,
+                                      ent.m_addrlen, false);
+                }
+#endif // HAVE_RX_THREADS
+        }
+
+        bool
+        udphandler::set_io_uring(bool enable)
+        {
+                if (m_opened)
+                        return false;
+
+#ifdef HAVE_IO_URING
+                m_is_uring = enable;
+                return true;
+#else
+                return ! enable;
+#endif // HAVE_IO_URING
+        }
+
+        void
+        udphandler::start_uring()
+        {
+#ifdef HAVE_IO_URING
+                m_uring = new uring_state;
+
+                if (! m_uring->m_ring.open(uring_state::num_entries) ||
+                    ! m_uring->m_ring.setup_buf_ring(uring_state::buf_group,
+                                                     uring_state::num_bufs)) {
+                        // fall back to the event loop
+                        delete m_uring;
+                        m_uring = NULL;
+                        return;
+                }
+
+                for (int i = 0; i < uring_state::num_bufs; i++)
+                        m_uring->provide_buf(i);
+
+                arm_uring();
+                m_uring->m_ring.submit();
+
+                // kernels without multishot recvmsg (before 6.0) refuse
+                // the request at submission, so the error is queued now
+                io_uring_cqe *cqe = m_uring->m_ring.peek_cqe();
+
+                if (cqe != NULL && cqe->user_data == uring_state::recv_tag &&
+                    cqe->res < 0 && cqe->res != -ENOBUFS) {
+                        m_uring->m_ring.cqe_seen();
+                        stop_uring();
+                }
+#endif // HAVE_IO_URING
+        }
+
+        void
+        udphandler::stop_uring()
+        {
+#ifdef HAVE_IO_URING
+                if (m_uring == NULL)
+                        return;
+
+                uring_state &st = *m_uring;
+
+                // the kernel may still read the buffers of pending sends
+                st.m_ring.submit();
+                while ((int)st.m_free.size() < uring_state::num_slots) {
+                        io_uring_cqe *cqe;
+
+                        if (st.m_ring.wait(1) < 0)
+                                break;
+
+                        while ((cqe = st.m_ring.peek_cqe()) != NULL) {
+                                uint64_t data = cqe->user_data;
+
+                                st.m_ring.cqe_seen();
+
+                                if (data != uring_state::recv_tag)
+                                        st.m_free.push_back(data - 1);
+                        }
+                }
+
+                delete m_uring;
+                m_uring = NULL;
+#endif // HAVE_IO_URING
+        }
+
+        void
+        udphandler::arm_uring()
+        {
+#ifdef HAVE_IO_URING
+                io_uring_sqe *sqe = m_uring->m_ring.get_sqe();
+
+                if (sqe == NULL) {
+                        m_uring->m_ring.submit();
+                        sqe = m_uring->m_ring.get_sqe();
+                        if (sqe == NULL)
+                                return;
+                }
+
+                // one request keeps receiving until the buffers run out
+                sqe->opcode    = IORING_OP_RECVMSG;
+                sqe->fd        = m_socket;
+                sqe->addr      = (unsigned long)&m_uring->m_recv_msg;
+                sqe->len       = 1;
+                sqe->ioprio    = IORING_RECV_MULTISHOT;
+                sqe->flags     = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = uring_state::buf_group;
+                sqe->user_data = uring_state::recv_tag;
+
+                m_uring->m_is_armed = true;
+#endif // HAVE_IO_URING
+        }
+
+        void
+        udphandler::recv_uring()
+        {
+#ifdef HAVE_IO_URING
+                io_uring_cqe *cqe;
+                bool          is_failed = false;
+
+                while ((cqe = m_uring->m_ring.peek_cqe()) != NULL) {
+                        io_uring_recvmsg_out *out;
+                        sockaddr_storage      from;
+                        packetbuf_ptr         pbuf;
+                        uint64_t data  = cqe->user_data;
+                        int      res   = cqe->res;
+                        unsigned flags = cqe->flags;
+                        int      namelen, hdrlen, bid;
+
+                        m_uring->m_ring.cqe_seen();
+
+                        if (data != uring_state::recv_tag) {
+                                m_uring->m_slots[data - 1].m_pbuf = NULL;
+                                m_uring->m_free.push_back(data - 1);
+
+                                if (res < 0) {
+                                        errno = -res;
+                                        perror("sendmsg");
+                                }
+                                continue;
+                        }
+
+                        if (! (flags & IORING_CQE_F_MORE))
+                                m_uring->m_is_armed = false;
+
+                        if (res < 0) {
+                                // ENOBUFS is recovered by rearming below
+                                if (res != -ENOBUFS) {
+                                        errno = -res;
+                                        perror("recvmsg");
+                                        is_failed = true;
+                                }
+                                continue;
+                        }
+
+                        if (! (flags & IORING_CQE_F_BUFFER))
+                                continue;
+
+                        bid  = flags >> IORING_CQE_BUFFER_SHIFT;
+                        pbuf = m_uring->m_bufs[bid];
+                        m_uring->provide_buf(bid);
+
+                        out     = (io_uring_recvmsg_out*)pbuf->get_data();
+                        namelen = m_uring->m_recv_msg.msg_namelen;
+                        hdrlen  = sizeof(*out) + namelen;
+
+                        if (res < hdrlen || out->namelen > (unsigned)namelen)
+                                continue;
+
+                        memcpy(&from, out + 1, out->namelen);
+
+                        pbuf->rm_head(hdrlen);
+                        pbuf->set_len(res - hdrlen);
+
+                        if (m_callback == NULL)
+                                break;
+
+                        (*m_callback)(*this, pbuf, (sockaddr*)&from,
+                                      (int)out->namelen, false);
+
+                        // the callback may close the socket
+                        if (m_uring == NULL)
+                                return;
+                }
+
+                // rearming after other errors would fail again at once
+                if (is_failed)
+                        fallback_uring();
+                else if (! m_uring->m_is_armed)
+                        arm_uring();
+#endif // HAVE_IO_URING
+        }
+
+        void
+        udphandler::fallback_uring()
+        {
+#ifdef HAVE_IO_URING
+                event_del(&m_event);
+                stop_uring();
+
+                // receive from the socket by the event loop as without
+                // io_uring
+                event_set(&m_event, m_socket, EV_READ | EV_PERSIST,
+                          udp_callback, this);
+                event_add(&m_event, m_has_tout ? &m_tout : NULL);
+#endif // HAVE_IO_URING
+        }
+
+        bool
+        udphandler::send_uring(const void *msg, int len, const sockaddr *to,
+                               int tolen)
+        {
+#ifdef HAVE_IO_URING
+                uring_state  &st = *m_uring;
+                io_uring_sqe *sqe;
+                packetbuf_ptr pbuf;
+                int           id;
+
+                pbuf = packetbuf::construct();
+                pbuf->use_whole();
+
+                if (len > pbuf->get_len() || st.m_free.empty())
+                        return false;
+
+                sqe = st.m_ring.get_sqe();
+                if (sqe == NULL) {
+                        flush();
+                        sqe = st.m_ring.get_sqe();
+                        if (sqe == NULL)
+                                return false;
+                }
+
+                id = st.m_free.back();
+                st.m_free.pop_back();
+
+                uring_state::tx_slot &slot = st.m_slots[id];
+
+                memcpy(pbuf->get_data(), msg, len);
+                memcpy(&slot.m_addr, to, tolen);
+
+                slot.m_pbuf = pbuf;
+
+                slot.m_iov.iov_base = pbuf->get_data();
+                slot.m_iov.iov_len  = len;
+
+                memset(&slot.m_msg, 0, sizeof(slot.m_msg));
+                slot.m_msg.msg_name    = &slot.m_addr;
+                slot.m_msg.msg_namelen = tolen;
+                slot.m_msg.msg_iov     = &slot.m_iov;
+                slot.m_msg.msg_iovlen  = 1;
+
+                sqe->opcode    = IORING_OP_SENDMSG;
+                sqe->fd        = m_socket;
+                sqe->addr      = (unsigned long)&slot.m_msg;
+                sqe->len       = 1;
+                sqe->user_data = id + 1;
+
+                st.m_num_queued++;
+
+                sched_flush();
+
+                return true;
+#else
+                return false;
+#endif // HAVE_IO_URING
+        }
+
+        void
+        udphandler::worker::sendto(const void *msg, int len,
+                                   const sockaddr *to, int tolen)
+        {
+#ifndef WIN32
+                if (::sendto(m_socket, msg, len, 0, to, tolen) < 0) {
+                        perror("sendto");
+                }
+#endif // WIN32
+        }
+
         uint16_t
         udphandler::get_domain()
         {
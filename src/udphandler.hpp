@@ -34,11 +34,19 @@
 
 #include "common.hpp"
 #include "packetbuf.hpp"
+#include "resolver.hpp"
 
 #include <event.h>
 
+#ifndef WIN32
+#include <pthread.h>
+#endif // WIN32
+
 #include <set>
 #include <string>
+#include <vector>
+
+#include <boost/shared_array.hpp>
 
 #ifndef WIN32
         typedef int SOCKET;
@@ -57,6 +65,33 @@ namespace libcage {
                         virtual ~callback() {}
                 };
 
+                class worker;
+
+                // called on a receive thread for each datagram read from
+                // an additional socket. return true to hand the datagram
+                // to the callback on the thread running the event loop
+                class worker_callback {
+                public:
+                        virtual bool operator() (worker &w, const void *buf,
+                                                 int len, sockaddr *from,
+                                                 int fromlen) = 0;
+
+                        virtual ~worker_callback() {}
+                };
+
+                class worker {
+                public:
+                        // send from the socket of this worker
+                        void            sendto(const void *msg, int len,
+                                               const sockaddr *to, int tolen);
+
+                        udphandler     *m_udp;
+                        SOCKET          m_socket;
+#ifndef WIN32
+                        pthread_t       m_thread;
+#endif // WIN32
+                };
+
                 void            set_callback(callback *func);
                 void            set_callback(callback *func, timeval *tout);
                 void            unset_callback();
@@ -70,8 +105,55 @@ namespace libcage {
                 void            sendto(const void *msg, int len,
                                        std::string host, int port);
 
+                // host names are resolved on a helper thread for
+                // resolve() and sendto(), get_sockaddr() blocks.
+                // all of them share a cache of the results
                 bool            get_sockaddr(sockaddr_storage *saddr,
                                              std::string host, int port);
+                void            resolve(std::string host, int port,
+                                        resolver::callback func);
+                void            set_resolver_ttl(int ttl, int ttl_fail);
+
+                // the maximum number of datagrams read per wakeup.
+                // 1 means one recvfrom per wakeup
+                void            set_recv_batch(int num);
+
+                // bind num sockets to the port with SO_REUSEPORT. the
+                // kernel spreads incoming flows over them and every
+                // socket but the first is read by its own thread.
+                // must be called before open()
+                void            set_rx_threads(int num,
+                                               worker_callback *func = NULL);
+
+                // join the receive threads. close() and the destructor
+                // call this too
+                void            stop_workers();
+
+                // receive with multishot recvmsg into provided packetbufs
+                // and send through io_uring. must be called before open().
+                // false if libcage is built without HAVE_IO_URING. open()
+                // falls back to the event loop when the kernel lacks
+                // support
+                bool            set_io_uring(bool enable);
+
+                // queue datagrams given to sendto() and send them with one
+                // sendmmsg() when the current event callback returns.
+                // disabled by default
+                void            set_tx_queue(bool enable);
+                void            flush();
+
+                class tx_stats {
+                public:
+                        uint64_t        num_flush;
+                        uint64_t        num_dgram;
+                        int             max_batch;
+
+                        // hist[i] counts flushes of 2^i to 2^(i + 1) - 1
+                        // datagrams
+                        uint64_t        hist[8];
+                };
+
+                const tx_stats& get_tx_stats() const { return m_tx_stats; }
 
                 // network byte order
                 uint16_t        get_port();
@@ -83,17 +165,106 @@ namespace libcage {
                 static void     clean_up();
 
                 friend void     udp_callback(SOCKET fd, short event, void *arg);
+                friend void     udp_tx_callback(SOCKET fd, short event,
+                                                void *arg);
+                friend void     udp_rxq_callback(SOCKET fd, short event,
+                                                 void *arg);
+                friend void*    udp_worker_main(void *arg);
 
 
                 udphandler();
                 virtual ~udphandler();
 
         private:
+                static const int        recv_batch_max;
+                static const int        recv_batch_default;
+                static const int        tx_batch_max;
+                static const int        rx_threads_max;
+                static const int        rxq_max;
+
+                class tx_entry {
+                public:
+                        std::vector<char>       m_buf;
+                        sockaddr_storage        m_addr;
+                        int                     m_addrlen;
+                };
+
+                class send_func {
+                public:
+                        void operator() (bool result, sockaddr_storage &saddr);
+
+                        udphandler                     *p_udp;
+                        boost::shared_array<char>       buf;
+                        int                             len;
+                };
+
                 callback       *m_callback;
                 event           m_event;
+                timeval         m_tout;
+                bool            m_has_tout;
                 SOCKET          m_socket;
                 bool            m_opened;
                 int             m_domain;
+                int             m_recv_batch;
+                resolver        m_resolver;
+
+                // receive buffers reused across wakeups.
+                // slots handed to the callback are replaced by new ones
+                std::vector<packetbuf_ptr>      m_rbufs;
+
+                // entries are reused, only the first m_txq_len are pending
+                std::vector<tx_entry>   m_txq;
+                int             m_txq_len;
+                bool            m_is_txq;
+                bool            m_is_tx_sched;
+                event           m_tx_event;
+                tx_stats        m_tx_stats;
+
+                void            send_now(const void *msg, int len,
+                                         const sockaddr *to, int tolen);
+                void            sched_flush();
+                void            count_flush(int num);
+
+                // datagrams forwarded by the workers. the workers append
+                // to m_rxq, the event loop swaps it with m_rxq_work
+                typedef tx_entry        rx_entry;
+
+                int                     m_num_rx_threads;
+                worker_callback        *m_worker_callback;
+                std::vector<worker>     m_workers;
+                std::vector<rx_entry>   m_rxq;
+                std::vector<rx_entry>   m_rxq_work;
+                int                     m_rxq_len;
+                bool                    m_rxq_notified;
+                volatile bool           m_rx_stop;
+                SOCKET                  m_rxq_pipe[2];
+                event                   m_rxq_event;
+#ifndef WIN32
+                pthread_mutex_t         m_rxq_mutex;
+#endif // WIN32
+
+                bool            open_socket(SOCKET &sock, int domain,
+                                            int port);
+                bool            start_workers(int domain, int port);
+                void            push_rxq(const void *buf, int len,
+                                         sockaddr *from, int fromlen);
+                void            recv_rxq();
+
+                class uring_state;
+
+                bool            m_is_uring;
+                uring_state    *m_uring;
+
+                void            start_uring();
+                void            stop_uring();
+                void            arm_uring();
+                void            recv_uring();
+                void            fallback_uring();
+                bool            send_uring(const void *msg, int len,
+                                           const sockaddr *to, int tolen);
+
+                void            recv_one(SOCKET fd);
+                void            recv_batch(SOCKET fd);
 
 #ifdef DEBUG
         public:
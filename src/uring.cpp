@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2009, Yuuki Takano (ytakanoster@gmail.com).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the writers nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "uring.hpp"
+
+#ifdef HAVE_IO_URING
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace libcage {
+        uring::uring() : m_fd(-1), m_sq_ptr(MAP_FAILED), m_cq_ptr(MAP_FAILED),
+                         m_sqes((io_uring_sqe*)MAP_FAILED), m_br(NULL)
+        {
+
+        }
+
+        uring::~uring()
+        {
+                close();
+        }
+
+        bool
+        uring::open(unsigned entries)
+        {
+                io_uring_params p;
+                char           *sq, *cq;
+
+                if (m_fd >= 0)
+                        return false;
+
+                memset(&p, 0, sizeof(p));
+
+                m_fd = syscall(__NR_io_uring_setup, entries, &p);
+                if (m_fd < 0) {
+                        perror("io_uring_setup");
+                        return false;
+                }
+
+                m_sq_entries = p.sq_entries;
+
+                m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+                m_cq_size = p.cq_off.cqes +
+                        p.cq_entries * sizeof(io_uring_cqe);
+
+                if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                        if (m_cq_size > m_sq_size)
+                                m_sq_size = m_cq_size;
+                        m_cq_size = 0;
+                }
+
+                m_sq_ptr = mmap(NULL, m_sq_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, m_fd,
+                                IORING_OFF_SQ_RING);
+                if (m_sq_ptr == MAP_FAILED) {
+                        perror("mmap");
+                        close();
+                        return false;
+                }
+
+                if (m_cq_size == 0) {
+                        m_cq_ptr = m_sq_ptr;
+                } else {
+                        m_cq_ptr = mmap(NULL, m_cq_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, m_fd,
+                                        IORING_OFF_CQ_RING);
+                        if (m_cq_ptr == MAP_FAILED) {
+                                perror("mmap");
+                                close();
+                                return false;
+                        }
+                }
+
+                m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+                m_sqes = (io_uring_sqe*)mmap(NULL, m_sqes_size,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, m_fd,
+                                             IORING_OFF_SQES);
+                if (m_sqes == MAP_FAILED) {
+                        perror("mmap");
+                        close();
+                        return false;
+                }
+
+                sq = (char*)m_sq_ptr;
+                cq = (char*)m_cq_ptr;
+
+                m_sq_head  = (unsigned*)(sq + p.sq_off.head);
+                m_sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+                m_sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+                m_sq_array = (unsigned*)(sq + p.sq_off.array);
+
+                m_cq_head = (unsigned*)(cq + p.cq_off.head);
+                m_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+                m_cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+                m_cqes    = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+                m_sqe_tail      = *m_sq_tail;
+                m_sqe_submitted = m_sqe_tail;
+
+                return true;
+        }
+
+        void
+        uring::close()
+        {
+                if (m_br != NULL) {
+                        munmap(m_br, m_br_size);
+                        m_br = NULL;
+                }
+
+                if (m_sqes != MAP_FAILED) {
+                        munmap(m_sqes, m_sqes_size);
+                        m_sqes = (io_uring_sqe*)MAP_FAILED;
+                }
+
+                if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+                        munmap(m_cq_ptr, m_cq_size);
+                m_cq_ptr = MAP_FAILED;
+
+                if (m_sq_ptr != MAP_FAILED) {
+                        munmap(m_sq_ptr, m_sq_size);
+                        m_sq_ptr = MAP_FAILED;
+                }
+
+                if (m_fd >= 0) {
+                        ::close(m_fd);
+                        m_fd = -1;
+                }
+        }
+
+        io_uring_sqe*
+        uring::get_sqe()
+        {
+                unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+                unsigned idx;
+
+                if (m_sqe_tail - head >= m_sq_entries)
+                        return NULL;
+
+                idx = m_sqe_tail & *m_sq_mask;
+                m_sq_array[idx] = idx;
+                m_sqe_tail++;
+
+                memset(&m_sqes[idx], 0, sizeof(m_sqes[idx]));
+
+                return &m_sqes[idx];
+        }
+
+        int
+        uring::get_num_pending() const
+        {
+                return m_sqe_tail - m_sqe_submitted;
+        }
+
+        int
+        uring::submit()
+        {
+                int num = get_num_pending();
+                int ret;
+
+                if (num == 0)
+                        return 0;
+
+                __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+
+                ret = syscall(__NR_io_uring_enter, m_fd, num, 0, 0, NULL, 0);
+                if (ret < 0) {
+                        perror("io_uring_enter");
+                        return ret;
+                }
+
+                m_sqe_submitted += ret;
+
+                return ret;
+        }
+
+        int
+        uring::wait(int num)
+        {
+                int ret;
+
+                __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+
+                ret = syscall(__NR_io_uring_enter, m_fd, get_num_pending(),
+                              num, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (ret < 0) {
+                        perror("io_uring_enter");
+                        return ret;
+                }
+
+                m_sqe_submitted += ret;
+
+                return ret;
+        }
+
+        io_uring_cqe*
+        uring::peek_cqe()
+        {
+                unsigned head = *m_cq_head;
+                unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+                if (head == tail)
+                        return NULL;
+
+                return &m_cqes[head & *m_cq_mask];
+        }
+
+        void
+        uring::cqe_seen()
+        {
+                __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+        }
+
+        bool
+        uring::setup_buf_ring(int gid, int num)
+        {
+                io_uring_buf_reg reg;
+                void            *p;
+
+                m_br_size = num * sizeof(io_uring_buf);
+
+                p = mmap(NULL, m_br_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED) {
+                        perror("mmap");
+                        return false;
+                }
+
+                memset(&reg, 0, sizeof(reg));
+
+                reg.ring_addr    = (unsigned long)p;
+                reg.ring_entries = num;
+                reg.bgid         = gid;
+
+                if (syscall(__NR_io_uring_register, m_fd,
+                            IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+                        perror("io_uring_register");
+                        munmap(p, m_br_size);
+                        return false;
+                }
+
+                m_br      = (io_uring_buf*)p;
+                m_br_mask = num - 1;
+
+                return true;
+        }
+
+        void
+        uring::add_buf(void *addr, int len, int bid)
+        {
+                uint16_t      tail = m_br[0].resv;
+                io_uring_buf *buf  = &m_br[tail & m_br_mask];
+
+                buf->addr = (unsigned long)addr;
+                buf->len  = len;
+                buf->bid  = bid;
+
+                __atomic_store_n(&m_br[0].resv, (uint16_t)(tail + 1),
+                                 __ATOMIC_RELEASE);
+        }
+}
+
+#endif // HAVE_IO_URING
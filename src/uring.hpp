@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2009, Yuuki Takano (ytakanoster@gmail.com).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the writers nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef URING_HPP
+#define URING_HPP
+
+#include "common.hpp"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+namespace libcage {
+        // a minimal io_uring on the raw system calls, so that liburing
+        // is not required. a single thread submits and reaps
+        class uring {
+        public:
+                uring();
+                virtual ~uring();
+
+                bool            open(unsigned entries);
+                void            close();
+                int             get_fd() const { return m_fd; }
+
+                // NULL when the submission queue is full
+                io_uring_sqe*   get_sqe();
+                int             get_num_pending() const;
+                int             submit();
+                int             wait(int num);
+
+                // NULL when the completion queue is empty
+                io_uring_cqe*   peek_cqe();
+                void            cqe_seen();
+
+                // ring of buffers provided to the kernel for group gid.
+                // num must be a power of 2
+                bool            setup_buf_ring(int gid, int num);
+                void            add_buf(void *addr, int len, int bid);
+
+        private:
+                int             m_fd;
+                unsigned        m_sq_entries;
+
+                void           *m_sq_ptr;
+                size_t          m_sq_size;
+                void           *m_cq_ptr;
+                size_t          m_cq_size;
+                io_uring_sqe   *m_sqes;
+                size_t          m_sqes_size;
+
+                unsigned       *m_sq_head;
+                unsigned       *m_sq_tail;
+                unsigned       *m_sq_mask;
+                unsigned       *m_sq_array;
+                unsigned        m_sqe_tail;
+                unsigned        m_sqe_submitted;
+
+                unsigned       *m_cq_head;
+                unsigned       *m_cq_tail;
+                unsigned       *m_cq_mask;
+                io_uring_cqe   *m_cqes;
+
+                // io_uring_buf_ring is not used, its flexible array is
+                // misplaced when compiled as C++. the tail of the ring
+                // overlays bufs[0].resv
+                io_uring_buf   *m_br;
+                size_t          m_br_size;
+                unsigned        m_br_mask;
+        };
+}
+
+#endif // HAVE_IO_URING
+
+#endif // URING_HPP
@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <event.h>
+
+#include <libcage/cage.hpp>
+
+
+// usage: bulk_load [put|put_ack|put_many [keys [nodes [all]]]]
+//
+// starts the nodes in this process, stores the keys from one of them by
+// put or put_many and prints keys/sec and the find_node lookups and
+// requests it took. put_ack keeps window puts in flight and sends the
+// next one when the replicas acknowledged one. a sample of the keys is
+// got from another node after that to check they were stored, or with
+// all every key by a get of its own. with more nodes than a routing
+// table holds, e.g. 1000, this checks that put_many stored each key at
+// its own closest nodes
+
+const int port       = 22000;
+const int num_sample = 100;
+const int max_wait   = 120;     // sec
+const int window     = 16;
+
+libcage::cage  *cage;
+event           ev;
+int             num_node = 50;
+int             num_key  = 10000;
+bool            is_many  = true;
+bool            is_ack   = false;
+bool            is_all   = false;
+
+int             num_sent = 0;
+int             num_done = 0;
+uint64_t        num_ack  = 0;
+uint64_t        num_replica = 0;
+uint64_t        total_usec  = 0;
+
+int             num_get   = 0;
+int             num_got   = 0;
+int             num_found = 0;
+
+std::vector<std::string> keys;
+std::vector<std::string> values;
+
+libcage::lookup_stats   stats1;
+timeval                 tval1;
+
+double
+elapsed(timeval &t1, timeval &t2)
+{
+        double diff;
+
+        diff  = t2.tv_sec - t1.tv_sec;
+        diff += t2.tv_usec / 1000000.0 - t1.tv_usec / 1000000.0;
+
+        return diff;
+}
+
+class sample_func {
+public:
+        void operator() (std::vector<libcage::dht::value_set_ptr> &result)
+        {
+                int found = 0;
+
+                for (int i = 0; i < (int)result.size(); i++) {
+                        if (result[i] && result[i]->size() > 0)
+                                found++;
+                }
+
+                std::cout << "sample: found = " << found << "/"
+                          << result.size() << std::endl;
+
+                event_loopexit(NULL);
+        }
+};
+
+void get_window();
+
+class get_func {
+public:
+        void operator() (bool result, libcage::dht::value_set_ptr vset)
+        {
+                num_got++;
+
+                if (result && vset->size() > 0)
+                        num_found++;
+
+                if (num_got < num_key) {
+                        get_window();
+                        return;
+                }
+
+                std::cout << "all: found = " << num_found << "/" << num_key
+                          << std::endl;
+
+                event_loopexit(NULL);
+        }
+};
+
+void
+get_window()
+{
+        while (num_get < num_key && num_get - num_got < window) {
+                std::string &key = keys[num_get];
+
+                num_get++;
+
+                cage[num_node - 1].get(key.data(), key.size(), get_func());
+        }
+}
+
+void
+get_sample(int fd, short event, void *arg)
+{
+        std::vector<std::string> sample;
+
+        if (is_all) {
+                get_window();
+                return;
+        }
+
+        for (int i = 0; i < num_sample && i < num_key; i++)
+                sample.push_back(keys[(i * 7919) % num_key]);
+
+        cage[num_node - 1].get_many(sample,
+                                    libcage::dht::callback_find_value_many(),
+                                    sample_func());
+}
+
+// wait for the find_node of the stores to finish
+void
+poll_stores(int fd, short event, void *arg)
+{
+        const libcage::lookup_stats &stats2 = cage[1].get_find_node_stats();
+        uint64_t lookups = stats2.num_lookup - stats1.num_lookup;
+        uint64_t found   = stats2.num_found - stats1.num_found;
+        timeval  tval2, tval;
+        double   sec;
+
+        gettimeofday(&tval2, NULL);
+        sec = elapsed(tval1, tval2);
+
+        if (found < lookups && sec < max_wait) {
+                tval.tv_sec  = 0;
+                tval.tv_usec = 10 * 1000;
+
+                evtimer_set(&ev, poll_stores, NULL);
+                evtimer_add(&ev, &tval);
+                return;
+        }
+
+        std::cout << (is_many ? "put_many" : "put")
+                  << ": keys = " << num_key
+                  << ", sec = " << sec
+                  << ", keys/sec = " << (int)(num_key / sec)
+                  << ", lookups = " << lookups
+                  << ", requests = "
+                  << stats2.num_request - stats1.num_request
+                  << std::endl;
+
+        // let the stores arrive
+        tval.tv_sec  = 10;
+        tval.tv_usec = 0;
+
+        evtimer_set(&ev, get_sample, NULL);
+        evtimer_add(&ev, &tval);
+}
+
+void put_window();
+
+class put_func {
+public:
+        void operator() (int acks, int replicas, uint64_t usec)
+        {
+                num_done++;
+                num_ack     += acks;
+                num_replica += replicas;
+                total_usec  += usec;
+
+                if (num_done < num_key) {
+                        put_window();
+                        return;
+                }
+
+                const libcage::lookup_stats &stats2 =
+                        cage[1].get_find_node_stats();
+                timeval tval2, tval;
+                double  sec;
+
+                gettimeofday(&tval2, NULL);
+                sec = elapsed(tval1, tval2);
+
+                std::cout << "put_ack: keys = " << num_key
+                          << ", sec = " << sec
+                          << ", keys/sec = " << (int)(num_key / sec)
+                          << ", acks/replicas = " << num_ack << "/"
+                          << num_replica
+                          << ", latency = " << total_usec / num_key
+                          << " usec, requests = "
+                          << stats2.num_request - stats1.num_request
+                          << std::endl;
+
+                tval.tv_sec  = 1;
+                tval.tv_usec = 0;
+
+                evtimer_set(&ev, get_sample, NULL);
+                evtimer_add(&ev, &tval);
+        }
+};
+
+void
+put_window()
+{
+        while (num_sent < num_key && num_sent - num_done < window) {
+                std::string &key = keys[num_sent];
+                std::string &val = values[num_sent];
+
+                num_sent++;
+
+                cage[1].put(key.data(), key.size(), val.data(), val.size(),
+                            3600, put_func());
+        }
+}
+
+void
+start_load(int fd, short event, void *arg)
+{
+        timeval tval;
+
+        stats1 = cage[1].get_find_node_stats();
+        gettimeofday(&tval1, NULL);
+
+        if (is_ack) {
+                put_window();
+                return;
+        }
+
+        if (is_many) {
+                cage[1].put_many(keys, values, 3600);
+        } else {
+                for (int i = 0; i < num_key; i++)
+                        cage[1].put(keys[i].data(), keys[i].size(),
+                                    values[i].data(), values[i].size(),
+                                    3600);
+        }
+
+        tval.tv_sec  = 0;
+        tval.tv_usec = 10 * 1000;
+
+        evtimer_set(&ev, poll_stores, NULL);
+        evtimer_add(&ev, &tval);
+}
+
+class join_callback
+{
+public:
+        int idx;
+
+        void operator() (bool result)
+        {
+                if (! result) {
+                        cage[idx].join("localhost", port, *this);
+                        return;
+                }
+
+                idx++;
+
+                if (idx < num_node) {
+                        if (! cage[idx].open(PF_INET, port + idx, false)) {
+                                std::cerr << "cannot open port: Port = "
+                                          << port + idx
+                                          << std::endl;
+                                exit(-1);
+                        }
+
+                        cage[idx].join("localhost", port, *this);
+                } else {
+                        timeval tval;
+
+                        std::cout << "joined: nodes = " << num_node
+                                  << std::endl;
+
+                        // let the routing tables settle
+                        tval.tv_sec  = 3;
+                        tval.tv_usec = 0;
+
+                        evtimer_set(&ev, start_load, NULL);
+                        evtimer_add(&ev, &tval);
+                }
+        }
+};
+
+int
+main(int argc, char *argv[])
+{
+        if (argc > 1) {
+                is_ack  = strcmp(argv[1], "put_ack") == 0;
+                is_many = strcmp(argv[1], "put_many") == 0;
+        }
+
+        if (argc > 2)
+                num_key = atoi(argv[2]);
+
+        if (argc > 3)
+                num_node = atoi(argv[3]);
+
+        if (argc > 4)
+                is_all = strcmp(argv[4], "all") == 0;
+
+        if (num_key <= 0 || num_node < 3) {
+                std::cerr << "usage: bulk_load [put|put_ack|put_many "
+                          << "[keys [nodes [all]]]]"
+                          << std::endl;
+                return -1;
+        }
+
+        for (int i = 0; i < num_key; i++) {
+                std::ostringstream key, value;
+
+                key   << "key-" << i;
+                value << "value-" << i;
+
+                keys.push_back(key.str());
+                values.push_back(value.str());
+        }
+
+        event_init();
+
+        cage = new libcage::cage[num_node];
+
+        // hold restore back, so that the gets find the values where
+        // the puts stored them. it would also copy every value to the
+        // other replicas right away
+        if (is_all) {
+                for (int i = 0; i < num_node; i++)
+                        cage[i].set_restore_rate(1);
+        }
+
+        if (! cage[0].open(PF_INET, port, false)) {
+                std::cerr << "cannot open port: Port = " << port
+                          << std::endl;
+                return -1;
+        }
+
+        join_callback func;
+        func.idx = 1;
+
+        if (! cage[1].open(PF_INET, port + 1, false)) {
+                std::cerr << "cannot open port: Port = " << port + 1
+                          << std::endl;
+                return -1;
+        }
+
+        cage[1].join("localhost", port, func);
+
+        event_dispatch();
+
+        return 0;
+}
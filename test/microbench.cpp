@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
+#ifdef __GLIBC__
+  #include <malloc.h>
+#endif // __GLIBC__
+
+#include <event.h>
+
+#include <libcage/peers.hpp>
+#include <libcage/rttable.hpp>
+#include <libcage/timer.hpp>
+
+
+// micro benchmarks of libcage's internals. run with the name of a section,
+// or without arguments to run all of them
+
+double
+elapsed(timeval &tval1, timeval &tval2)
+{
+        double diff;
+
+        diff  = tval2.tv_sec - tval1.tv_sec;
+        diff += tval2.tv_usec / 1000000.0 - tval1.tv_usec / 1000000.0;
+
+        return diff;
+}
+
+
+// timer: arm and cancel throughput of the timing wheel compared with the
+// former implementation, which allocated one libevent timer per callback
+
+const int num_timers = 100000;
+const int num_rounds = 10;
+
+class func_wheel : public libcage::timer::callback {
+public:
+        virtual void operator() () { }
+};
+
+// the former timer
+class timer_event {
+public:
+        class callback {
+        public:
+                virtual void    operator() () { }
+                virtual ~callback() { }
+        };
+
+        ~timer_event()
+        {
+                boost::unordered_map<callback*,
+                        boost::shared_ptr<event> >::iterator it;
+
+                for (it = m_events.begin(); it != m_events.end(); ++it) {
+                        evtimer_del(it->second.get());
+                }
+        }
+
+        void set_timer(callback *func, timeval *t)
+        {
+                typedef boost::shared_ptr<event> ev_ptr;
+                ev_ptr ev = ev_ptr(new event);
+
+                unset_timer(func);
+
+                m_events[func] = ev;
+                evtimer_set(ev.get(), timer_event_callback, func);
+                evtimer_add(ev.get(), t);
+        }
+
+        void unset_timer(callback *func)
+        {
+                if (m_events.find(func) != m_events.end()) {
+                        evtimer_del(m_events[func].get());
+                        m_events.erase(func);
+                }
+        }
+
+        static void timer_event_callback(int fd, short event, void *arg) { }
+
+private:
+        boost::unordered_map<callback*, boost::shared_ptr<event> > m_events;
+};
+
+template<typename TIMER, typename FUNC>
+void
+bench_timer_arm(const char *name, std::vector<timeval> &delays)
+{
+        TIMER           t;
+        std::vector<FUNC> funcs(num_timers);
+        timeval         tval1, tval2;
+        double          arm = 0.0, cancel = 0.0;
+
+        for (int r = 0; r < num_rounds; r++) {
+                gettimeofday(&tval1, NULL);
+
+                for (int i = 0; i < num_timers; i++)
+                        t.set_timer(&funcs[i], &delays[i]);
+
+                gettimeofday(&tval2, NULL);
+                arm += elapsed(tval1, tval2);
+
+                gettimeofday(&tval1, NULL);
+
+                for (int i = 0; i < num_timers; i++)
+                        t.unset_timer(&funcs[i]);
+
+                gettimeofday(&tval2, NULL);
+                cancel += elapsed(tval1, tval2);
+        }
+
+        std::cout << "  " << name << ": arm = "
+                  << (int)(arm * 1e9 / num_timers / num_rounds)
+                  << " ns, cancel = "
+                  << (int)(cancel * 1e9 / num_timers / num_rounds)
+                  << " ns" << std::endl;
+}
+
+template<typename TIMER, typename FUNC>
+void
+bench_timer_rearm(const char *name, std::vector<timeval> &delays)
+{
+        TIMER           t;
+        std::vector<FUNC> funcs(num_timers);
+        timeval         tval1, tval2;
+
+        for (int i = 0; i < num_timers; i++)
+                t.set_timer(&funcs[i], &delays[i]);
+
+        // re-arming an armed timer, as done for every query timeout
+        gettimeofday(&tval1, NULL);
+
+        for (int r = 0; r < num_rounds; r++) {
+                for (int i = 0; i < num_timers; i++)
+                        t.set_timer(&funcs[i], &delays[(i + r) % num_timers]);
+        }
+
+        gettimeofday(&tval2, NULL);
+
+        for (int i = 0; i < num_timers; i++)
+                t.unset_timer(&funcs[i]);
+
+        std::cout << "  " << name << ": re-arm = "
+                  << (int)(elapsed(tval1, tval2) * 1e9 / num_timers /
+                           num_rounds)
+                  << " ns" << std::endl;
+}
+
+void
+bench_timer()
+{
+        std::vector<timeval> delays(num_timers);
+
+        // the spread of timeouts used by dht and dtun, from 1 sec to 10 min
+        for (int i = 0; i < num_timers; i++) {
+                long msec = 1000 + random() % (600 * 1000);
+
+                delays[i].tv_sec  = msec / 1000;
+                delays[i].tv_usec = (msec % 1000) * 1000;
+        }
+
+        std::cout << "timer (" << num_timers << " callbacks)" << std::endl;
+
+        bench_timer_arm<timer_event, timer_event::callback>("libevent",
+                                                            delays);
+        bench_timer_arm<libcage::timer, func_wheel>("wheel", delays);
+
+        bench_timer_rearm<timer_event, timer_event::callback>("libevent",
+                                                              delays);
+        bench_timer_rearm<libcage::timer, func_wheel>("wheel", delays);
+}
+
+
+// rttable: memory per node and lookup cost of a routing table as seen in a
+// network of 1M nodes
+
+const int num_network = 1000000;
+const int num_lookups = 100000;
+const int num_find    = 20;
+
+size_t
+heap_used()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        return mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+        return mallinfo().uordblks;
+#else
+        return 0;
+#endif // __GLIBC__
+}
+
+void
+random_id(libcage::uint160_t &id)
+{
+        uint32_t buf[5];
+
+        for (int i = 0; i < 5; i++)
+                buf[i] = random();
+
+        id.from_binary(buf, sizeof(buf));
+}
+
+void
+bench_rttable()
+{
+        boost::mt19937          gen;
+        libcage::uint_dist      udist(0, ~0);
+        libcage::real_dist      rdist(0.0, 1.0);
+        libcage::rand_uint      rnd(gen, udist);
+        libcage::rand_real      drnd(gen, rdist);
+        libcage::uint160_t      id;
+        libcage::timer          t;
+        libcage::peers          p(drnd, t);
+        std::vector<libcage::uint160_t> dst(num_lookups);
+        std::vector<libcage::cageaddr>  nodes;
+        timeval                 tval1, tval2;
+        size_t                  mem1, mem2;
+
+        random_id(id);
+
+        for (int i = 0; i < num_lookups; i++)
+                random_id(dst[i]);
+
+        mem1 = heap_used();
+
+        libcage::rttable       *table = new libcage::rttable(rnd, id, t, p);
+
+        // bucket i holds the nodes whose distance has its most
+        // significant bit at i, about num_network / 2^(160 - i) of them
+        for (int i = 159; i >= 0; i--) {
+                int num = 160 - i < 31 ? num_network >> (160 - i) : 0;
+
+                if (num > 20)
+                        num = 20;
+
+                for (int j = 0; j < num; j++) {
+                        libcage::cageaddr  addr;
+                        libcage::uint160_t d;
+                        libcage::in_ptr    in(new sockaddr_in);
+
+                        random_id(d);
+
+                        d = d >> (159 - i);
+                        if (! d.get_bit(i))
+                                d.flip_bit(i);
+
+                        memset(in.get(), 0, sizeof(*in));
+                        in->sin_family = PF_INET;
+                        in->sin_port   = htons(10000 + j);
+
+                        addr.id     = libcage::id_ptr(new libcage::uint160_t);
+                        *addr.id    = id ^ d;
+                        addr.domain = libcage::domain_inet;
+                        addr.saddr  = in;
+
+                        table->add(addr);
+                }
+        }
+
+        mem2 = heap_used();
+
+        std::cout << "rttable (" << table->get_size() << " nodes)"
+                  << std::endl;
+
+        if (mem2 > mem1)
+                std::cout << "  memory = "
+                          << (mem2 - mem1) / table->get_size()
+                          << " bytes/node" << std::endl;
+
+        gettimeofday(&tval1, NULL);
+
+        for (int i = 0; i < num_lookups; i++) {
+                nodes.clear();
+                table->lookup(dst[i], num_find, nodes);
+        }
+
+        gettimeofday(&tval2, NULL);
+
+        std::cout << "  lookup(cageaddr) = "
+                  << (int)(elapsed(tval1, tval2) * 1e9 / num_lookups)
+                  << " ns" << std::endl;
+
+        std::vector<libcage::rttable::entry_view> views;
+
+        gettimeofday(&tval1, NULL);
+
+        for (int i = 0; i < num_lookups; i++) {
+                views.clear();
+                table->lookup(dst[i], num_find, views);
+        }
+
+        gettimeofday(&tval2, NULL);
+
+        std::cout << "  lookup(view) = "
+                  << (int)(elapsed(tval1, tval2) * 1e9 / num_lookups)
+                  << " ns" << std::endl;
+
+        delete table;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        std::string section;
+
+        if (argc > 1)
+                section = argv[1];
+
+        event_init();
+        srandom(1);
+
+        if (section.empty() || section == "timer")
+                bench_timer();
+
+        if (section.empty() || section == "rttable")
+                bench_rttable();
+
+        return 0;
+}
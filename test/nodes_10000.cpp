@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <iostream>
 
@@ -14,11 +15,26 @@ const int max_node = 125;
 const int port     = 20000;
 const int proc_num = 80;
 
+// usage: nodes_10000 [alpha [k [exhaustive|stall]]]
+//
+// every get prints its latency, its hops and the find_value requests it
+// sent, and every 10 gets the averages of the process. run it with
+// different parameters to compare the trade-off of lookup parallelism
+// and width
+
 libcage::cage *cage;
 event   *ev;
 int      proc = -1;
 timeval  tval1;
 int      get_key;
+int      get_node;
+
+libcage::lookup_param   param;
+libcage::lookup_stats   stats1;
+int      num_get  = 0;
+double   sum_sec  = 0.0;
+uint64_t sum_hop  = 0;
+uint64_t sum_req  = 0;
 
 // callback function for get
 void
@@ -31,9 +47,21 @@ get_func(bool result, libcage::dht::value_set_ptr vset)
         diff  = tval2.tv_sec - tval1.tv_sec;
         diff += tval2.tv_usec / 1000000.0 - tval1.tv_usec / 1000000.0;
 
+        const libcage::lookup_stats &stats2 =
+                cage[get_node].get_find_value_stats();
+        uint64_t hop = stats2.num_hop - stats1.num_hop;
+        uint64_t req = stats2.num_request - stats1.num_request;
+
+        num_get++;
+        sum_sec += diff;
+        sum_hop += hop;
+        sum_req += req;
+
         if (result) {
                 std::cout << "succeeded in getting: sec = " << diff
-                          << "[s], key = " << get_key << ", values =";
+                          << "[s], hops = " << hop
+                          << ", requests = " << req
+                          << ", key = " << get_key << ", values =";
 
                 libcage::dht::value_set::iterator it;
                 BOOST_FOREACH(const libcage::dht::value_t &val, *vset) {
@@ -42,9 +70,19 @@ get_func(bool result, libcage::dht::value_set_ptr vset)
                 std::cout << std::endl;
         } else {
                 std::cout << "failed in getting: sec = " << diff << "[s]"
+                          << ", requests = " << req
                           << ", key = " << get_key << std::endl;
         }
 
+        if (num_get % 10 == 0) {
+                std::cout << "summary: proc = " << proc
+                          << ", gets = " << num_get
+                          << ", sec = " << sum_sec / num_get
+                          << "[s], hops = " << (double)sum_hop / num_get
+                          << ", requests = " << (double)sum_req / num_get
+                          << std::endl;
+        }
+
         timeval tval;
 
         tval.tv_sec  = abs(mrand48()) % proc_num + 1;
@@ -68,6 +106,9 @@ timer_callback(int fd, short ev, void *arg)
         }
 
         // get at random
+        get_node = n;
+        stats1   = cage[n].get_find_value_stats();
+
         gettimeofday(&tval1, NULL);
         cage[n].get(&get_key, sizeof(get_key), get_func);
 }
@@ -143,12 +184,26 @@ main(int argc, char *argv[])
         int   i = 0;
         pid_t pid;
 
+        if (argc > 1)
+                param.alpha = atoi(argv[1]);
+
+        if (argc > 2)
+                param.k = atoi(argv[2]);
+
+        if (argc > 3) {
+                if (strcmp(argv[3], "stall") == 0)
+                        param.policy = libcage::lookup_stall;
+                else
+                        param.policy = libcage::lookup_exhaustive;
+        }
+
         pid = fork();
 
         if (pid == 0) {
                 event_init();
 
                 cage = new libcage::cage;
+                cage->set_lookup_param(param);
 
                 srand48(t);
 
@@ -173,6 +228,9 @@ main(int argc, char *argv[])
 
                         cage = new libcage::cage[max_node];
 
+                        for (int j = 0; j < max_node; j++)
+                                cage[j].set_lookup_param(param);
+
                         srand48(t + i + 1);
 
                         proc = i;
@@ -0,0 +1,158 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#ifdef __GLIBC__
+  #include <malloc.h>
+#endif // __GLIBC__
+
+#include <event.h>
+
+#include <libcage/cage.hpp>
+
+
+// usage: restart_bench [values [dir]]
+//
+// puts values into a node of its own which keeps them in a log in dir,
+// then stops it and starts another node on the log, and prints the time
+// it took to load the values and the memory they use. the segments of
+// the log in dir are removed first
+
+const int value_len = 32;
+
+double
+elapsed(timeval &t1, timeval &t2)
+{
+        double diff;
+
+        diff  = t2.tv_sec - t1.tv_sec;
+        diff += t2.tv_usec / 1000000.0 - t1.tv_usec / 1000000.0;
+
+        return diff;
+}
+
+// large arrays are mmapped by malloc and counted in hblkhd
+size_t
+heap_used()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        struct mallinfo2 mi = mallinfo2();
+
+        return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+        struct mallinfo mi = mallinfo();
+
+        return mi.uordblks + mi.hblkhd;
+#else
+        return 0;
+#endif // __GLIBC__
+}
+
+void
+remove_log(const std::string &dir)
+{
+        DIR    *d = opendir(dir.c_str());
+        dirent *ent;
+
+        if (d == NULL)
+                return;
+
+        while ((ent = readdir(d)) != NULL) {
+                int len = strlen(ent->d_name);
+
+                if (len > 4 && strcmp(ent->d_name + len - 4, ".log") == 0)
+                        unlink((dir + "/" + ent->d_name).c_str());
+        }
+
+        closedir(d);
+}
+
+int
+main(int argc, char *argv[])
+{
+        int             num_value = 10000000;
+        std::string     dir       = "restart_bench.log";
+        libcage::cage  *cage;
+        timeval         tval1, tval2;
+        size_t          mem1, mem2;
+
+        if (argc > 1)
+                num_value = atoi(argv[1]);
+
+        if (argc > 2)
+                dir = argv[2];
+
+        if (num_value <= 0) {
+                std::cerr << "usage: restart_bench [values [dir]]"
+                          << std::endl;
+                return -1;
+        }
+
+        event_init();
+
+        remove_log(dir);
+
+        cage = new libcage::cage;
+        if (! cage->set_store_log(dir)) {
+                std::cerr << "cannot open the log: dir = " << dir
+                          << std::endl;
+                return -1;
+        }
+
+        std::string value(value_len, 'v');
+
+        gettimeofday(&tval1, NULL);
+
+        for (int i = 0; i < num_value; i++) {
+                std::ostringstream key;
+
+                key << "key-" << i;
+
+                cage->put(key.str().data(), key.str().size(),
+                          value.data(), value.size(), 3600);
+        }
+
+        gettimeofday(&tval2, NULL);
+
+        std::cout << "put: values = " << num_value
+                  << ", values/sec = "
+                  << (int)(num_value / elapsed(tval1, tval2))
+                  << std::endl;
+
+        delete cage;
+
+        mem1 = heap_used();
+        gettimeofday(&tval1, NULL);
+
+        cage = new libcage::cage;
+        if (! cage->set_store_log(dir)) {
+                std::cerr << "cannot open the log: dir = " << dir
+                          << std::endl;
+                return -1;
+        }
+
+        gettimeofday(&tval2, NULL);
+        mem2 = heap_used();
+
+        const libcage::dht::store_stats &stats = cage->get_store_stats();
+        double sec = elapsed(tval1, tval2);
+
+        std::cout << "restart: values = " << stats.items
+                  << ", sec = " << sec
+                  << ", values/sec = " << (int)(stats.items / sec)
+                  << std::endl;
+
+        if (mem2 > mem1 && stats.items > 0)
+                std::cout << "memory = " << (mem2 - mem1) / stats.items
+                          << " bytes/value" << std::endl;
+
+        delete cage;
+
+        return 0;
+}
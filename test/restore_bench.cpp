@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <event.h>
+
+#include <libcage/cage.hpp>
+
+
+// usage: restore_bench [keys [rate [nodes [sec]]]]
+//
+// starts the nodes in this process, puts the keys from one of them and
+// prints the bytes the nodes sent to restore the stored values every
+// 10 sec for sec sec, and the most they sent in a sec. rate is the bytes
+// per second each node may send, 0 for no limit. the values are restored
+// by rdp, and without a limit the connections of all the nodes may take
+// GBs
+
+const int port      = 23000;
+const int value_len = 100;
+
+libcage::cage  *cage;
+event           ev;
+int             num_node = 20;
+int             num_key  = 10000;
+int             rate     = 5000;
+int             num_sec  = 250;
+
+int             num_tick  = 0;
+uint64_t        last_bytes = 0;
+uint64_t        sum_bytes  = 0;
+uint64_t        max_bytes  = 0;
+
+uint64_t
+restore_bytes()
+{
+        uint64_t bytes = 0;
+
+        for (int i = 0; i < num_node; i++)
+                bytes += cage[i].get_restore_stats().bytes;
+
+        return bytes;
+}
+
+void
+tick(int fd, short event, void *arg)
+{
+        uint64_t bytes = restore_bytes();
+        timeval  tval;
+
+        num_tick++;
+
+        if (bytes - last_bytes > max_bytes)
+                max_bytes = bytes - last_bytes;
+
+        sum_bytes += bytes - last_bytes;
+        last_bytes = bytes;
+
+        if (num_tick % 10 == 0) {
+                uint64_t queued = 0;
+
+                for (int i = 0; i < num_node; i++)
+                        queued += cage[i].get_restore_stats().queued;
+
+                std::cout << "sec = " << num_tick
+                          << ", bytes = " << sum_bytes
+                          << ", queued = " << queued << std::endl;
+
+                sum_bytes = 0;
+        }
+
+        if (num_tick >= num_sec) {
+                std::cout << "total = " << bytes
+                          << " bytes, max = " << max_bytes
+                          << " bytes/sec" << std::endl;
+
+                event_loopexit(NULL);
+                return;
+        }
+
+        tval.tv_sec  = 1;
+        tval.tv_usec = 0;
+
+        evtimer_set(&ev, tick, NULL);
+        evtimer_add(&ev, &tval);
+}
+
+void
+start_load(int fd, short event, void *arg)
+{
+        std::vector<std::string> keys;
+        std::vector<std::string> values;
+        timeval tval;
+
+        for (int i = 0; i < num_key; i++) {
+                std::ostringstream key;
+
+                key << "key-" << i;
+
+                keys.push_back(key.str());
+                values.push_back(std::string(value_len, 'v'));
+        }
+
+        cage[1].put_many(keys, values, 3600);
+
+        for (int i = 0; i < num_node; i++)
+                cage[i].set_restore_rate(rate);
+
+        last_bytes = restore_bytes();
+
+        tval.tv_sec  = 1;
+        tval.tv_usec = 0;
+
+        evtimer_set(&ev, tick, NULL);
+        evtimer_add(&ev, &tval);
+}
+
+class join_callback
+{
+public:
+        int idx;
+
+        void operator() (bool result)
+        {
+                if (! result) {
+                        cage[idx].join("localhost", port, *this);
+                        return;
+                }
+
+                idx++;
+
+                if (idx < num_node) {
+                        if (! cage[idx].open(PF_INET, port + idx, false)) {
+                                std::cerr << "cannot open port: Port = "
+                                          << port + idx
+                                          << std::endl;
+                                exit(-1);
+                        }
+
+                        cage[idx].join("localhost", port, *this);
+                } else {
+                        timeval tval;
+
+                        std::cout << "joined: nodes = " << num_node
+                                  << std::endl;
+
+                        // let the routing tables settle
+                        tval.tv_sec  = 3;
+                        tval.tv_usec = 0;
+
+                        evtimer_set(&ev, start_load, NULL);
+                        evtimer_add(&ev, &tval);
+                }
+        }
+};
+
+int
+main(int argc, char *argv[])
+{
+        if (argc > 1)
+                num_key = atoi(argv[1]);
+
+        if (argc > 2)
+                rate = atoi(argv[2]);
+
+        if (argc > 3)
+                num_node = atoi(argv[3]);
+
+        if (argc > 4)
+                num_sec = atoi(argv[4]);
+
+        if (num_key <= 0 || rate < 0 || num_node < 3 || num_sec <= 0) {
+                std::cerr << "usage: restore_bench [keys [rate [nodes [sec]]]]"
+                          << std::endl;
+                return -1;
+        }
+
+        event_init();
+
+        cage = new libcage::cage[num_node];
+
+        if (! cage[0].open(PF_INET, port, false)) {
+                std::cerr << "cannot open port: Port = " << port
+                          << std::endl;
+                return -1;
+        }
+
+        join_callback func;
+        func.idx = 1;
+
+        if (! cage[1].open(PF_INET, port + 1, false)) {
+                std::cerr << "cannot open port: Port = " << port + 1
+                          << std::endl;
+                return -1;
+        }
+
+        cage[1].join("localhost", port, func);
+
+        event_dispatch();
+
+        return 0;
+}
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#ifdef __GLIBC__
+  #include <malloc.h>
+#endif // __GLIBC__
+
+#include <event.h>
+
+#include <libcage/cage.hpp>
+
+
+// usage: store_bench [values [expired [limit]]]
+//
+// puts values into a node of its own, expired of them in percent with a
+// ttl of 1 sec and the rest with 1 hour, and prints the memory they use.
+// with limit in MB the node keeps the values under it by evicting them.
+// then it runs a 10 msec timer until the fast timer of the dht removed
+// the expired values, 60 to 120 sec later, and prints the longest time
+// the event loop was blocked
+
+const int tick_usec  = 10 * 1000;
+const int wait_sec   = 125;
+const int value_len  = 32;
+
+libcage::cage  *cage;
+event           ev;
+timeval         tval_start;
+timeval         tval_last;
+double          max_gap = 0.0;
+
+double
+elapsed(timeval &t1, timeval &t2)
+{
+        double diff;
+
+        diff  = t2.tv_sec - t1.tv_sec;
+        diff += t2.tv_usec / 1000000.0 - t1.tv_usec / 1000000.0;
+
+        return diff;
+}
+
+// large arrays are mmapped by malloc and counted in hblkhd
+size_t
+heap_used()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        struct mallinfo2 mi = mallinfo2();
+
+        return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+        struct mallinfo mi = mallinfo();
+
+        return mi.uordblks + mi.hblkhd;
+#else
+        return 0;
+#endif // __GLIBC__
+}
+
+void
+tick(int fd, short event, void *arg)
+{
+        timeval tval, now;
+        double  gap;
+
+        gettimeofday(&now, NULL);
+
+        gap = elapsed(tval_last, now) - tick_usec / 1000000.0;
+        if (gap > max_gap)
+                max_gap = gap;
+
+        tval_last = now;
+
+        if (elapsed(tval_start, now) > wait_sec) {
+                std::cout << "longest stall = " << (int)(max_gap * 1000)
+                          << " msec" << std::endl;
+
+                event_loopexit(NULL);
+                return;
+        }
+
+        tval.tv_sec  = 0;
+        tval.tv_usec = tick_usec;
+
+        evtimer_set(&ev, tick, NULL);
+        evtimer_add(&ev, &tval);
+}
+
+int
+main(int argc, char *argv[])
+{
+        int     num_value = 1000000;
+        int     expired   = 10;
+        int     limit     = 0;
+        timeval tval1, tval2, tval;
+        size_t  mem1, mem2;
+
+        if (argc > 1)
+                num_value = atoi(argv[1]);
+
+        if (argc > 2)
+                expired = atoi(argv[2]);
+
+        if (argc > 3)
+                limit = atoi(argv[3]);
+
+        if (num_value <= 0 || expired < 0 || expired > 100 || limit < 0) {
+                std::cerr << "usage: store_bench [values [expired [limit]]]"
+                          << std::endl;
+                return -1;
+        }
+
+        event_init();
+
+        cage = new libcage::cage;
+        cage->set_store_limit((size_t)limit * 1024 * 1024);
+
+        std::string value(value_len, 'v');
+        int num_expired = (int)((int64_t)num_value * expired / 100);
+
+        mem1 = heap_used();
+        gettimeofday(&tval1, NULL);
+
+        for (int i = 0; i < num_value; i++) {
+                std::ostringstream key;
+
+                key << "key-" << i;
+
+                cage->put(key.str().data(), key.str().size(),
+                          value.data(), value.size(),
+                          i < num_expired ? 1 : 3600);
+        }
+
+        gettimeofday(&tval2, NULL);
+        mem2 = heap_used();
+
+        std::cout << "put: values = " << num_value
+                  << ", values/sec = "
+                  << (int)(num_value / elapsed(tval1, tval2))
+                  << std::endl;
+
+        if (mem2 > mem1)
+                std::cout << "memory = " << (mem2 - mem1) / num_value
+                          << " bytes/value" << std::endl;
+
+        const libcage::dht::store_stats &stats = cage->get_store_stats();
+
+        std::cout << "stored: values = " << stats.items
+                  << ", bytes = " << stats.bytes
+                  << ", evicted = " << stats.num_evicted << std::endl;
+
+        std::cout << "waiting for the expiry of " << num_expired
+                  << " values" << std::endl;
+
+        gettimeofday(&tval_start, NULL);
+        tval_last = tval_start;
+
+        tval.tv_sec  = 0;
+        tval.tv_usec = tick_usec;
+
+        evtimer_set(&ev, tick, NULL);
+        evtimer_add(&ev, &tval);
+
+        event_dispatch();
+
+        return 0;
+}
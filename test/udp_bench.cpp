@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <iostream>
+
+#include <event.h>
+
+#include <libcage/udphandler.hpp>
+
+
+// packets per second between two udphandlers on the loopback interface,
+// for the plain event loop, recvmmsg/sendmmsg and io_uring paths
+
+const int port      = 21000;
+const int num_total = 200000;
+const int burst     = 64;
+const int window    = 128;
+const int dgram_len = 64;
+
+enum mode {
+        MODE_EVENT,
+        MODE_MMSG,
+        MODE_URING,
+};
+
+class receiver : public libcage::udphandler::callback {
+public:
+        int     m_num;
+
+        receiver() : m_num(0) { }
+
+        virtual void operator() (libcage::udphandler &udp,
+                                 libcage::packetbuf_ptr pbuf,
+                                 sockaddr *from, int fromlen,
+                                 bool is_timeout)
+        {
+                m_num++;
+
+                if (m_num == num_total)
+                        event_loopexit(NULL);
+        }
+};
+
+class sender {
+public:
+        libcage::udphandler    &m_udp;
+        receiver               &m_rcv;
+        sockaddr_storage        m_dst;
+        event                   m_event;
+        event                   m_drain;
+        int                     m_num;
+        bool                    m_is_drain;
+
+        sender(libcage::udphandler &udp, receiver &rcv)
+                : m_udp(udp), m_rcv(rcv), m_num(0), m_is_drain(false) { }
+
+        void    start();
+};
+
+void
+drain_callback(int fd, short ev, void *arg)
+{
+        event_loopexit(NULL);
+}
+
+void
+send_callback(int fd, short ev, void *arg)
+{
+        sender *s = (sender*)arg;
+        char    buf[dgram_len];
+        timeval tval;
+
+        memset(buf, 0, sizeof(buf));
+
+        // keep at most window datagrams in flight so that the socket
+        // buffer of the receiver does not overflow
+        for (int i = 0; i < burst && s->m_num < num_total &&
+                     s->m_num - s->m_rcv.m_num < window; i++) {
+                s->m_udp.sendto(buf, sizeof(buf), (sockaddr*)&s->m_dst,
+                                sizeof(sockaddr_in));
+                s->m_num++;
+        }
+
+        s->m_udp.flush();
+
+        if (s->m_num < num_total) {
+                tval.tv_sec  = 0;
+                tval.tv_usec = 0;
+                evtimer_add(&s->m_event, &tval);
+        } else {
+                // in case of losses, give up after a while
+                tval.tv_sec  = 0;
+                tval.tv_usec = 200 * 1000;
+                evtimer_add(&s->m_drain, &tval);
+                s->m_is_drain = true;
+        }
+}
+
+void
+sender::start()
+{
+        timeval tval;
+
+        tval.tv_sec  = 0;
+        tval.tv_usec = 0;
+
+        evtimer_set(&m_event, send_callback, this);
+        evtimer_set(&m_drain, drain_callback, this);
+        evtimer_add(&m_event, &tval);
+}
+
+void
+run(mode m, const char *name)
+{
+        libcage::udphandler     rx, tx;
+        receiver                func, dummy;
+        sender                  s(tx, func);
+        timeval                 tval1, tval2;
+        double                  diff;
+
+        if (m == MODE_URING &&
+            (! rx.set_io_uring(true) || ! tx.set_io_uring(true))) {
+                std::cout << name << ": not compiled in" << std::endl;
+                return;
+        }
+
+        if (m == MODE_EVENT)
+                rx.set_recv_batch(1);
+
+        if (m == MODE_MMSG)
+                tx.set_tx_queue(true);
+
+        if (! rx.open(PF_INET, port) || ! tx.open(PF_INET, port + 1)) {
+                std::cout << name << ": failed in opening" << std::endl;
+                return;
+        }
+
+        rx.set_callback(&func);
+        tx.set_callback(&dummy);
+        tx.get_sockaddr(&s.m_dst, "127.0.0.1", port);
+
+        gettimeofday(&tval1, NULL);
+
+        s.start();
+        event_dispatch();
+
+        gettimeofday(&tval2, NULL);
+
+        evtimer_del(&s.m_event);
+        evtimer_del(&s.m_drain);
+
+        diff  = tval2.tv_sec - tval1.tv_sec;
+        diff += tval2.tv_usec / 1000000.0 - tval1.tv_usec / 1000000.0;
+
+        if (func.m_num < num_total && s.m_is_drain)
+                diff -= 0.2;
+
+        std::cout << name << ": received = " << func.m_num
+                  << ", lost = " << num_total - func.m_num
+                  << ", pps = " << (int)(func.m_num / diff)
+                  << ", tx flushes = " << tx.get_tx_stats().num_flush
+                  << std::endl;
+
+        rx.close();
+        tx.close();
+}
+
+int
+main(int argc, char *argv[])
+{
+        event_init();
+
+        run(MODE_EVENT, "libevent");
+        run(MODE_MMSG,  "recvmmsg/sendmmsg");
+        run(MODE_URING, "io_uring");
+
+        return 0;
+}